@@ -0,0 +1,349 @@
+#include "app_metrics.h"
+#include "log_linear_buckets.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+extern "C" {
+
+#define _Atomic
+
+#include "caml/mlvalues.h"
+
+  CAMLprim value opsian_app_metric_register(value name, value kind, value unit);
+  CAMLprim value opsian_app_counter_add(intnat id, intnat delta);
+  CAMLprim value opsian_app_counter_add_byte(value id, value delta);
+  CAMLprim value opsian_app_gauge_set(intnat id, intnat gaugeValue);
+  CAMLprim value opsian_app_gauge_set_byte(value id, value gaugeValue);
+  CAMLprim value opsian_app_histogram_observe(intnat id, intnat observation);
+  CAMLprim value opsian_app_histogram_observe_byte(value id, value observation);
+}
+
+typedef LogLinearBuckets<3> AppBuckets;
+
+static const string APP_NAME_PREFIX = string("app.");
+
+static const size_t CELLS_PER_CACHE_LINE = 64 / sizeof(uint64_t);
+
+// The cells of a histogram shard, followed by its buckets
+static const size_t COUNT_CELL = 0;
+static const size_t SUM_CELL = 1;
+static const size_t MAX_CELL = 2;
+static const size_t FIRST_BUCKET_CELL = 3;
+
+struct AppMetric {
+    string name;
+    AppMetricKind kind;
+    MetricUnit unit;
+    int shards;
+    // Cells of a shard, rounded up to a whole number of cache lines
+    size_t shardStride;
+    uint64_t* cells;
+};
+
+// Never freed, the application can update its metrics right up until it exits
+static AppMetric* appMetrics[MAX_APP_METRICS];
+static std::atomic<int> appMetricCount(0);
+static boost::mutex registrationMutex;
+
+static std::atomic<uint32_t> nextShard(0);
+static __thread int threadShard = -1;
+
+static inline int currentShard() {
+    int shard = threadShard;
+    if (shard < 0) {
+        shard = (int) (nextShard.fetch_add(1, std::memory_order_relaxed) % APP_METRIC_SHARDS);
+        threadShard = shard;
+    }
+    return shard;
+}
+
+static inline AppMetric* appMetric(const int id) {
+    if (id < 0 || id >= MAX_APP_METRICS) {
+        return nullptr;
+    }
+
+    return __atomic_load_n(&appMetrics[id], __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t* shardCells(AppMetric* metric, const int shard) {
+    return metric->cells + shard * metric->shardStride;
+}
+
+// The name becomes a single component of the metric name, so it can't contain the '.' separator
+static string sanitizeAppMetricName(const char* name) {
+    string sanitized = name;
+    for (char& c : sanitized) {
+        if (!isalnum(c) && c != '_' && c != '-') {
+            c = '_';
+        }
+    }
+
+    if (sanitized.empty()) {
+        sanitized = "unnamed";
+    }
+
+    return APP_NAME_PREFIX + sanitized;
+}
+
+int register_app_metric(const char* name, const AppMetricKind kind, const MetricUnit unit) {
+    const string metricName = sanitizeAppMetricName(name);
+
+    boost::lock_guard<boost::mutex> guard(registrationMutex);
+
+    const int count = appMetricCount.load(std::memory_order_relaxed);
+    for (int id = 0; id < count; id++) {
+        if (appMetrics[id]->name == metricName) {
+            return appMetrics[id]->kind == kind ? id : -1;
+        }
+    }
+
+    if (count == MAX_APP_METRICS) {
+        return -1;
+    }
+
+    AppMetric* metric = new AppMetric();
+    metric->name = metricName;
+    metric->kind = kind;
+    metric->unit = unit;
+    // A gauge's value is whichever was set last, so it can't be sharded
+    metric->shards = kind == AppMetricKind::GAUGE ? 1 : APP_METRIC_SHARDS;
+    const size_t cellsPerShard =
+        kind == AppMetricKind::HISTOGRAM ? FIRST_BUCKET_CELL + AppBuckets::NUMBER_OF_BUCKETS : 1;
+    metric->shardStride =
+        ((cellsPerShard + CELLS_PER_CACHE_LINE - 1) / CELLS_PER_CACHE_LINE) * CELLS_PER_CACHE_LINE;
+
+    const size_t size = metric->shards * metric->shardStride * sizeof(uint64_t);
+    void* cells;
+    if (posix_memalign(&cells, 64, size) != 0) {
+        logError("ERROR: unable to allocate %lu bytes for application metric %s\n", size, metricName.c_str());
+        delete metric;
+        return -1;
+    }
+    memset(cells, 0, size);
+    metric->cells = (uint64_t*) cells;
+
+    __atomic_store_n(&appMetrics[count], metric, __ATOMIC_RELEASE);
+    appMetricCount.store(count + 1, std::memory_order_release);
+
+    return count;
+}
+
+void app_counter_add(const int id, const int64_t delta) {
+    AppMetric* metric = appMetric(id);
+    if (metric == nullptr || delta <= 0) {
+        return;
+    }
+
+    __atomic_fetch_add(shardCells(metric, currentShard()), (uint64_t) delta, __ATOMIC_RELAXED);
+}
+
+void app_gauge_set(const int id, const int64_t value) {
+    AppMetric* metric = appMetric(id);
+    if (metric == nullptr) {
+        return;
+    }
+
+    __atomic_store_n(metric->cells, (uint64_t) value, __ATOMIC_RELAXED);
+}
+
+void app_histogram_observe(const int id, const int64_t value) {
+    AppMetric* metric = appMetric(id);
+    if (metric == nullptr) {
+        return;
+    }
+
+    const uint64_t observation = value < 0 ? 0 : (uint64_t) value;
+    uint64_t* cells = shardCells(metric, currentShard());
+    __atomic_fetch_add(&cells[FIRST_BUCKET_CELL + AppBuckets::index(observation)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cells[COUNT_CELL], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cells[SUM_CELL], observation, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&cells[MAX_CELL], __ATOMIC_RELAXED);
+    while (observation > max &&
+           !__atomic_compare_exchange_n(
+               &cells[MAX_CELL], &max, observation, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// ---- BEGIN OCaml stubs ----
+
+// Indexed by the constructors of Opsian.metric_unit
+static const MetricUnit OCAML_METRIC_UNITS[] = {
+    MetricUnit::NONE,
+    MetricUnit::BYTES,
+    MetricUnit::MILLISECONDS,
+    MetricUnit::NANOSECONDS
+};
+
+CAMLprim value opsian_app_metric_register(value name, value kind, value unit) {
+    return Val_int(register_app_metric(
+        String_val(name),
+        (AppMetricKind) Int_val(kind),
+        OCAML_METRIC_UNITS[Int_val(unit)]));
+}
+
+CAMLprim value opsian_app_counter_add(intnat id, intnat delta) {
+    app_counter_add((int) id, delta);
+    return Val_unit;
+}
+
+CAMLprim value opsian_app_counter_add_byte(value id, value delta) {
+    return opsian_app_counter_add(Long_val(id), Long_val(delta));
+}
+
+CAMLprim value opsian_app_gauge_set(intnat id, intnat gaugeValue) {
+    app_gauge_set((int) id, gaugeValue);
+    return Val_unit;
+}
+
+CAMLprim value opsian_app_gauge_set_byte(value id, value gaugeValue) {
+    return opsian_app_gauge_set(Long_val(id), Long_val(gaugeValue));
+}
+
+CAMLprim value opsian_app_histogram_observe(intnat id, intnat observation) {
+    app_histogram_observe((int) id, observation);
+    return Val_unit;
+}
+
+CAMLprim value opsian_app_histogram_observe_byte(value id, value observation) {
+    return opsian_app_histogram_observe(Long_val(id), Long_val(observation));
+}
+
+// ---- END OCaml stubs ----
+
+AppMetricsReader::AppMetricsReader(vector<string>& disabledPrefixes)
+  : disabledPrefixes_(disabledPrefixes),
+    handles_(),
+    mergedBuckets_(AppBuckets::NUMBER_OF_BUCKETS, 0) {
+}
+
+static void recordStatistic(
+    MetricDataListener& listener,
+    MetricHandle& handle,
+    const string& name,
+    const char* suffix,
+    const MetricUnit unit,
+    const uint64_t value) {
+
+    // Only build the name the first time
+    if (handle == INVALID_METRIC_HANDLE) {
+        handle = listener.registerMetric(name + suffix, unit, MetricVariability::VARIABLE, MetricDataType::LONG);
+    }
+
+    // uint64 to int64 conversion
+    listener.recordLong(handle, (int64_t) value);
+}
+
+void AppMetricsReader::read(MetricDataListener& listener, const long timestampInMs) {
+    const int count = appMetricCount.load(std::memory_order_acquire);
+
+    while (handles_.size() < (size_t) count) {
+        Handles handles{};
+        handles.enabled = !isPrefixDisabled(appMetrics[handles_.size()]->name, disabledPrefixes_);
+        handles_.push_back(handles);
+    }
+
+    for (int id = 0; id < count; id++) {
+        Handles& handles = handles_[id];
+        if (!handles.enabled) {
+            continue;
+        }
+
+        AppMetric* metric = appMetrics[id];
+        switch (metric->kind) {
+            case AppMetricKind::COUNTER: {
+                uint64_t total = 0;
+                for (int shard = 0; shard < metric->shards; shard++) {
+                    total += __atomic_load_n(shardCells(metric, shard), __ATOMIC_RELAXED);
+                }
+                listener.record(
+                    handles.value, metric->name.c_str(), metric->unit, MetricVariability::MONOTONIC, (int64_t) total);
+                break;
+            }
+
+            case AppMetricKind::GAUGE:
+                listener.record(
+                    handles.value,
+                    metric->name.c_str(),
+                    metric->unit,
+                    MetricVariability::VARIABLE,
+                    (int64_t) __atomic_load_n(metric->cells, __ATOMIC_RELAXED));
+                break;
+
+            case AppMetricKind::HISTOGRAM:
+                readHistogram(listener, id, handles);
+                break;
+        }
+    }
+}
+
+// Takes the interval's observations out of every shard. An observation racing with this can have its count in one
+// interval and its bucket in the next, so the percentiles are ranked by the buckets actually taken.
+void AppMetricsReader::readHistogram(MetricDataListener& listener, const int id, Handles& handles) {
+    AppMetric* metric = appMetrics[id];
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    uint64_t bucketsCount = 0;
+    int minIndex = AppBuckets::NUMBER_OF_BUCKETS;
+    int maxIndex = -1;
+    for (int shard = 0; shard < metric->shards; shard++) {
+        uint64_t* cells = shardCells(metric, shard);
+        if (__atomic_load_n(&cells[COUNT_CELL], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        count += __atomic_exchange_n(&cells[COUNT_CELL], 0, __ATOMIC_RELAXED);
+        sum += __atomic_exchange_n(&cells[SUM_CELL], 0, __ATOMIC_RELAXED);
+        max = std::max(max, __atomic_exchange_n(&cells[MAX_CELL], 0, __ATOMIC_RELAXED));
+
+        uint64_t* buckets = cells + FIRST_BUCKET_CELL;
+        for (int index = 0; index < AppBuckets::NUMBER_OF_BUCKETS; index++) {
+            // Avoid dirtying the cache lines of buckets that weren't used
+            if (__atomic_load_n(&buckets[index], __ATOMIC_RELAXED) != 0) {
+                const uint64_t bucketCount = __atomic_exchange_n(&buckets[index], 0, __ATOMIC_RELAXED);
+                mergedBuckets_[index] += bucketCount;
+                bucketsCount += bucketCount;
+                minIndex = std::min(minIndex, index);
+                maxIndex = std::max(maxIndex, index);
+            }
+        }
+    }
+
+    // The count and sum are emitted even for an empty interval, like the runtime event histograms
+    const string& name = metric->name;
+    const MetricUnit unit = metric->unit;
+    recordStatistic(listener, handles.count, name, ".count", MetricUnit::EVENTS, count);
+    recordStatistic(listener, handles.sum, name, ".sum", unit, sum);
+
+    if (bucketsCount > 0) {
+        const uint64_t* buckets = mergedBuckets_.data();
+        recordStatistic(listener, handles.max, name, ".max", unit, max);
+        recordStatistic(listener, handles.p50, name, ".p50", unit,
+                        AppBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.5));
+        recordStatistic(listener, handles.p90, name, ".p90", unit,
+                        AppBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.9));
+        recordStatistic(listener, handles.p99, name, ".p99", unit,
+                        AppBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.99));
+
+        std::fill(mergedBuckets_.begin() + minIndex, mergedBuckets_.begin() + maxIndex + 1, 0);
+    }
+}
+
+void AppMetricsReader::updateEntryPrefixes(vector<string>& disabledPrefixes) {
+    disabledPrefixes_ = disabledPrefixes;
+
+    for (size_t id = 0; id < handles_.size(); id++) {
+        handles_[id].enabled = !isPrefixDisabled(appMetrics[id]->name, disabledPrefixes_);
+    }
+}
+
+const bool AppMetricsReader::hasEmittedConstantMetrics() {
+    // There are no constant metrics
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef OPSIAN_APP_METRICS_H
+#define OPSIAN_APP_METRICS_H
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "globals.h"
+#include "metric_types.h"
+
+using std::string;
+using std::vector;
+
+// Counters, gauges and histograms published by the application through the Opsian.Counter, Opsian.Gauge and
+// Opsian.Histogram OCaml modules. Updates are relaxed atomic writes into C-allocated cells, counters and histograms
+// have a cache line aligned shard per thread so that domains updating the same metric don't contend. The metrics
+// thread harvests the cells on each tick.
+
+enum class AppMetricKind {
+    COUNTER = 0,
+    GAUGE = 1,
+    HISTOGRAM = 2
+};
+
+static const int MAX_APP_METRICS = 512;
+static const int APP_METRIC_SHARDS = 8;
+
+// Registers a metric, called "app.<name>". Registering the same name and kind again returns the same id, returns -1
+// if there's no space left or the name is already registered with a different kind.
+int register_app_metric(const char* name, const AppMetricKind kind, const MetricUnit unit);
+
+// Counters only go up, negative increments are ignored
+void app_counter_add(const int id, const int64_t delta);
+
+void app_gauge_set(const int id, const int64_t value);
+
+// Negative observations are recorded as 0
+void app_histogram_observe(const int id, const int64_t value);
+
+class AppMetricsReader {
+public:
+    AppMetricsReader(vector<string>& disabledPrefixes);
+
+    void read(MetricDataListener& listener, const long timestampInMs);
+
+    void updateEntryPrefixes(vector<string>& disabledPrefixes);
+
+    const bool hasEmittedConstantMetrics();
+
+private:
+    // Handles of a metric's samples, a histogram emits all six, counters and gauges only the value
+    struct Handles {
+        bool enabled;
+        MetricHandle value;
+        MetricHandle count;
+        MetricHandle sum;
+        MetricHandle max;
+        MetricHandle p50;
+        MetricHandle p90;
+        MetricHandle p99;
+    };
+
+    vector<string> disabledPrefixes_;
+    // Indexed by metric id, grows as the application registers metrics
+    vector<Handles> handles_;
+    // The interval's buckets merged from every shard
+    vector<uint64_t> mergedBuckets_;
+
+    void readHistogram(MetricDataListener& listener, const int id, Handles& handles);
+
+    DISALLOW_COPY_AND_ASSIGN(AppMetricsReader);
+};
+
+#endif // OPSIAN_APP_METRICS_H
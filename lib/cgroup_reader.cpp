@@ -0,0 +1,370 @@
+#include "cgroup_reader.h"
+#include "data.pb.h"
+
+#include <math.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+std::atomic<uint32_t> CgroupReader::errors(0);
+
+static const int64_t NS_IN_US = 1000;
+static const int64_t MILLICORES_IN_CORE = 1000;
+
+// ---- BEGIN CGROUP DISCOVERY ----
+
+// Finds the cgroup v2 mount point and the directory of this process's cgroup within it, eg: /sys/fs/cgroup and
+// /sys/fs/cgroup/system.slice/app.service. Returns false if the process isn't in a cgroup v2 hierarchy.
+static bool find_cgroup_directory(string& mountPoint, string& directory) {
+    // A line of the form 0::/system.slice/app.service
+    ProcFile cgroupFile("/proc/self/cgroup");
+    if (!cgroupFile.read()) {
+        return false;
+    }
+
+    string cgroupPath;
+    const char* line = cgroupFile.begin();
+    const char* lineEnd;
+    while (ProcLineParser::nextLine(line, cgroupFile.end(), lineEnd)) {
+        if (lineEnd - line >= 3 && strncmp(line, "0::", 3) == 0) {
+            cgroupPath.assign(line + 3, lineEnd);
+            break;
+        }
+        line = lineEnd + 1;
+    }
+
+    if (cgroupPath.empty()) {
+        return false;
+    }
+
+    // Lines of the form: 30 23 0:26 / /sys/fs/cgroup rw,nosuid shared:4 - cgroup2 cgroup2 rw
+    // the 4th field is the root of the mount within the hierarchy and the 5th is the mount point
+    ProcFile mountInfo("/proc/self/mountinfo");
+    if (!mountInfo.read()) {
+        return false;
+    }
+
+    line = mountInfo.begin();
+    while (ProcLineParser::nextLine(line, mountInfo.end(), lineEnd)) {
+        const string entry(line, lineEnd);
+        line = lineEnd + 1;
+
+        if (entry.find(" - cgroup2 ") == string::npos) {
+            continue;
+        }
+
+        ProcLineParser parser(entry.data(), entry.data() + entry.size());
+        const char* root;
+        size_t rootLength;
+        const char* mount;
+        size_t mountLength;
+        if (!parser.skipFields(3) ||
+            !parser.nextField(root, rootLength) ||
+            !parser.nextField(mount, mountLength)) {
+            continue;
+        }
+
+        const string mountRoot(root, rootLength);
+        if (mountRoot != "/" && cgroupPath.compare(0, mountRoot.size(), mountRoot) != 0) {
+            continue;
+        }
+
+        mountPoint.assign(mount, mountLength);
+        directory = mountPoint;
+        if (mountRoot == "/") {
+            directory += cgroupPath;
+        } else {
+            directory += cgroupPath.substr(mountRoot.size());
+        }
+
+        while (directory.size() > mountPoint.size() && directory.back() == '/') {
+            directory.pop_back();
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// Parses cpu.max, of the form "max 100000" or "50000 100000", returns false if there's no quota
+static bool read_cpu_quota(ProcFile& file, int64_t& quotaInUs, int64_t& periodInUs, bool& isMalformed) {
+    isMalformed = false;
+    if (!file.read()) {
+        return false;
+    }
+
+    ProcLineParser parser(file.begin(), file.end());
+    const char* quota;
+    size_t quotaLength;
+    if (!parser.nextField(quota, quotaLength) || fieldEquals(quota, quotaLength, "max")) {
+        return false;
+    }
+
+    ProcLineParser quotaParser(quota, quota + quotaLength);
+    if (!quotaParser.nextInt64(quotaInUs) || !parser.nextInt64(periodInUs) || periodInUs <= 0) {
+        isMalformed = true;
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t effective_cpu_count() {
+    uint32_t cpuCount = get_nprocs();
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) == 0) {
+        cpuCount = CPU_COUNT(&cpuSet);
+    }
+
+    string mountPoint;
+    string directory;
+    if (!find_cgroup_directory(mountPoint, directory)) {
+        return cpuCount;
+    }
+
+    // A quota on any ancestor also limits this cgroup. The mount point is included, inside a cgroup namespace it's the
+    // container's own cgroup, whilst the host's root cgroup has no cpu.max.
+    while (directory.size() >= mountPoint.size()) {
+        ProcFile cpuMax((directory + "/cpu.max").c_str());
+        int64_t quotaInUs;
+        int64_t periodInUs;
+        bool isMalformed;
+        if (read_cpu_quota(cpuMax, quotaInUs, periodInUs, isMalformed)) {
+            const uint32_t quotaCpus = (uint32_t) ceil((double) quotaInUs / periodInUs);
+            if (quotaCpus > 0 && quotaCpus < cpuCount) {
+                cpuCount = quotaCpus;
+            }
+        }
+
+        if (directory.size() == mountPoint.size()) {
+            break;
+        }
+        directory.erase(directory.rfind('/'));
+    }
+
+    return cpuCount;
+}
+
+// ---- END CGROUP DISCOVERY ----
+
+static std::unique_ptr<ProcFile> open_cgroup_file(const string& directory, const char* name) {
+    return std::unique_ptr<ProcFile>(new ProcFile((directory + "/" + name).c_str()));
+}
+
+CgroupReader::CgroupReader(vector<string>& disabledPrefixes)
+  : cpuEnabled(false),
+    memoryEnabled(false),
+    available(false),
+    sentErrors_(),
+    cpuMax(),
+    cpuStat(),
+    cpuPressure(),
+    memoryCurrent(),
+    memoryMax(),
+    memoryPressure(),
+    handles_(),
+    hasEmittedConstantMetrics_(false) {
+
+    updateEntryPrefixes(disabledPrefixes);
+
+    string mountPoint;
+    string directory;
+    available = find_cgroup_directory(mountPoint, directory);
+    if (available) {
+        cpuMax = open_cgroup_file(directory, "cpu.max");
+        cpuStat = open_cgroup_file(directory, "cpu.stat");
+        cpuPressure = open_cgroup_file(directory, "cpu.pressure");
+        memoryCurrent = open_cgroup_file(directory, "memory.current");
+        memoryMax = open_cgroup_file(directory, "memory.max");
+        memoryPressure = open_cgroup_file(directory, "memory.pressure");
+    }
+}
+
+struct CgroupMetricDefinition {
+    const char* name;
+    MetricUnit unit;
+};
+
+// Indexed by CgroupReader::CgroupMetric, they're all variable
+static const CgroupMetricDefinition CGROUP_METRICS[] = {
+    {"cgroup.cpu.limit_millicores", MetricUnit::NONE},
+    {"cgroup.cpu.usage", MetricUnit::NANOSECONDS},
+    {"cgroup.cpu.user", MetricUnit::NANOSECONDS},
+    {"cgroup.cpu.system", MetricUnit::NANOSECONDS},
+    {"cgroup.cpu.periods", MetricUnit::EVENTS},
+    {"cgroup.cpu.throttled", MetricUnit::EVENTS},
+    {"cgroup.cpu.throttled_time", MetricUnit::NANOSECONDS},
+    {"cgroup.cpu.pressure.some", MetricUnit::NANOSECONDS},
+    {"cgroup.cpu.pressure.full", MetricUnit::NANOSECONDS},
+    {"cgroup.memory.current", MetricUnit::BYTES},
+    {"cgroup.memory.max", MetricUnit::BYTES},
+    {"cgroup.memory.pressure.some", MetricUnit::NANOSECONDS},
+    {"cgroup.memory.pressure.full", MetricUnit::NANOSECONDS}
+};
+
+void CgroupReader::record(MetricDataListener& listener, const CgroupMetric metric, const int64_t value) {
+    const CgroupMetricDefinition& definition = CGROUP_METRICS[metric];
+    listener.record(handles_[metric], definition.name, definition.unit, MetricVariability::VARIABLE, value);
+}
+
+void CgroupReader::read(MetricDataListener& listener, const long timestampInMs) {
+    if (available) {
+        if (cpuEnabled) {
+            readCpuMax(listener);
+            readCpuStat(listener);
+            readPressure(listener, *cpuPressure, CPU_PRESSURE_SOME, CPU_PRESSURE_FULL);
+        }
+
+        if (memoryEnabled) {
+            readMemory(listener);
+            readPressure(listener, *memoryPressure, MEMORY_PRESSURE_SOME, MEMORY_PRESSURE_FULL);
+        }
+    }
+
+    // There are no constant metrics
+    hasEmittedConstantMetrics_ = true;
+}
+
+void CgroupReader::readCpuMax(MetricDataListener& listener) {
+    int64_t quotaInUs;
+    int64_t periodInUs;
+    bool isMalformed;
+    if (read_cpu_quota(*cpuMax, quotaInUs, periodInUs, isMalformed)) {
+        record(listener, CPU_LIMIT_MILLICORES, (quotaInUs * MILLICORES_IN_CORE) / periodInUs);
+    } else if (isMalformed) {
+        error(listener, "Unable to parse cgroup cpu.max", CPU_MAX_PARSE_ERROR);
+    }
+}
+
+// Lines of the form: usage_usec 1234
+void CgroupReader::readCpuStat(MetricDataListener& listener) {
+    if (!cpuStat->read()) {
+        return;
+    }
+
+    const char* line = cpuStat->begin();
+    const char* end = cpuStat->end();
+    const char* lineEnd;
+    while (ProcLineParser::nextLine(line, end, lineEnd)) {
+        ProcLineParser parser(line, lineEnd);
+        const char* key;
+        size_t keyLength;
+        int64_t value;
+        if (parser.nextField(key, keyLength)) {
+            if (!parser.nextInt64(value)) {
+                error(listener,
+                      ("Unable to parse cgroup cpu.stat line: " + string(line, lineEnd)).c_str(),
+                      CPU_STAT_PARSE_ERROR);
+            } else if (fieldEquals(key, keyLength, "usage_usec")) {
+                record(listener, CPU_USAGE, value * NS_IN_US);
+            } else if (fieldEquals(key, keyLength, "user_usec")) {
+                record(listener, CPU_USER, value * NS_IN_US);
+            } else if (fieldEquals(key, keyLength, "system_usec")) {
+                record(listener, CPU_SYSTEM, value * NS_IN_US);
+            } else if (fieldEquals(key, keyLength, "nr_periods")) {
+                record(listener, CPU_PERIODS, value);
+            } else if (fieldEquals(key, keyLength, "nr_throttled")) {
+                record(listener, CPU_THROTTLED, value);
+            } else if (fieldEquals(key, keyLength, "throttled_usec")) {
+                record(listener, CPU_THROTTLED_TIME, value * NS_IN_US);
+            }
+        }
+
+        line = lineEnd + 1;
+    }
+}
+
+void CgroupReader::readMemory(MetricDataListener& listener) {
+    int64_t value;
+    if (memoryCurrent->read()) {
+        ProcLineParser parser(memoryCurrent->begin(), memoryCurrent->end());
+        if (parser.nextInt64(value)) {
+            record(listener, MEMORY_CURRENT, value);
+        } else {
+            error(listener, "Unable to parse cgroup memory.current", MEMORY_PARSE_ERROR);
+        }
+    }
+
+    // Either a number of bytes or "max" if there's no limit
+    if (memoryMax->read()) {
+        ProcLineParser parser(memoryMax->begin(), memoryMax->end());
+        if (parser.nextInt64(value)) {
+            record(listener, MEMORY_MAX, value);
+        }
+    }
+}
+
+// Lines of the form: some avg10=0.00 avg60=0.00 avg300=0.00 total=1234
+// Only the total stall time is reported, the averages can be derived from it
+void CgroupReader::readPressure(
+    MetricDataListener& listener,
+    ProcFile& file,
+    const CgroupMetric someMetric,
+    const CgroupMetric fullMetric) {
+
+    if (!file.read()) {
+        return;
+    }
+
+    const char* line = file.begin();
+    const char* end = file.end();
+    const char* lineEnd;
+    while (ProcLineParser::nextLine(line, end, lineEnd)) {
+        ProcLineParser parser(line, lineEnd);
+        const char* kind;
+        size_t kindLength;
+        const char* field;
+        size_t fieldLength;
+        if (parser.nextField(kind, kindLength)) {
+            const CgroupMetric metric = fieldEquals(kind, kindLength, "some") ? someMetric : fullMetric;
+            bool parsed = false;
+            while (parser.nextField(field, fieldLength)) {
+                if (fieldLength > 6 && strncmp(field, "total=", 6) == 0) {
+                    ProcLineParser totalParser(field + 6, field + fieldLength);
+                    int64_t totalInUs;
+                    if (totalParser.nextInt64(totalInUs)) {
+                        record(listener, metric, totalInUs * NS_IN_US);
+                        parsed = true;
+                    }
+                    break;
+                }
+            }
+
+            if (!parsed) {
+                error(listener,
+                      ("Unable to parse cgroup pressure line: " + string(line, lineEnd)).c_str(),
+                      PRESSURE_PARSE_ERROR);
+            }
+        }
+
+        line = lineEnd + 1;
+    }
+}
+
+static const string cgroupCpuName = string("cgroup.cpu");
+static const string cgroupMemoryName = string("cgroup.memory");
+
+void CgroupReader::updateEntryPrefixes(vector<string>& disabledPrefixes) {
+    cpuEnabled = !isPrefixDisabled(cgroupCpuName, disabledPrefixes);
+    memoryEnabled = !isPrefixDisabled(cgroupMemoryName, disabledPrefixes);
+}
+
+void CgroupReader::error(
+    MetricDataListener& listener, const char* payload, const Error status) {
+
+    if (sentErrors_.insert(status).second) {
+        // User-level readable error message
+        listener.recordNotification(data::NotificationCategory::USER_ERROR, "Unable to record cgroup Metrics");
+        // Detailed information for us about why the error happened.
+        listener.recordNotification(data::NotificationCategory::INFO_LOGGING, payload);
+    }
+
+    errors++;
+}
+
+const bool CgroupReader::hasEmittedConstantMetrics() {
+    return hasEmittedConstantMetrics_;
+}
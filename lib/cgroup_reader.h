@@ -0,0 +1,95 @@
+#ifndef OPSIAN_CGROUP_READER_H
+#define OPSIAN_CGROUP_READER_H
+
+#include <memory>
+#include <unordered_set>
+#include "metric_types.h"
+#include "globals.h"
+#include "proc_file.h"
+
+using std::string;
+using std::vector;
+using std::unordered_set;
+
+// The number of CPUs this process can effectively use: the affinity mask, limited by any cgroup v2 cpu.max quota
+// on the process's cgroup or its ancestors, rounded up.
+uint32_t effective_cpu_count();
+
+// Reads the limits, usage, throttling and pressure of the process's cgroup v2 cgroup, this is what matters inside
+// a container rather than the host level /proc/stat and /proc/meminfo
+class CgroupReader {
+public:
+    static std::atomic<uint32_t> errors;
+
+    CgroupReader(vector<string>& disabledPrefixes);
+
+    enum Error {
+        CPU_MAX_PARSE_ERROR,
+        CPU_STAT_PARSE_ERROR,
+        MEMORY_PARSE_ERROR,
+        PRESSURE_PARSE_ERROR,
+    };
+
+    void read(MetricDataListener& listener, const long timestampInMs);
+
+    void updateEntryPrefixes(vector<string>& disabledPrefixes);
+
+    const bool hasEmittedConstantMetrics();
+
+    void error(MetricDataListener& listener, const char* payload, const Error status);
+
+private:
+    bool cpuEnabled;
+    bool memoryEnabled;
+    // false if the process isn't in a cgroup v2 hierarchy
+    bool available;
+
+    unordered_set<Error, std::hash<int>> sentErrors_;
+
+    // Not every controller is enabled on every cgroup, so any of these files can fail to open
+    std::unique_ptr<ProcFile> cpuMax;
+    std::unique_ptr<ProcFile> cpuStat;
+    std::unique_ptr<ProcFile> cpuPressure;
+    std::unique_ptr<ProcFile> memoryCurrent;
+    std::unique_ptr<ProcFile> memoryMax;
+    std::unique_ptr<ProcFile> memoryPressure;
+
+    // See CGROUP_METRICS for their names and units
+    enum CgroupMetric {
+        CPU_LIMIT_MILLICORES,
+        CPU_USAGE,
+        CPU_USER,
+        CPU_SYSTEM,
+        CPU_PERIODS,
+        CPU_THROTTLED,
+        CPU_THROTTLED_TIME,
+        CPU_PRESSURE_SOME,
+        CPU_PRESSURE_FULL,
+        MEMORY_CURRENT,
+        MEMORY_MAX,
+        MEMORY_PRESSURE_SOME,
+        MEMORY_PRESSURE_FULL,
+        NUMBER_OF_CGROUP_METRICS
+    };
+
+    MetricHandle handles_[NUMBER_OF_CGROUP_METRICS];
+    bool hasEmittedConstantMetrics_;
+
+    void record(MetricDataListener& listener, const CgroupMetric metric, const int64_t value);
+
+    void readCpuMax(MetricDataListener& listener);
+
+    void readCpuStat(MetricDataListener& listener);
+
+    void readMemory(MetricDataListener& listener);
+
+    void readPressure(
+        MetricDataListener& listener,
+        ProcFile& file,
+        const CgroupMetric someMetric,
+        const CgroupMetric fullMetric);
+
+    DISALLOW_COPY_AND_ASSIGN(CgroupReader);
+};
+
+#endif //OPSIAN_CGROUP_READER_H
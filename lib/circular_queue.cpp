@@ -6,6 +6,7 @@ std::atomic<uint32_t> CircularQueue::allocationFailures(0);
 std::atomic<uint32_t> CircularQueue::allocationStackTraceFailures(0);
 std::atomic<uint32_t> CircularQueue::cputimeFailures(0);
 std::atomic<uint32_t> CircularQueue::wallclockFailures(0);
+std::atomic<uint32_t> CircularQueue::perfEventFailures(0);
 std::atomic<uint32_t> CircularQueue::metricFailures(0);
 
 bool CircularQueue::pushStackTrace(
@@ -51,7 +52,26 @@ bool CircularQueue::pushThread(const char *name, int threadId) {
     return true;
 }
 
-bool CircularQueue::pushAllocation(const uintptr_t allocationSize, const bool outsideTlab, VMSymbol* symbol) {
+bool CircularQueue::pushThreadExit(int threadId) {
+    size_t currentInput;
+    if (!stackQueue.acquireWrite(currentInput)) {
+        return false;
+    }
+
+    StackHolder& holder = stackQueue.get(currentInput);
+    holder.elementType = THREAD_EXIT;
+    holder.threadId = threadId;
+    stackQueue.commitWrite(holder);
+
+    return true;
+}
+
+bool CircularQueue::pushAllocation(
+    const uintptr_t allocationSize,
+    const uint32_t numberOfAllocations,
+    const bool outsideTlab,
+    const CallFrame& site) {
+
     size_t currentInput;
     if (!allocationQueue.acquireWrite(currentInput)) {
         allocationFailures++;
@@ -60,8 +80,9 @@ bool CircularQueue::pushAllocation(const uintptr_t allocationSize, const bool ou
 
     AllocationHolder& holder = allocationQueue.get(currentInput);
     holder.allocationSize = allocationSize;
+    holder.numberOfAllocations = numberOfAllocations;
     holder.outsideTlab = outsideTlab;
-    holder.symbol = symbol;
+    holder.site = site;
     allocationQueue.commitWrite(holder);
 
     return true;
@@ -158,6 +179,7 @@ void CircularQueue::write(const CallTrace& item, size_t slot, StackHolder& holde
     holder.trace.frames = fb;
     holder.trace.threadId = item.threadId;
     holder.trace.num_frames = item.num_frames;
+    holder.trace.weight = item.weight;
 }
 
 bool CircularQueue::pop(QueueListener& listener) {
@@ -195,8 +217,8 @@ bool CircularQueue::pop(QueueListener& listener) {
     if (allocationQueue.acquireRead(currentOutput)) {
         read = true;
         AllocationHolder& holder = allocationQueue.get(currentOutput);
-        listener.recordAllocation(holder.allocationSize, holder.outsideTlab, holder.symbol);
-        holder.symbol = nullptr;
+        listener.recordAllocation(
+            holder.allocationSize, holder.numberOfAllocations, holder.outsideTlab, holder.site);
         allocationQueue.commitRead(currentOutput);
     }
 
@@ -225,6 +247,11 @@ bool CircularQueue::pop(QueueListener& listener) {
                 listener.recordThread(holder.threadId, holder.name);
                 break;
             }
+
+            case THREAD_EXIT: {
+                listener.recordThreadExit(holder.threadId);
+                break;
+            }
         }
         stackQueue.commitRead(currentOutput);
     }
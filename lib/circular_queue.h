@@ -45,7 +45,11 @@ public:
     recordThread(int threadId, const string& name) = 0;
 
     virtual void
-    recordAllocation(uintptr_t allocationSize, bool outsideTlab, VMSymbol* symbol) = 0;
+    recordThreadExit(int threadId) = 0;
+
+    virtual void
+    recordAllocation(
+        uintptr_t allocationSize, uint32_t numberOfAllocations, bool outsideTlab, const CallFrame& site) = 0;
 
     virtual void
     recordNotification(data::NotificationCategory category, const string &payload, int value) = 0;
@@ -103,17 +107,22 @@ struct AllocationHolder {
     AllocationHolder() :
         is_committed(UNCOMMITTED),
         allocationSize(0),
-        outsideTlab(false) {}
+        numberOfAllocations(0),
+        outsideTlab(false),
+        site() {}
 
     std::atomic<int> is_committed;
-    VMSymbol* symbol;
     uintptr_t allocationSize;
+    uint32_t numberOfAllocations;
     bool outsideTlab;
+    // The frame of the code that allocated
+    CallFrame site;
 };
 
 enum StackElementType {
     STACK_TRACE,
-    THREAD
+    THREAD,
+    THREAD_EXIT
 };
 
 struct StackHolder {
@@ -161,6 +170,7 @@ public:
     static std::atomic<uint32_t> allocationStackTraceFailures;
     static std::atomic<uint32_t> cputimeFailures;
     static std::atomic<uint32_t> wallclockFailures;
+    static std::atomic<uint32_t> perfEventFailures;
     static std::atomic<uint32_t> metricFailures;
 
     explicit CircularQueue(int maxFrameSize) : mainQueue() {
@@ -179,7 +189,10 @@ public:
 
     bool pushThread(const char* name, int threadId);
 
-    bool pushAllocation(uintptr_t allocationSize, bool outsideTlab, VMSymbol* symbol);
+    bool pushThreadExit(int threadId);
+
+    bool pushAllocation(
+        uintptr_t allocationSize, uint32_t numberOfAllocations, bool outsideTlab, const CallFrame& site);
 
     bool pushNotification(data::NotificationCategory category, const char* payload);
     bool pushNotification(data::NotificationCategory category, const char* payload, const int value);
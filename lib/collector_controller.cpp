@@ -1,5 +1,6 @@
 #include "collector_controller.h"
 
+#include "memory_profiler.h"
 #include "network.h"
 #include "proc_scanner.h"
 
@@ -83,14 +84,21 @@ void CollectorController::startProfiling(
     bool switchProcessTimeProfilingOn,
     bool switchElapsedTimeProfilingOn) {
 
+    const bool perThreadCpuTimers = configurationOptions.cpuSamplingMode == CpuSamplingMode::THREAD;
     if (switchProcessTimeProfilingOn) {
         if (processTimeStackSampleRateMillis != DONT_CHANGE_SAMPLE_RATE)
         {
-            signalHandler_.updateProcessInterval(static_cast<int>(processTimeStackSampleRateMillis));
+            if (perThreadCpuTimers) {
+                update_cpu_timers_interval(processTimeStackSampleRateMillis);
+            } else {
+                signalHandler_.updateProcessInterval(static_cast<int>(processTimeStackSampleRateMillis));
+            }
             processTimeStackSampleIntervalMillis_ = processTimeStackSampleRateMillis;
         }
     } else if (signalHandler_.isProcessProfiling()) {
         signalHandler_.stopProcessProfiling();
+    } else if (is_cpu_timing_threads()) {
+        stop_cpu_timers();
     }
 
     if (switchElapsedTimeProfilingOn) {
@@ -102,6 +110,14 @@ void CollectorController::startProfiling(
     } else if (is_scanning_threads()) {
         stop_scanning_threads();
     }
+
+    // The perf events have no rate of their own from the collector, they're sampled at their configured periods
+    // whilst either kind of stack sampling is on
+    if (switchProcessTimeProfilingOn || switchElapsedTimeProfilingOn) {
+        start_perf_events();
+    } else if (is_counting_perf_events()) {
+        stop_perf_events();
+    }
 }
 
 void CollectorController::onSampleRate(
@@ -131,7 +147,32 @@ void CollectorController::onSampleRate(
         metrics_.disable();
     }
 
-    memoryProfilingOn_ = switchMemoryProfilingOn;
+    bool memoryProfilingStarted = false;
+    if (switchMemoryProfilingOn) {
+        memoryProfilingStarted =
+            MemoryProfiler::start(memoryProfilingStackSampleRateSamples, switchMemoryProfilingStacktraceOn);
+        if (!memoryProfilingStarted && state_ == SENT_HELLO) {
+            // Only warned on the first SampleRate of a connection, as that sends the stashed notifications
+            stashNotification(
+                data::NotificationCategory::USER_WARNING,
+                "Memory profiling requires Gc.Memprof, which is available on OCaml 4.12–4.14 and 5.3 onwards");
+        }
+    } else if (memoryProfilingOn_) {
+        MemoryProfiler::stop();
+    }
+
+    if (memoryProfilingStarted) {
+        const uint64_t pushRateMillis =
+            memoryProfilingPushRateMillis > 0 ? memoryProfilingPushRateMillis : DEFAULT_ALLOCATION_PUSH_RATE_MILLIS;
+        if (!memoryProfilingOn_ || pushRateMillis != memoryProfilingPushRateMillis_) {
+            memoryProfilingPushRateMillis_ = pushRateMillis;
+            scheduleAllocationTimer();
+        }
+    } else {
+        allocationTimer_->cancel();
+    }
+
+    memoryProfilingOn_ = memoryProfilingStarted;
     threadStateOn_ = threadStateOn;
     metricsOn_ = switchMetricsOn;
 
@@ -169,14 +210,23 @@ void CollectorController::onStart() {
             configurationOptions.prometheusElapsedSampleRate,
             true,
             true);
+
+        // There's no collector to send a SampleRate message, so metrics are always on and exported on scrape
+        vector<string> disabledMetricPrefixes;
+        metrics_.setSampleRate(metricsSampleRateMillis_);
+        metrics_.enable(disabledMetricPrefixes);
+        metricsOn_ = true;
     }
 }
 
 void CollectorController::onEnd() {
     signalHandler_.stopProcessProfiling();
-    /*if (memoryProfilingOn_) {
+    stop_cpu_timers();
+    stop_perf_events();
+    if (memoryProfilingOn_) {
         MemoryProfiler::stop();
-    }*/
+        memoryProfilingOn_ = false;
+    }
 
     onDisconnect();
 }
@@ -209,6 +259,7 @@ void CollectorController::resetAgentStatisticsCounters() {
     CircularQueue::allocationStackTraceFailures.store(0);
     CircularQueue::cputimeFailures.store(0);
     CircularQueue::wallclockFailures.store(0);
+    CircularQueue::perfEventFailures.store(0);
     CircularQueue::metricFailures.store(0);
     threadIdDenials.store(0);
     CPUDataReader::errors.store(0);
@@ -237,6 +288,11 @@ void CollectorController::onDisconnect() {
     allocationTimer_->cancel();
     agentStatisticsTimer_->cancel();
 
+    if (memoryProfilingOn_) {
+        MemoryProfiler::stop();
+        memoryProfilingOn_ = false;
+    }
+
     if (metricsOn_) {
       // Check the thread is running to avoid deadlock in the case that we're terminating and blocking the
       // main thread that owns the ocaml masterlock
@@ -384,6 +440,7 @@ void CollectorController::onAgentStatisticsTimer(const error_code &ec) {
         agentStatistics->set_allocation_enqueue_failures(CircularQueue::allocationFailures);
         agentStatistics->set_cputime_enqueue_failures(CircularQueue::cputimeFailures);
         agentStatistics->set_wallclock_enqueue_failures(CircularQueue::wallclockFailures);
+        agentStatistics->set_perf_event_enqueue_failures(CircularQueue::perfEventFailures);
         agentStatistics->set_thread_id_denials(CollectorController::threadIdDenials);
         agentStatistics->set_cpu_metric_errors(CPUDataReader::errors);
         agentStatistics->set_cpu_metric_warnings(CPUDataReader::warnings);
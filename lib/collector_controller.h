@@ -5,6 +5,7 @@
 #include "signal_handler.h"
 #include "debug_logger.h"
 
+#include <atomic>
 #include <functional>
 #include <vector>
 #include <string>
@@ -201,7 +202,8 @@ private:
 
     uint64_t memoryProfilingPushRateMillis_;
 
-    bool threadStateOn_;
+    // Read in the signal handler
+    std::atomic_bool threadStateOn_;
 
     bool memoryProfilingOn_;
 
@@ -1,16 +1,12 @@
 #include "cpudata_reader.h"
 #include "data.pb.h"
+#include "proc_scanner.h"
 
 #include <boost/format.hpp>
-#include <boost/lexical_cast.hpp>
-#include <boost/algorithm/string/constants.hpp>
-#include <boost/algorithm/string/classification.hpp>
-#include <boost/algorithm/string/split.hpp>
 #include <sys/resource.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <string>
-#include <stdexcept>
 
 static const int KILO_TO_BYTES = 1024;
 
@@ -21,180 +17,517 @@ std::atomic<uint32_t> CPUDataReader::warnings(0);
 
 static const string MEM_CORE_NAME_PREFIX = "mem.system.core.";
 static const string MEM_EXTENDED_NAME_PREFIX = "mem.system.extended.";
+static const string CPU_THREAD_NAME_PREFIX = "cpu.thread.";
 
-void addLongEntry(
-    vector<MetricListenerEntry>& entries,
-    const char* name,
-    const MetricUnit unit,
-    const MetricVariability variability,
-    const int64_t value) {
-
-    struct MetricListenerEntry entry;
+// Fields 14 and 15 of /proc/<pid>/task/<tid>/stat, counting from the state field which is the 3rd
+static const int STAT_FIELDS_BEFORE_UTIME = 11;
 
-    entry.name = string(name);
-    entry.unit = unit;
-    entry.variability = variability;
-    entry.data.type = MetricDataType::LONG;
-    entry.data.valueLong = value;
+int64_t timevalToMs(timeval ts) {
+    return (ts.tv_sec * 1000) + (ts.tv_usec / 1000);
+}
 
-    entries.push_back(entry);
+struct CpuMetricDefinition {
+    const char* name;
+    MetricUnit unit;
+    MetricVariability variability;
+};
+
+// Indexed by CPUDataReader::CpuMetric
+static const CpuMetricDefinition CPU_METRICS[] = {
+    {"cpu.process.time.user", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.process.time.system", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.process.maxrss", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"cpu.process.page_faults.soft", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.page_faults.hard", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.blocks.in", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.blocks.out", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.csw.voluntary", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.csw.involuntary", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.process.timers", MetricUnit::NONE, MetricVariability::VARIABLE},
+    {"cpu.system.user", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.nice", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.system", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.idle", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.iowait", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.irq", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.softirq", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.steal", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.guest", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.guest_nice", MetricUnit::MILLISECONDS, MetricVariability::VARIABLE},
+    {"cpu.system.pages.in", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.system.pages.out", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.system.swap.in", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.system.swap.out", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.system.csw", MetricUnit::EVENTS, MetricVariability::VARIABLE},
+    {"cpu.system.procs.running", MetricUnit::NONE, MetricVariability::VARIABLE},
+    {"cpu.system.procs.blocked", MetricUnit::NONE, MetricVariability::VARIABLE},
+    {"cpu.ncores", MetricUnit::NONE, MetricVariability::CONSTANT}
+};
+
+void CPUDataReader::record(MetricDataListener& listener, const CpuMetric metric, const int64_t value) {
+    const CpuMetricDefinition& definition = CPU_METRICS[metric];
+    listener.record(handles_[metric], definition.name, definition.unit, definition.variability, value);
 }
 
-void addLongVar(
-    vector<MetricListenerEntry>& entries,
-    const char* name,
-    const MetricUnit unit,
-    const int64_t value) {
+void CPUDataReader::read(MetricDataListener& listener, const long timestampInMs) {
+    if (cpuProcessEnabled) {
+        struct rusage usage;
 
-    addLongEntry(entries, name, unit, MetricVariability::VARIABLE, value);
-}
+        int err = getrusage(RUSAGE_SELF, &usage);
 
-int64_t timevalToMs(timeval ts) {
-    return (ts.tv_sec * 1000) + (ts.tv_usec / 1000);
-}
+        if (!err) {
+            record(listener, PROCESS_TIME_USER, timevalToMs(usage.ru_utime));
+            record(listener, PROCESS_TIME_SYSTEM, timevalToMs(usage.ru_stime));
+            record(listener, PROCESS_MAXRSS, usage.ru_maxrss * KILO_TO_BYTES);
+            record(listener, PROCESS_PAGE_FAULTS_SOFT, usage.ru_minflt);
+            record(listener, PROCESS_PAGE_FAULTS_HARD, usage.ru_majflt);
+            record(listener, PROCESS_BLOCKS_IN, usage.ru_inblock);
+            record(listener, PROCESS_BLOCKS_OUT, usage.ru_oublock);
+            record(listener, PROCESS_CSW_VOLUNTARY, usage.ru_nvcsw);
+            record(listener, PROCESS_CSW_INVOLUNTARY, usage.ru_nivcsw);
+        } else {
+            error(listener, (boost::format("Got getrusage error of %d") % err).str().c_str(), RUSAGE_FAILURE);
+        }
 
-#define ticksAt(X) (boost::lexical_cast<int64_t>(result.at(X)) * 1000) / clockTicksPerSecond
-#define int64At(X) boost::lexical_cast<int64_t>(result.at(X))
-#define kbAt(X) boost::lexical_cast<int64_t>(result.at(X)) * KILO_TO_BYTES
+        // The profiler's per-thread timers, scanned on this thread
+        record(listener, PROCESS_TIMERS, live_timer_count());
+    }
 
-void CPUDataReader::read(MetricDataListener& listener, const long timestampInMs) {
-    vector<MetricListenerEntry> entries;
+    if ((cpuSystemEnabled || cpuThreadEnabled) && !readClockTicksPerSecond) {
+        clockTicksPerSecond = sysconf(_SC_CLK_TCK);
+        readClockTicksPerSecond = true;
+    }
+
+    if (cpuSystemEnabled) {
+        readProcStat(listener);
+    }
+
+    if (memCoreEnabled) {
+        readProcMemInfo(listener);
+    }
+
+    if (cpuThreadEnabled) {
+        readThreads(listener);
+    }
 
     if (cpuNCoresEnabled && !readNCores) {
         // So technically this could change with for example virtual machines, etc.
         int ncores = get_nprocs();
 
-        addLongEntry(entries, "cpu.ncores", MetricUnit::NONE, MetricVariability::CONSTANT, ncores);
+        record(listener, NCORES, ncores);
 
         readNCores = true;
     }
 
-    if (cpuProcessEnabled) {
-        struct rusage usage;
+    // Always get emitted on the first run
+    if (!hasEmittedConstantMetrics_) {
+        hasEmittedConstantMetrics_ = true;
+    }
+}
 
-        int err = getrusage(RUSAGE_SELF, &usage);
+void CPUDataReader::readProcStat(MetricDataListener& listener) {
+    if (!procStat.read()) {
+        if (procStat.hasOpenError()) {
+            error(listener, procStat.getError().c_str(), PROC_STAT_FILE_ERROR);
+        }
+        return;
+    }
 
-        if (!err) {
-            addLongVar(entries, "cpu.process.time.user", MetricUnit::MILLISECONDS, timevalToMs(usage.ru_utime));
-            addLongVar(entries, "cpu.process.time.system", MetricUnit::MILLISECONDS, timevalToMs(usage.ru_stime));
-            addLongVar(entries, "cpu.process.maxrss", MetricUnit::BYTES, usage.ru_maxrss * KILO_TO_BYTES);
-            addLongVar(entries, "cpu.process.page_faults.soft", MetricUnit::EVENTS, usage.ru_minflt);
-            addLongVar(entries, "cpu.process.page_faults.hard", MetricUnit::EVENTS, usage.ru_majflt);
-            addLongVar(entries, "cpu.process.blocks.in", MetricUnit::EVENTS, usage.ru_inblock);
-            addLongVar(entries, "cpu.process.blocks.out", MetricUnit::EVENTS, usage.ru_oublock);
-            addLongVar(entries, "cpu.process.csw.voluntary", MetricUnit::EVENTS, usage.ru_nvcsw);
-            addLongVar(entries, "cpu.process.csw.involuntary", MetricUnit::EVENTS, usage.ru_nivcsw);
-        } else {
-            error(listener, (boost::format("Got getrusage error of %d") % err).str().c_str(), RUSAGE_FAILURE);
+    const char* line = procStat.begin();
+    const char* end = procStat.end();
+    const char* lineEnd;
+    while (ProcLineParser::nextLine(line, end, lineEnd)) {
+        ProcLineParser parser(line, lineEnd);
+        const char* key;
+        size_t keyLength;
+        if (parser.nextField(key, keyLength) && !readProcStatLine(listener, parser, key, keyLength)) {
+            error(listener,
+                  ("Unable to parse /proc/stat line: " + string(line, lineEnd)).c_str(),
+                  PROC_STAT_PARSE_ERROR);
         }
+
+        line = lineEnd + 1;
     }
+}
 
-    if (cpuSystemEnabled) {
-        if (!readClockTicksPerSecond) {
-            clockTicksPerSecond = sysconf(_SC_CLK_TCK);
-            readClockTicksPerSecond = true;
-        }
-
-        if (procStat.reset()) {
-            string line;
-            vector<string> result;
-
-            while (getline(procStat.file, line)) {
-                result.clear();
-                boost::split(result, line, boost::is_any_of(" "), boost::algorithm::token_compress_on);
-
-                try {
-                    if (result.at(0) == "cpu") {
-                        addLongVar(entries, "cpu.system.user", MetricUnit::MILLISECONDS, ticksAt(1));
-                        addLongVar(entries, "cpu.system.nice", MetricUnit::MILLISECONDS, ticksAt(2));
-                        addLongVar(entries, "cpu.system.system", MetricUnit::MILLISECONDS, ticksAt(3));
-                        addLongVar(entries, "cpu.system.idle", MetricUnit::MILLISECONDS, ticksAt(4));
-                        addLongVar(entries, "cpu.system.iowait", MetricUnit::MILLISECONDS, ticksAt(5));
-                        addLongVar(entries, "cpu.system.irq", MetricUnit::MILLISECONDS, ticksAt(6));
-                        addLongVar(entries, "cpu.system.softirq", MetricUnit::MILLISECONDS, ticksAt(7));
-                        addLongVar(entries, "cpu.system.steal", MetricUnit::MILLISECONDS, ticksAt(8));
-                        addLongVar(entries, "cpu.system.guest", MetricUnit::MILLISECONDS, ticksAt(9));
-                        addLongVar(entries, "cpu.system.guest_nice", MetricUnit::MILLISECONDS, ticksAt(10));
-                    } else if (result.at(0) == "page") {
-                        addLongVar(entries, "cpu.system.pages.in", MetricUnit::EVENTS, int64At(1));
-                        addLongVar(entries, "cpu.system.pages.out", MetricUnit::EVENTS, int64At(2));
-                    } else if (result.at(0) == "swap") {
-                        addLongVar(entries, "cpu.system.swap.in", MetricUnit::EVENTS, int64At(1));
-                        addLongVar(entries, "cpu.system.swap.out", MetricUnit::EVENTS, int64At(2));
-                    } else if (result.at(0) == "ctxt") {
-                        addLongVar(entries, "cpu.system.csw", MetricUnit::EVENTS, int64At(1));
-                    } else if (result.at(0) == "procs_running") {
-                        addLongVar(entries, "cpu.system.procs.running", MetricUnit::NONE, int64At(1));
-                    } else if (result.at(0) == "procs_blocked") {
-                        addLongVar(entries, "cpu.system.procs.blocked", MetricUnit::NONE, int64At(1));
-                    }
-                }
-                catch (const boost::bad_lexical_cast& ex) {
-                    error(listener,
-                          (boost::format("Got bad_lexical_cast exception while parsing /proc/stat: %s") % ex.what()).str().c_str(),
-                          PROC_STAT_PARSE_ERROR);
-                    continue;
-                }
-                catch (const std::out_of_range& oor) {
-                    continue; // This can happen in really old kernels. Older than even Redhat support.
-                }
+bool CPUDataReader::readProcStatLine(
+    MetricDataListener& listener,
+    ProcLineParser& parser,
+    const char* key,
+    const size_t keyLength) {
+
+    int64_t first;
+    int64_t second;
+
+    if (fieldEquals(key, keyLength, "cpu")) {
+        for (int metric = SYSTEM_USER; metric <= SYSTEM_GUEST_NICE; metric++) {
+            int64_t ticks;
+            if (!parser.nextInt64(ticks)) {
+                // This can happen in really old kernels. Older than even Redhat support.
+                break;
             }
-        } else if (procStat.hasOpenError()) {
-            error(listener, procStat.getError().c_str(), PROC_STAT_FILE_ERROR);
+
+            record(listener, (CpuMetric) metric, (ticks * 1000) / clockTicksPerSecond);
         }
+    } else if (fieldEquals(key, keyLength, "page")) {
+        if (!parser.nextInt64(first) || !parser.nextInt64(second)) {
+            return false;
+        }
+        record(listener, SYSTEM_PAGES_IN, first);
+        record(listener, SYSTEM_PAGES_OUT, second);
+    } else if (fieldEquals(key, keyLength, "swap")) {
+        if (!parser.nextInt64(first) || !parser.nextInt64(second)) {
+            return false;
+        }
+        record(listener, SYSTEM_SWAP_IN, first);
+        record(listener, SYSTEM_SWAP_OUT, second);
+    } else if (fieldEquals(key, keyLength, "ctxt")) {
+        if (!parser.nextInt64(first)) {
+            return false;
+        }
+        record(listener, SYSTEM_CSW, first);
+    } else if (fieldEquals(key, keyLength, "procs_running")) {
+        if (!parser.nextInt64(first)) {
+            return false;
+        }
+        record(listener, SYSTEM_PROCS_RUNNING, first);
+    } else if (fieldEquals(key, keyLength, "procs_blocked")) {
+        if (!parser.nextInt64(first)) {
+            return false;
+        }
+        record(listener, SYSTEM_PROCS_BLOCKED, first);
     }
 
-    if (memCoreEnabled) {
-        if (procMemInfo.reset()) {
-            string line;
-            vector<string> result;
-
-            while (getline(procMemInfo.file, line)) {
-                result.clear();
-                boost::split(result, line, boost::is_any_of(" "), boost::algorithm::token_compress_on);
-
-                try {
-                    string& entryName = result.at(0);
-                    const bool isCoreMetric = procMemNames.count(entryName) == 1;
-                    if (memExtendedEnabled || isCoreMetric) {
-                        entryName.erase(entryName.size() - 1);
-                        const string& prefix = isCoreMetric ? MEM_CORE_NAME_PREFIX : MEM_EXTENDED_NAME_PREFIX;
-                        string name = prefix + entryName;
-                        // Entries either end in kB for kilobytes or nothing
-                        if (result.size() > 2) {
-                            addLongVar(entries, name.c_str(), MetricUnit::BYTES, kbAt(1));
-                        } else {
-                            addLongVar(entries, name.c_str(), MetricUnit::NONE, int64At(1));
-                        }
-                    }
-                }
-                catch (const boost::bad_lexical_cast& ex) {
+    return true;
+}
+
+CPUDataReader::MemInfoField& CPUDataReader::memInfoField(
+    const size_t lineNumber,
+    const char* key,
+    const size_t keyLength) {
+
+    if (lineNumber == memInfoFields_.size()) {
+        memInfoFields_.emplace_back();
+    }
+
+    MemInfoField& field = memInfoFields_[lineNumber];
+    if (field.key.size() != keyLength || field.key.compare(0, keyLength, key, keyLength) != 0) {
+        // First read, or the kernel's layout differs from the last read
+        field.key.assign(key, keyLength);
+        field.handle = INVALID_METRIC_HANDLE;
+        const bool isCoreMetric = procMemNames.count(field.key) == 1;
+        field.enabled = memExtendedEnabled || isCoreMetric;
+        if (field.enabled) {
+            const string& prefix = isCoreMetric ? MEM_CORE_NAME_PREFIX : MEM_EXTENDED_NAME_PREFIX;
+            // Drop the trailing ':'
+            field.name = prefix + field.key.substr(0, keyLength - 1);
+        }
+    }
+
+    return field;
+}
+
+void CPUDataReader::readProcMemInfo(MetricDataListener& listener) {
+    if (!procMemInfo.read()) {
+        if (procMemInfo.hasOpenError()) {
+            error(listener, procMemInfo.getError().c_str(), PROC_MEMINFO_FILE_ERROR);
+        }
+        return;
+    }
+
+    const char* line = procMemInfo.begin();
+    const char* end = procMemInfo.end();
+    const char* lineEnd;
+    size_t lineNumber = 0;
+    while (ProcLineParser::nextLine(line, end, lineEnd)) {
+        ProcLineParser parser(line, lineEnd);
+        const char* key;
+        size_t keyLength;
+        if (parser.nextField(key, keyLength)) {
+            MemInfoField& field = memInfoField(lineNumber, key, keyLength);
+            lineNumber++;
+            if (field.enabled) {
+                int64_t value;
+                const char* unit;
+                size_t unitLength;
+                if (!parser.nextInt64(value)) {
                     error(listener,
-                          (boost::format("Got bad_lexical_cast exception while parsing /proc/meminfo: %s") %
-                           ex.what()).str().c_str(),
+                          ("Unable to parse /proc/meminfo line: " + string(line, lineEnd)).c_str(),
                           PROC_MEMINFO_PARSE_ERROR);
-                    continue;
-                }
-                catch (const std::out_of_range& oor) {
-                    continue; // This can happen in really old kernels. Older than even Redhat support.
+                } else if (parser.nextField(unit, unitLength)) {
+                    // Entries either end in kB for kilobytes or nothing
+                    listener.record(
+                        field.handle,
+                        field.name.c_str(),
+                        MetricUnit::BYTES,
+                        MetricVariability::VARIABLE,
+                        value * KILO_TO_BYTES);
+                } else {
+                    listener.record(
+                        field.handle, field.name.c_str(), MetricUnit::NONE, MetricVariability::VARIABLE, value);
                 }
             }
-        } else if (procMemInfo.hasOpenError()) {
-            error(listener, procMemInfo.getError().c_str(), PROC_MEMINFO_FILE_ERROR);
         }
+
+        line = lineEnd + 1;
     }
+}
+
+CPUDataReader::ThreadTotals::ThreadTotals(const string& threadName)
+  : userTimeName(CPU_THREAD_NAME_PREFIX + threadName + ".time.user"),
+    systemTimeName(CPU_THREAD_NAME_PREFIX + threadName + ".time.system"),
+    onCpuName(CPU_THREAD_NAME_PREFIX + threadName + ".sched.on_cpu"),
+    runQueueWaitName(CPU_THREAD_NAME_PREFIX + threadName + ".sched.runqueue_wait"),
+    voluntaryCswName(CPU_THREAD_NAME_PREFIX + threadName + ".csw.voluntary"),
+    involuntaryCswName(CPU_THREAD_NAME_PREFIX + threadName + ".csw.involuntary"),
+    userTimeHandle(INVALID_METRIC_HANDLE),
+    systemTimeHandle(INVALID_METRIC_HANDLE),
+    onCpuHandle(INVALID_METRIC_HANDLE),
+    runQueueWaitHandle(INVALID_METRIC_HANDLE),
+    voluntaryCswHandle(INVALID_METRIC_HANDLE),
+    involuntaryCswHandle(INVALID_METRIC_HANDLE),
+    exited(),
+    live(),
+    hasSchedstat(false),
+    seen(false) {
+}
+
+CPUDataReader::ThreadCounters::ThreadCounters()
+  : userTimeInTicks(0),
+    systemTimeInTicks(0),
+    onCpuInNs(0),
+    runQueueWaitInNs(0),
+    voluntaryCsw(0),
+    involuntaryCsw(0) {
+}
+
+void CPUDataReader::ThreadCounters::add(const ThreadCounters& other) {
+    userTimeInTicks += other.userTimeInTicks;
+    systemTimeInTicks += other.systemTimeInTicks;
+    onCpuInNs += other.onCpuInNs;
+    runQueueWaitInNs += other.runQueueWaitInNs;
+    voluntaryCsw += other.voluntaryCsw;
+    involuntaryCsw += other.involuntaryCsw;
+}
 
-    if (!entries.empty()) {
-        listener.recordEntries(entries, timestampInMs);
+bool CPUDataReader::ThreadCounters::isBefore(const ThreadCounters& other) const {
+    return userTimeInTicks < other.userTimeInTicks ||
+        systemTimeInTicks < other.systemTimeInTicks ||
+        onCpuInNs < other.onCpuInNs ||
+        runQueueWaitInNs < other.runQueueWaitInNs ||
+        voluntaryCsw < other.voluntaryCsw ||
+        involuntaryCsw < other.involuntaryCsw;
+}
+
+// Thread names become a component of the metric name, so they can't contain the '.' separator
+static void sanitizeThreadName(string& name) {
+    for (char& c : name) {
+        if (!isalnum(c) && c != '_' && c != '-') {
+            c = '_';
+        }
     }
 
-    // Always get emitted on the first run
-    if (!hasEmittedConstantMetrics_) {
-        hasEmittedConstantMetrics_ = true;
+    if (name.empty()) {
+        name = "unnamed";
+    }
+}
+
+// The thread metrics are all totals since the threads started, see ThreadTotals
+static void recordThreadCounter(
+    MetricDataListener& listener,
+    MetricHandle& handle,
+    const string& name,
+    const MetricUnit unit,
+    const int64_t value) {
+
+    listener.record(handle, name.c_str(), unit, MetricVariability::MONOTONIC, value);
+}
+
+CPUDataReader::ThreadTotals& CPUDataReader::threadTotals(const string& threadName) {
+    auto it = threadTotals_.find(threadName);
+    if (it == threadTotals_.end()) {
+        it = threadTotals_.insert({threadName, ThreadTotals(threadName)}).first;
     }
+    return it->second;
+}
+
+// The work a thread did between its last read and exiting is lost, but its totals never go backwards
+void CPUDataReader::recordExitedThread(const ThreadState& state) {
+    threadTotals(state.name).exited.add(state.counters);
+}
+
+void CPUDataReader::readThreads(MetricDataListener& listener) {
+    for (auto& it : threadTotals_) {
+        it.second.live = ThreadCounters();
+        it.second.seen = false;
+    }
+
+    const std::unordered_set<pid_t>& threads = scanned_threads();
+    for (auto it = threadStates_.begin(); it != threadStates_.end();) {
+        if (threads.count(it->first) == 0) {
+            recordExitedThread(it->second);
+            it = threadStates_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    string threadName;
+    ThreadCounters counters;
+    for (const pid_t tid : threads) {
+        bool hasSchedstat = false;
+        auto stateIt = threadStates_.find(tid);
+        if (!readThread(tid, threadName, counters, hasSchedstat)) {
+            // It exited whilst being read
+            if (stateIt != threadStates_.end()) {
+                recordExitedThread(stateIt->second);
+                threadStates_.erase(stateIt);
+            }
+            continue;
+        }
+
+        if (stateIt == threadStates_.end()) {
+            stateIt = threadStates_.insert({tid, ThreadState()}).first;
+        } else if (stateIt->second.name != threadName || counters.isBefore(stateIt->second.counters)) {
+            // A renamed thread's counters so far stay with its old name
+            recordExitedThread(stateIt->second);
+        }
+
+        ThreadState& state = stateIt->second;
+        state.name = threadName;
+        state.counters = counters;
+
+        ThreadTotals& totals = threadTotals(threadName);
+        totals.live.add(counters);
+        totals.hasSchedstat |= hasSchedstat;
+        totals.seen = true;
+    }
+
+    ThreadCounters sum;
+    for (auto& it : threadTotals_) {
+        ThreadTotals& totals = it.second;
+        if (!totals.seen) {
+            continue;
+        }
+
+        sum = totals.exited;
+        sum.add(totals.live);
+        recordThreadCounter(
+            listener,
+            totals.userTimeHandle,
+            totals.userTimeName,
+            MetricUnit::MILLISECONDS,
+            (sum.userTimeInTicks * 1000) / clockTicksPerSecond);
+        recordThreadCounter(
+            listener,
+            totals.systemTimeHandle,
+            totals.systemTimeName,
+            MetricUnit::MILLISECONDS,
+            (sum.systemTimeInTicks * 1000) / clockTicksPerSecond);
+        if (totals.hasSchedstat) {
+            recordThreadCounter(
+                listener, totals.onCpuHandle, totals.onCpuName, MetricUnit::NANOSECONDS, sum.onCpuInNs);
+            recordThreadCounter(
+                listener,
+                totals.runQueueWaitHandle,
+                totals.runQueueWaitName,
+                MetricUnit::NANOSECONDS,
+                sum.runQueueWaitInNs);
+        }
+        recordThreadCounter(
+            listener, totals.voluntaryCswHandle, totals.voluntaryCswName, MetricUnit::EVENTS, sum.voluntaryCsw);
+        recordThreadCounter(
+            listener,
+            totals.involuntaryCswHandle,
+            totals.involuntaryCswName,
+            MetricUnit::EVENTS,
+            sum.involuntaryCsw);
+    }
+}
+
+// threadPath_ holds the thread's directory, up to directoryLength, the file's name is appended after it
+bool CPUDataReader::readThreadFile(ProcFile& file, const size_t directoryLength, const char* name) {
+    threadPath_.resize(directoryLength);
+    threadPath_ += name;
+    return file.read(threadPath_.c_str());
+}
+
+// A thread can exit at any point whilst we read its files, in which case false is returned without reporting an error
+bool CPUDataReader::readThread(
+    const pid_t tid,
+    string& threadName,
+    ThreadCounters& counters,
+    bool& hasSchedstat) {
+
+    threadPath_ = "/proc/self/task/";
+    threadPath_ += std::to_string(tid);
+    threadPath_ += '/';
+    const size_t directoryLength = threadPath_.size();
+    if (!readThreadFile(threadComm_, directoryLength, "comm") ||
+        !readThreadFile(threadStat_, directoryLength, "stat") ||
+        !readThreadFile(threadStatus_, directoryLength, "status")) {
+        return false;
+    }
+
+    // comm ends in a newline
+    const char* nameEnd = (const char*) memchr(threadComm_.begin(), '\n', threadComm_.end() - threadComm_.begin());
+    threadName.assign(threadComm_.begin(), nameEnd != nullptr ? nameEnd : threadComm_.end());
+    sanitizeThreadName(threadName);
+
+    // The comm field of stat is in parentheses and can contain spaces, so parse from the last ')'
+    const char* statBegin = threadStat_.begin();
+    const char* commEnd = (const char*) memrchr(statBegin, ')', threadStat_.end() - statBegin);
+    if (commEnd == nullptr) {
+        return false;
+    }
+
+    ProcLineParser statParser(commEnd + 1, threadStat_.end());
+    int64_t utimeInTicks;
+    int64_t stimeInTicks;
+    if (!statParser.skipFields(STAT_FIELDS_BEFORE_UTIME) ||
+        !statParser.nextInt64(utimeInTicks) ||
+        !statParser.nextInt64(stimeInTicks)) {
+        return false;
+    }
+
+    counters = ThreadCounters();
+    counters.userTimeInTicks = utimeInTicks;
+    counters.systemTimeInTicks = stimeInTicks;
+    const char* line = threadStatus_.begin();
+    const char* end = threadStatus_.end();
+    const char* lineEnd;
+    while (ProcLineParser::nextLine(line, end, lineEnd)) {
+        ProcLineParser parser(line, lineEnd);
+        const char* key;
+        size_t keyLength;
+        if (parser.nextField(key, keyLength)) {
+            if (fieldEquals(key, keyLength, "voluntary_ctxt_switches:")) {
+                parser.nextInt64(counters.voluntaryCsw);
+            } else if (fieldEquals(key, keyLength, "nonvoluntary_ctxt_switches:")) {
+                parser.nextInt64(counters.involuntaryCsw);
+            }
+        }
+
+        line = lineEnd + 1;
+    }
+
+    // schedstat is only present on kernels built with CONFIG_SCHED_INFO, it's: on cpu ns, run queue wait ns, slices
+    if (readThreadFile(threadSchedstat_, directoryLength, "schedstat")) {
+        ProcLineParser schedParser(threadSchedstat_.begin(), threadSchedstat_.end());
+        int64_t onCpuInNs;
+        int64_t runQueueWaitInNs;
+        if (schedParser.nextInt64(onCpuInNs) && schedParser.nextInt64(runQueueWaitInNs)) {
+            counters.onCpuInNs = onCpuInNs;
+            counters.runQueueWaitInNs = runQueueWaitInNs;
+            hasSchedstat = true;
+        }
+    }
+
+    return true;
 }
 
 static const string cpuProcessName = string("cpu.process");
+static const string cpuThreadName = string("cpu.thread");
 static const string cpuSystemName = string("cpu.system");
 static const string cpuNCoresName = string("cpu.ncores");
 static const string memCoreName = string("mem.system.core");
@@ -202,10 +535,18 @@ static const string memExtendedName = string("mem.system.extended");
 
 void CPUDataReader::updateEntryPrefixes(vector<string>& disabledPrefixes) {
     cpuProcessEnabled = !isPrefixDisabled(cpuProcessName, disabledPrefixes);
+    cpuThreadEnabled = !isPrefixDisabled(cpuThreadName, disabledPrefixes);
+    set_thread_list_required(cpuThreadEnabled);
     cpuSystemEnabled = !isPrefixDisabled(cpuSystemName, disabledPrefixes);
     cpuNCoresEnabled = !isPrefixDisabled(cpuNCoresName, disabledPrefixes);
     memCoreEnabled = !isPrefixDisabled(memCoreName, disabledPrefixes);
     memExtendedEnabled = !isPrefixDisabled(memExtendedName, disabledPrefixes);
+    // Which fields are enabled depends on memExtendedEnabled
+    memInfoFields_.clear();
+}
+
+CPUDataReader::~CPUDataReader() {
+    set_thread_list_required(false);
 }
 
 void CPUDataReader::error(
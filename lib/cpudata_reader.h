@@ -1,54 +1,18 @@
 #ifndef CPUDATA_READER_H
 #define CPUDATA_READER_H
 
+#include <map>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
 #include "metric_types.h"
 #include "globals.h"
+#include "proc_file.h"
 
 using std::string;
 using std::vector;
 using std::unordered_set;
-
-class SeekableFile {
-public:
-    SeekableFile(const char* name)
-      : file(name, std::ifstream::in),
-        readable(file.good()),
-        openError(!readable),
-        error(readable ? "" : strerror(errno)) {
-    }
-
-    bool reset() {
-        if (readable) {
-            // getline() will set the badbit when it reaches eof so we need to clear them
-            file.clear();
-            // seek to the beginning of the file
-            file.seekg(0);
-        }
-
-        return readable;
-    }
-
-    bool hasOpenError() {
-        if (openError) {
-            openError = false;
-            return true;
-        }
-
-        return false;
-    }
-
-    string& getError() {
-        return error;
-    }
-
-    std::ifstream file;
-
-private:
-    bool readable;
-    bool openError;
-    string error;
-};
+using std::unordered_map;
 
 class CPUDataReader {
 public:
@@ -57,6 +21,7 @@ public:
 
     CPUDataReader(vector<string>& disabledPrefixes)
       : cpuProcessEnabled(false),
+        cpuThreadEnabled(false),
         cpuSystemEnabled(false),
         cpuNCoresEnabled(false),
         memCoreEnabled(false),
@@ -68,6 +33,15 @@ public:
         procMemNames(),
         procMemInfo("/proc/meminfo"),
         procStat("/proc/stat"),
+        memInfoFields_(),
+        handles_(),
+        threadPath_(),
+        threadComm_(),
+        threadStat_(),
+        threadSchedstat_(),
+        threadStatus_(),
+        threadStates_(),
+        threadTotals_(),
         hasEmittedConstantMetrics_(false)  {
 
         updateEntryPrefixes(disabledPrefixes);
@@ -90,6 +64,8 @@ public:
         PROC_MEMINFO_PARSE_ERROR,
     };
 
+    ~CPUDataReader();
+
     void read(MetricDataListener& listener, const long timestampInMs);
 
     void updateEntryPrefixes(vector<string>& disabledPrefixes);
@@ -100,6 +76,7 @@ public:
 
 private:
     bool cpuProcessEnabled;
+    bool cpuThreadEnabled;
     bool cpuSystemEnabled;
     bool cpuNCoresEnabled;
     bool memCoreEnabled;
@@ -110,11 +87,143 @@ private:
     unordered_set<Error, std::hash<int>> sentErrors_;
     int64_t clockTicksPerSecond;
 
+    // A line of /proc/meminfo, the lines are in the same order on every read so they're cached by line number
+    struct MemInfoField {
+        // eg: MemTotal:
+        string key;
+        bool enabled;
+        // eg: mem.system.core.MemTotal
+        string name;
+        MetricHandle handle;
+    };
+
     unordered_set<string> procMemNames;
-    SeekableFile procMemInfo;
-    SeekableFile procStat;
+    ProcFile procMemInfo;
+    ProcFile procStat;
+    vector<MemInfoField> memInfoFields_;
+
+    // The metrics whose names are fixed, see CPU_METRICS for their names and units
+    enum CpuMetric {
+        PROCESS_TIME_USER,
+        PROCESS_TIME_SYSTEM,
+        PROCESS_MAXRSS,
+        PROCESS_PAGE_FAULTS_SOFT,
+        PROCESS_PAGE_FAULTS_HARD,
+        PROCESS_BLOCKS_IN,
+        PROCESS_BLOCKS_OUT,
+        PROCESS_CSW_VOLUNTARY,
+        PROCESS_CSW_INVOLUNTARY,
+        PROCESS_TIMERS,
+        // The columns of the cpu line of /proc/stat, in order
+        SYSTEM_USER,
+        SYSTEM_NICE,
+        SYSTEM_SYSTEM,
+        SYSTEM_IDLE,
+        SYSTEM_IOWAIT,
+        SYSTEM_IRQ,
+        SYSTEM_SOFTIRQ,
+        SYSTEM_STEAL,
+        SYSTEM_GUEST,
+        SYSTEM_GUEST_NICE,
+        SYSTEM_PAGES_IN,
+        SYSTEM_PAGES_OUT,
+        SYSTEM_SWAP_IN,
+        SYSTEM_SWAP_OUT,
+        SYSTEM_CSW,
+        SYSTEM_PROCS_RUNNING,
+        SYSTEM_PROCS_BLOCKED,
+        NCORES,
+        NUMBER_OF_CPU_METRICS
+    };
+
+    MetricHandle handles_[NUMBER_OF_CPU_METRICS];
+
+    // A thread's counters over its lifetime, or the sum of several threads'
+    struct ThreadCounters {
+        ThreadCounters();
+
+        int64_t userTimeInTicks;
+        int64_t systemTimeInTicks;
+        int64_t onCpuInNs;
+        int64_t runQueueWaitInNs;
+        int64_t voluntaryCsw;
+        int64_t involuntaryCsw;
+
+        void add(const ThreadCounters& other);
+
+        // A thread's counters only go backwards if its tid has been reused by a new thread
+        bool isBefore(const ThreadCounters& other) const;
+    };
+
+    // The last read of a live thread
+    struct ThreadState {
+        string name;
+        ThreadCounters counters;
+    };
+
+    // Threads are aggregated by name, since thread ids aren't stable across restarts or thread pools. Each total is
+    // the lifetime counters of the live threads with the name plus the last read counters of those that have exited,
+    // so it's monotonic as pool threads come and go.
+    struct ThreadTotals {
+        explicit ThreadTotals(const string& threadName);
+
+        string userTimeName;
+        string systemTimeName;
+        string onCpuName;
+        string runQueueWaitName;
+        string voluntaryCswName;
+        string involuntaryCswName;
+
+        MetricHandle userTimeHandle;
+        MetricHandle systemTimeHandle;
+        MetricHandle onCpuHandle;
+        MetricHandle runQueueWaitHandle;
+        MetricHandle voluntaryCswHandle;
+        MetricHandle involuntaryCswHandle;
+
+        ThreadCounters exited;
+        // Reset on each tick
+        ThreadCounters live;
+        bool hasSchedstat;
+        bool seen;
+    };
+
+    // The /proc/self/task/<tid> files are opened by path on each read, rather than kept open, so that the application's
+    // threads don't use up its descriptors. The buffers are shared by every thread.
+    string threadPath_;
+    ProcFile threadComm_;
+    ProcFile threadStat_;
+    ProcFile threadSchedstat_;
+    ProcFile threadStatus_;
+    unordered_map<pid_t, ThreadState> threadStates_;
+    // Kept after the name's threads have exited, in case the name comes back
+    std::map<string, ThreadTotals> threadTotals_;
     bool hasEmittedConstantMetrics_;
 
+    void record(MetricDataListener& listener, const CpuMetric metric, const int64_t value);
+
+    void readProcStat(MetricDataListener& listener);
+
+    bool readProcStatLine(
+        MetricDataListener& listener,
+        ProcLineParser& parser,
+        const char* key,
+        const size_t keyLength);
+
+    void readProcMemInfo(MetricDataListener& listener);
+
+    MemInfoField& memInfoField(const size_t lineNumber, const char* key, const size_t keyLength);
+
+    void readThreads(MetricDataListener& listener);
+
+    bool readThreadFile(ProcFile& file, const size_t directoryLength, const char* name);
+
+    bool readThread(const pid_t tid, string& threadName, ThreadCounters& counters, bool& hasSchedstat);
+
+    ThreadTotals& threadTotals(const string& threadName);
+
+    void recordExitedThread(const ThreadState& state);
+
     DISALLOW_COPY_AND_ASSIGN(CPUDataReader);
 };
 
@@ -15,9 +15,10 @@ static const string VERSION_PARAM_NAME = string("ocaml.version");
 // or not:
 
 bool has_runtime_events();
-// true if enabling succeeded
+// true if enabling succeeded, starts the consumer thread that polls events into the interval's aggregates
 bool enable_runtime_events(const bool wasEnabled, const bool enable);
-uint32_t read_runtime_events(MetricDataListener& listener);
+// Emits the aggregates of the interval since the last flush
+void flush_runtime_events(MetricDataListener& listener, const long timestampInMs);
 void disable_runtime_events();
 
 EventRingReader::EventRingReader(vector<string>& disabledPrefixes)
@@ -41,32 +42,19 @@ void EventRingReader::disable() {
     }
 }
 
-uint32_t EventRingReader::read(MetricDataListener& listener, const long timestampInMs) {
-    uint32_t events = 0;
-    if (enabled_) {
-        if (!hasEmittedConstantMetrics_) {
-            emitConstantMetrics(listener, timestampInMs);
-            events++;
-
-            hasEmittedConstantMetrics_ = true;
-        }
+void EventRingReader::read(MetricDataListener& listener, const long timestampInMs) {
+    if (enabled_ && !hasEmittedConstantMetrics_) {
+        emitConstantMetrics(listener, timestampInMs);
 
-        events += read_runtime_events(listener);
+        hasEmittedConstantMetrics_ = true;
     }
-
-    return events;
 }
 
 void EventRingReader::emitConstantMetrics(MetricDataListener &listener, const long timestampInMs) const {
-    vector<MetricListenerEntry> constantMetrics{};
-
-    MetricListenerEntry hasEventRingEntry{};
-    hasEventRingEntry.name = ENABLED_NAME;
-    hasEventRingEntry.unit = MetricUnit::NONE;
-    hasEventRingEntry.variability = MetricVariability::CONSTANT;
-    hasEventRingEntry.data.type = MetricDataType::LONG;
-    hasEventRingEntry.data.valueLong = has_runtime_events();
-    constantMetrics.push_back(hasEventRingEntry);
+    // Only emitted once, so there's no point in keeping the handles
+    const MetricHandle enabledHandle = listener.registerMetric(
+        ENABLED_NAME, MetricUnit::NONE, MetricVariability::CONSTANT, MetricDataType::LONG);
+    listener.recordLong(enabledHandle, has_runtime_events());
 
     char* runParam = getenv("OCAMLRUNPARAM");
     if (runParam == nullptr) {
@@ -75,24 +63,20 @@ void EventRingReader::emitConstantMetrics(MetricDataListener &listener, const lo
     }
 
     if (runParam != nullptr) {
-        MetricListenerEntry runParamEvent{};
-        runParamEvent.name = RUN_PARAM_NAME;
-        runParamEvent.unit = MetricUnit::STRING;
-        runParamEvent.variability = MetricVariability::CONSTANT;
-        runParamEvent.data.type = MetricDataType::STRING;
-        runParamEvent.data.valueString = runParam;
-        constantMetrics.push_back(runParamEvent);
+        const MetricHandle runParamHandle = listener.registerMetric(
+            RUN_PARAM_NAME, MetricUnit::STRING, MetricVariability::CONSTANT, MetricDataType::STRING);
+        listener.recordString(runParamHandle, runParam);
     }
 
-    MetricListenerEntry versionEvent{};
-    versionEvent.name = VERSION_PARAM_NAME;
-    versionEvent.unit = MetricUnit::NONE;
-    versionEvent.variability = MetricVariability::CONSTANT;
-    versionEvent.data.type = MetricDataType::STRING;
-    versionEvent.data.valueString = OCAML_VERSION_STRING;
-    constantMetrics.push_back(versionEvent);
+    const MetricHandle versionHandle = listener.registerMetric(
+        VERSION_PARAM_NAME, MetricUnit::NONE, MetricVariability::CONSTANT, MetricDataType::STRING);
+    listener.recordString(versionHandle, OCAML_VERSION_STRING);
+}
 
-    listener.recordEntries(constantMetrics, timestampInMs);
+void EventRingReader::flush(MetricDataListener& listener, const long timestampInMs) {
+    if (enabled_) {
+        flush_runtime_events(listener, timestampInMs);
+    }
 }
 
 const bool EventRingReader::hasEmittedConstantMetrics() {
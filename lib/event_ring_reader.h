@@ -9,7 +9,11 @@ class EventRingReader {
 public:
     EventRingReader(vector<string>& disabledPrefixes);
 
-    uint32_t read(MetricDataListener& listener, const long timestampInMs);
+    // Called once per metrics tick, the events themselves are read on the events consumer thread
+    void read(MetricDataListener& listener, const long timestampInMs);
+
+    // Called once per metrics tick
+    void flush(MetricDataListener& listener, const long timestampInMs);
 
     void updateEntryPrefixes(vector<string>& disabledPrefixes);
 
@@ -27,4 +31,7 @@ private:
     void emitConstantMetrics(MetricDataListener &listener, const long timestampInMs) const;
 };
 
+// Called on the forked child, provided in events.enabled.cpp / events.disabled.cpp
+void on_fork_runtime_events();
+
 #endif //OPSIAN_OCAML_EVENT_RING_READER_H
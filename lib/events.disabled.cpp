@@ -2,17 +2,55 @@
 // Used on platforms where runtime_events isn't available, eg: OCaml < 5.0.0
 
 #include "event_ring_reader.h"
+#include "heap_stats_reader.h"
 #include <cstdlib>
 #include "globals.h"
 
+extern "C" {
+    #define CAML_INTERNALS
+
+    #include <caml/mlvalues.h>
+    #include <caml/domain_state.h> // Caml_state
+    #include <caml/freelist.h> // caml_fl_cur_wsz
+}
+
 bool has_runtime_events() {
     return false;
 }
 bool enable_runtime_events(const bool wasEnabled, const bool enable) {
     return false;
 }
-uint32_t read_runtime_events(MetricDataListener& listener) {
-    return 0;
+void flush_runtime_events(MetricDataListener& listener, const long timestampInMs) {
 }
 void disable_runtime_events() {
 }
+void on_fork_runtime_events() {
+}
+
+// The same counters that Gc.quick_stat reads. They're read without the runtime lock, rather than stalling until the
+// OCaml threads release it, which is safe as each is a single aligned word that's only ever written by the thread
+// holding the lock. A sample can straddle a collection, but each value is one that the runtime really had.
+void read_heap_stats(HeapStats& stats) {
+    const caml_domain_state* state = Caml_state;
+    if (state == nullptr) {
+        return;
+    }
+
+    const int64_t wordSize = sizeof(value);
+    const int64_t heapWords = state->stat_heap_wsz;
+    const int64_t freeWords = caml_fl_cur_wsz;
+
+    stats.set(HEAP_SIZE, heapWords * wordSize);
+    stats.set(HEAP_TOP_SIZE, (int64_t) state->stat_top_heap_wsz * wordSize);
+    stats.set(HEAP_FREE, freeWords * wordSize);
+    // Includes the garbage that hasn't been swept yet, Gc.stat would need to walk the heap to exclude it
+    if (heapWords >= freeWords) {
+        stats.set(HEAP_LIVE, (heapWords - freeWords) * wordSize);
+    }
+    stats.set(HEAP_CHUNKS, state->stat_heap_chunks);
+    stats.set(HEAP_COMPACTIONS, state->stat_compactions);
+    stats.set(MINOR_COLLECTIONS, state->stat_minor_collections);
+    stats.set(MAJOR_COLLECTIONS, state->stat_major_collections);
+    stats.set(MINOR_ALLOCATED, (int64_t) state->stat_minor_words * wordSize);
+    stats.set(PROMOTED, (int64_t) state->stat_promoted_words * wordSize);
+}
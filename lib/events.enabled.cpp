@@ -1,6 +1,9 @@
 #include "event_ring_reader.h"
+#include "heap_stats_reader.h"
 #include <cstdlib>
 #include "globals.h"
+#include "log_linear_buckets.h"
+#include "proc_scanner.h"
 
 extern "C" {
     #define CAML_NAME_SPACE
@@ -14,34 +17,103 @@ extern "C" {
     #include "caml/runtime_events_consumer.h"
 }
 
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <pthread.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
 
 // Implementation of integration with OCaml runtime_events system, used on OCaml >= 5.0.0
 
 static const uint MAX_EVENTS = 60000;
 static const string LOST_EVENTS_NAME = string("ocaml.eventring.lost_events");
-static long MONOTONIC_TO_REALTIME_ADJUSTMENT_IN_MS = 0;
+static const string POLLS_NAME = string("ocaml.eventring.polls");
+static const string FILL_PERCENT_NAME = string("ocaml.eventring.fill_percent");
 static const int MONITOR_THIS_PROCESS = -1;
-static const int WORD_SIZE = sizeof(unsigned);
+static const int WORD_SIZE = sizeof(uintnat);
 static std::atomic_bool calledStart_(false);
 
+static const string EVENT_RING_PREFIX = string("ocaml.eventring.");
+static const string DOMAIN_PREFIX = string("ocaml.eventring.domain.");
+static const int ALL_DOMAINS = -1;
+
 #define ADD_EVENT(EV) { EV, "ocaml.eventring."#EV }
+#define ADD_PHASE(EV, SCOPE) { EV, { "ocaml.eventring."#EV, SCOPE } }
+
+// In OCaml 5 a stop-the-world phase runs on every domain at once, so the application is paused from when the first
+// domain enters it until the last domain leaves it. A domain-local phase only pauses the domain running it.
+enum class PhaseScope {
+    STOP_THE_WORLD,
+    DOMAIN_LOCAL
+};
 
+struct PhaseInfo {
+    const char* name;
+    PhaseScope scope;
+};
+
+// Begin timestamps are tracked per (domain, phase) as the same phase can run concurrently on several domains
 struct EventState {
     uint64_t beginTimestamp;
-    string eventName;
 };
 
+struct StopTheWorldInterval {
+    uint64_t beginTimestamp;
+    uint64_t endTimestamp;
+};
+
+// The domains' intervals in a stop-the-world phase, merged so that each pause is recorded once process-wide. A poll
+// drains each domain's ring in turn rather than interleaving them by time, so the intervals are only merged once the
+// poll's returned. The last merged pause is held back until the next poll, in case that reads another domain's
+// interval of it.
+struct StopTheWorldState {
+    std::vector<StopTheWorldInterval> intervals;
+    bool hasPending;
+    StopTheWorldInterval pending;
+};
+
+static inline uint64_t domainKey(const int domainId, const int event) {
+    return (((uint64_t) (uint32_t) domainId) << 32) | (uint32_t) event;
+}
+
+static inline int domainOfKey(const uint64_t key) {
+    return (int) (uint32_t) (key >> 32);
+}
+
 // Not static fields to avoid a race between the metrics thread completing and the program shutting down.
-const std::unordered_map<ev_runtime_phase, const char*>* REQUIRED_PHASES = nullptr;
+const std::unordered_map<ev_runtime_phase, PhaseInfo>* REQUIRED_PHASES = nullptr;
 const std::unordered_map<ev_runtime_counter, const char*>* REQUIRED_COUNTERS = nullptr;
-std::unordered_map<ev_runtime_phase, EventState>* phaseToEventState_ = nullptr;
+std::unordered_map<uint64_t, EventState>* phaseToEventState_ = nullptr;
+std::unordered_map<ev_runtime_phase, StopTheWorldState>* stopTheWorldStates_ = nullptr;
+
+// The latest major heap counters of a domain, the runtime samples them at the end of each major cycle. Only available
+// from OCaml 5.2.
+struct DomainHeapStats {
+    uint64_t poolWords;
+    uint64_t poolLiveWords;
+    uint64_t poolFragmentWords;
+    uint64_t largeWords;
+};
+
+std::unordered_map<int, DomainHeapStats>* domainHeapStats_ = nullptr;
+// The collection totals count each collection once however many domains take part: minor collections from the
+// domains' EV_MINOR intervals merged into pauses, major collections from domain 0's EV_MAJOR_FINISH_CYCLE.
+uint64_t minorCollections_ = 0;
+uint64_t majorCollections_ = 0;
+uint64_t minorAllocatedWords_ = 0;
+uint64_t promotedWords_ = 0;
 
 void init_counters() {
-    REQUIRED_PHASES = new std::unordered_map<ev_runtime_phase, const char*> {
-        ADD_EVENT(EV_MINOR), // Pause time for minor collection
-        ADD_EVENT(EV_MAJOR), // Sum of pause time slices for major collections
+    REQUIRED_PHASES = new std::unordered_map<ev_runtime_phase, PhaseInfo> {
+        // Minor collections are stop-the-world, but each domain collects its own minor heap
+        ADD_PHASE(EV_MINOR, PhaseScope::STOP_THE_WORLD),
+        // The whole stop-the-world section, as seen by the domain leading it
+        ADD_PHASE(EV_STW_LEADER, PhaseScope::STOP_THE_WORLD),
+        // Sum of pause time slices for major collections
+        ADD_PHASE(EV_MAJOR, PhaseScope::DOMAIN_LOCAL),
+        ADD_PHASE(EV_MAJOR_SLICE, PhaseScope::DOMAIN_LOCAL),
     };
 
     REQUIRED_COUNTERS = new std::unordered_map<ev_runtime_counter, const char*> {
@@ -56,77 +128,280 @@ void init_counters() {
 
         // amount of allocation in the previous minor cycle in terms of machine words
         ADD_EVENT(EV_C_MINOR_ALLOCATED),
-        // ADD_EVENT(EV_STAT_MAJOR_WORDS),
-        // ADD_EVENT(EV_STAT_MAJOR_COLLECTIONS),
-        // ADD_EVENT(EV_STAT_MINOR_COLLECTIONS),
-        // ADD_EVENT(EV_STAT_MINOR_WORDS),
-        // ADD_EVENT(EV_STAT_HEAP_WORDS),
-        // ADD_EVENT(EV_STAT_MINOR_SIZE)
+        // The heap sizes and collection totals are reported by the HeapStatsReader, see read_heap_stats
     };
 
-    phaseToEventState_ = new std::unordered_map<ev_runtime_phase, EventState> {};
+    phaseToEventState_ = new std::unordered_map<uint64_t, EventState> {};
+    stopTheWorldStates_ = new std::unordered_map<ev_runtime_phase, StopTheWorldState> {};
+    domainHeapStats_ = new std::unordered_map<int, DomainHeapStats> {};
 };
 
-class PollState {
+// Upper bounds of the fixed buckets that durations are also counted into, eg: ocaml.eventring.EV_MINOR.bucket_10000.
+// Unlike the percentiles these can be summed across intervals, which is what Prometheus histograms need. Covers a short
+// minor collection up to a very long major slice.
+static const uint64_t DURATION_BUCKET_BOUNDS_NS[] = {
+    10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000, 1000000000, 2500000000
+};
+static const size_t NUMBER_OF_DURATION_BUCKETS =
+    sizeof(DURATION_BUCKET_BOUNDS_NS) / sizeof(DURATION_BUCKET_BOUNDS_NS[0]);
+static const uint64_t* const DURATION_BUCKET_BOUNDS_END = DURATION_BUCKET_BOUNDS_NS + NUMBER_OF_DURATION_BUCKETS;
+
+// Log-linear histogram of the values seen in an interval, percentiles are within 1/16th of the true value whilst
+// covering the full uint64_t range in a fixed ~8KB.
+class EventHistogram {
 public:
-    PollState(MetricDataListener& listener)
-    : listener_(listener), entries_(), lostEvents_(0), lastTimestampInMs_(0) {
+    typedef LogLinearBuckets<4> Buckets;
+    static const int NUMBER_OF_BUCKETS = Buckets::NUMBER_OF_BUCKETS;
+
+    EventHistogram(const string& name, const MetricUnit unit)
+    : countName_(name + ".count"),
+      sumName_(name + ".sum"),
+      maxName_(name + ".max"),
+      p50Name_(name + ".p50"),
+      p90Name_(name + ".p90"),
+      p99Name_(name + ".p99"),
+      unit_(unit),
+      countHandle_(INVALID_METRIC_HANDLE),
+      sumHandle_(INVALID_METRIC_HANDLE),
+      maxHandle_(INVALID_METRIC_HANDLE),
+      p50Handle_(INVALID_METRIC_HANDLE),
+      p90Handle_(INVALID_METRIC_HANDLE),
+      p99Handle_(INVALID_METRIC_HANDLE),
+      buckets_(NUMBER_OF_BUCKETS, 0),
+      durationBucketNames_(),
+      durationBucketHandles_(),
+      durationBuckets_(),
+      count_(0),
+      sum_(0),
+      max_(0),
+      minIndex_(NUMBER_OF_BUCKETS),
+      maxIndex_(-1) {
+
+        if (unit == MetricUnit::NANOSECONDS) {
+            for (size_t i = 0; i < NUMBER_OF_DURATION_BUCKETS; i++) {
+                durationBucketNames_.push_back(name + ".bucket_" + std::to_string(DURATION_BUCKET_BOUNDS_NS[i]));
+            }
+            durationBucketHandles_.resize(NUMBER_OF_DURATION_BUCKETS, INVALID_METRIC_HANDLE);
+            durationBuckets_.resize(NUMBER_OF_DURATION_BUCKETS, 0);
+        }
     }
 
-    void emitWarning(const string& message) {
-        listener_.recordNotification(data::NotificationCategory::USER_WARNING, message);
+    void record(const uint64_t value) {
+        const int index = Buckets::index(value);
+        buckets_[index]++;
+        if (!durationBuckets_.empty()) {
+            // Values above the last bound are only in the count
+            const uint64_t* bound = std::lower_bound(DURATION_BUCKET_BOUNDS_NS, DURATION_BUCKET_BOUNDS_END, value);
+            if (bound != DURATION_BUCKET_BOUNDS_END) {
+                durationBuckets_[bound - DURATION_BUCKET_BOUNDS_NS]++;
+            }
+        }
+        count_++;
+        sum_ += value;
+        max_ = std::max(max_, value);
+        minIndex_ = std::min(minIndex_, index);
+        maxIndex_ = std::max(maxIndex_, index);
     }
 
-    void addEntry(MetricListenerEntry& entry, uint64_t timestampInNs) {
-        uint64_t timestampInMs = timestampInNs / NS_IN_MS;
-        if (lastTimestampInMs_ == 0) {
-            lastTimestampInMs_ = timestampInMs;
-        } else if (lastTimestampInMs_ != timestampInMs) {
-            push();
-            lastTimestampInMs_ = timestampInMs;
+    // Emits the interval's statistics and starts a new interval. The count, sum and duration buckets are emitted even
+    // for an empty interval, so that an absence of pauses is distinguishable from an absence of data. Each duration
+    // bucket is the interval's count of values between the previous bound and its own.
+    void flush(MetricDataListener& listener) {
+        record(listener, countHandle_, countName_, MetricUnit::EVENTS, count_);
+        record(listener, sumHandle_, sumName_, unit_, sum_);
+        for (size_t i = 0; i < durationBuckets_.size(); i++) {
+            record(
+                listener, durationBucketHandles_[i], durationBucketNames_[i], MetricUnit::EVENTS, durationBuckets_[i]);
+            durationBuckets_[i] = 0;
+        }
+
+        if (count_ > 0) {
+            record(listener, maxHandle_, maxName_, unit_, max_);
+            record(listener, p50Handle_, p50Name_, unit_, percentile(0.5));
+            record(listener, p90Handle_, p90Name_, unit_, percentile(0.9));
+            record(listener, p99Handle_, p99Name_, unit_, percentile(0.99));
+
+            // Only clear the buckets that were used
+            std::fill(buckets_.begin() + minIndex_, buckets_.begin() + maxIndex_ + 1, 0);
         }
 
-        addEntry(entry);
+        count_ = 0;
+        sum_ = 0;
+        max_ = 0;
+        minIndex_ = NUMBER_OF_BUCKETS;
+        maxIndex_ = -1;
     }
 
-    void lostEvents(int lostEvents) {
-        lostEvents_ += lostEvents;
+private:
+    const string countName_;
+    const string sumName_;
+    const string maxName_;
+    const string p50Name_;
+    const string p90Name_;
+    const string p99Name_;
+    const MetricUnit unit_;
+    MetricHandle countHandle_;
+    MetricHandle sumHandle_;
+    MetricHandle maxHandle_;
+    MetricHandle p50Handle_;
+    MetricHandle p90Handle_;
+    MetricHandle p99Handle_;
+
+    vector<uint64_t> buckets_;
+    // Only used for durations
+    vector<string> durationBucketNames_;
+    vector<MetricHandle> durationBucketHandles_;
+    vector<uint64_t> durationBuckets_;
+    uint64_t count_;
+    uint64_t sum_;
+    uint64_t max_;
+    int minIndex_;
+    int maxIndex_;
+
+    uint64_t percentile(const double fraction) const {
+        return Buckets::percentile(buckets_.data(), minIndex_, maxIndex_, count_, max_, fraction);
     }
 
-    void push() {
-        //        printf("len=%lu\n", entries_.size());
-        if (!entries_.empty()) {
-            if (lostEvents_ > 0) {
-                struct MetricListenerEntry entry{};
+    static void record(
+        MetricDataListener& listener,
+        MetricHandle& handle,
+        const string& name,
+        const MetricUnit unit,
+        const uint64_t value) {
 
-                entry.name = LOST_EVENTS_NAME;
-                entry.unit = MetricUnit::NONE;
-                entry.variability = MetricVariability::VARIABLE;
-                entry.data.type = MetricDataType::LONG;
-                entry.data.valueLong = lostEvents_;
+        // uint64 to int64 conversion
+        listener.record(handle, name.c_str(), unit, MetricVariability::VARIABLE, (int64_t) value);
+    }
 
-                addEntry(entry);
-                lostEvents_ = 0;
-                //                printf("lostEvents_=%d\n", lostEvents_);
-            }
+    DISALLOW_COPY_AND_ASSIGN(EventHistogram);
+};
+
+// Aggregates the events read between metrics ticks, so that each tick sends one batch of entries rather than one
+// entry per event. Each phase and counter is aggregated process-wide, eg: ocaml.eventring.EV_MINOR, and per domain,
+// eg: ocaml.eventring.domain.2.EV_MINOR.
+class EventAggregator {
+public:
+    EventAggregator()
+    : phases_(), domainPhases_(), counters_(), domainCounters_(), lostEventsHandle_(INVALID_METRIC_HANDLE),
+      pollsHandle_(INVALID_METRIC_HANDLE), fillPercentHandle_(INVALID_METRIC_HANDLE), lostEvents_(0), polls_(0),
+      maxFillPercent_(0) {
+    }
+
+    ~EventAggregator() {
+        deleteAll(phases_);
+        deleteAll(domainPhases_);
+        deleteAll(counters_);
+        deleteAll(domainCounters_);
+    }
+
+    void recordPhase(const ev_runtime_phase phase, const char* name, const uint64_t durationInNs) {
+        histogram(phases_, phase, ALL_DOMAINS, name, MetricUnit::NANOSECONDS).record(durationInNs);
+    }
+
+    void recordDomainPhase(
+        const int domainId,
+        const ev_runtime_phase phase,
+        const char* name,
+        const uint64_t durationInNs) {
+
+        histogram(domainPhases_, domainKey(domainId, phase), domainId, name, MetricUnit::NANOSECONDS)
+            .record(durationInNs);
+    }
+
+    void recordCounter(
+        const int domainId,
+        const ev_runtime_counter counter,
+        const char* name,
+        const MetricUnit unit,
+        const uint64_t value) {
+
+        histogram(counters_, counter, ALL_DOMAINS, name, unit).record(value);
+        histogram(domainCounters_, domainKey(domainId, counter), domainId, name, unit).record(value);
+    }
+
+    void lostEvents(const int lostEvents) {
+        lostEvents_ += lostEvents;
+    }
+
+    void recordPoll(const int fillPercent) {
+        polls_++;
+        maxFillPercent_ = std::max(maxFillPercent_, fillPercent);
+    }
 
-            const long realtimeTimestampInMs = MONOTONIC_TO_REALTIME_ADJUSTMENT_IN_MS + (long)lastTimestampInMs_;
-            listener_.recordEntries(entries_, realtimeTimestampInMs);
-            entries_.clear();
+    void flush(MetricDataListener& listener) {
+        flushAll(listener, phases_);
+        flushAll(listener, domainPhases_);
+        flushAll(listener, counters_);
+        flushAll(listener, domainCounters_);
+
+        if (lostEvents_ > 0) {
+            listener.record(
+                lostEventsHandle_, LOST_EVENTS_NAME.c_str(), MetricUnit::NONE, MetricVariability::VARIABLE, lostEvents_);
+            lostEvents_ = 0;
         }
+
+        listener.record(pollsHandle_, POLLS_NAME.c_str(), MetricUnit::EVENTS, MetricVariability::VARIABLE, polls_);
+        listener.record(
+            fillPercentHandle_, FILL_PERCENT_NAME.c_str(), MetricUnit::NONE, MetricVariability::VARIABLE,
+            maxFillPercent_);
+        polls_ = 0;
+        maxFillPercent_ = 0;
     }
 
 private:
-    MetricDataListener& listener_;
-    vector<MetricListenerEntry> entries_;
+    typedef std::unordered_map<uint64_t, EventHistogram*> Histograms;
+
+    Histograms phases_;
+    Histograms domainPhases_;
+    Histograms counters_;
+    Histograms domainCounters_;
+    MetricHandle lostEventsHandle_;
+    MetricHandle pollsHandle_;
+    MetricHandle fillPercentHandle_;
     int lostEvents_;
-    uint64_t lastTimestampInMs_;
+    int64_t polls_;
+    // The highest estimate of how full the ring was when polled, see ringCapacityInEvents()
+    int maxFillPercent_;
+
+    static EventHistogram& histogram(
+        Histograms& histograms,
+        const uint64_t key,
+        const int domainId,
+        const char* name,
+        const MetricUnit unit) {
+
+        auto it = histograms.find(key);
+        if (it == histograms.end()) {
+            string histogramName = name;
+            if (domainId != ALL_DOMAINS) {
+                histogramName =
+                    DOMAIN_PREFIX + std::to_string(domainId) + "." + histogramName.substr(EVENT_RING_PREFIX.size());
+            }
+            it = histograms.insert({key, new EventHistogram(histogramName, unit)}).first;
+        }
 
-    void addEntry(MetricListenerEntry& entry) {
-        entries_.push_back(entry);
+        return *it->second;
     }
+
+    static void flushAll(MetricDataListener& listener, Histograms& histograms) {
+        for (auto& it : histograms) {
+            it.second->flush(listener);
+        }
+    }
+
+    static void deleteAll(Histograms& histograms) {
+        for (auto& it : histograms) {
+            delete it.second;
+        }
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(EventAggregator);
 };
 
+EventAggregator* aggregator_ = nullptr;
+
 struct caml_runtime_events_cursor* cursor_ = nullptr;
 
 int eventRingBegin(int domainId, void* data, uint64_t timestamp, ev_runtime_phase phase) {
@@ -136,49 +411,128 @@ int eventRingBegin(int domainId, void* data, uint64_t timestamp, ev_runtime_phas
         return 1;
     }
 
-    const auto& it = phaseToEventState_->find(phase);
-    if (it == phaseToEventState_->end()) {
-        EventState eventState{};
-        eventState.beginTimestamp = timestamp;
-        eventState.eventName = phaseIt->second;
+    (*phaseToEventState_)[domainKey(domainId, phase)].beginTimestamp = timestamp;
 
-        phaseToEventState_->insert({phase, eventState});
-    } else {
-        it->second.beginTimestamp = timestamp;
-    }
     return 1;
 }
 
 int eventRingEnd(int domainId, void* data, uint64_t timestamp, ev_runtime_phase phase) {
 //    printf("eventRingEnd %lu %d\n", timestamp, phase);
-    if (REQUIRED_PHASES->find(phase) == REQUIRED_PHASES->end()) {
+    // Finishing a cycle is stop-the-world so every domain runs it, the initial domain is always one of them
+    if (phase == EV_MAJOR_FINISH_CYCLE && domainId == 0) {
+        majorCollections_++;
+    }
+
+    const auto& phaseIt = REQUIRED_PHASES->find(phase);
+    if (phaseIt == REQUIRED_PHASES->end()) {
         return 1;
     }
 
-    PollState* pollState = (PollState*) data;
-    const auto& it = phaseToEventState_->find(phase);
+    const auto& it = phaseToEventState_->find(domainKey(domainId, phase));
     if (it == phaseToEventState_->end()) {
         return 1;
     }
 
-    EventState& state = it->second;
-    const uint64_t duration = timestamp - state.beginTimestamp;
-
-    struct MetricListenerEntry entry{};
+    const PhaseInfo& phaseInfo = phaseIt->second;
+    const uint64_t beginTimestamp = it->second.beginTimestamp;
+    const uint64_t duration = timestamp - beginTimestamp;
+    phaseToEventState_->erase(it);
 
-    entry.name = state.eventName;
-    entry.unit = MetricUnit::NANOSECONDS;
-    entry.variability = MetricVariability::VARIABLE;
-    entry.data.type = MetricDataType::LONG;
-    entry.data.valueLong = duration;
+    aggregator_->recordDomainPhase(domainId, phase, phaseInfo.name, duration);
 
-    pollState->addEntry(entry, timestamp);
+    if (phaseInfo.scope == PhaseScope::DOMAIN_LOCAL) {
+        aggregator_->recordPhase(phase, phaseInfo.name, duration);
+    } else {
+        (*stopTheWorldStates_)[phase].intervals.push_back({beginTimestamp, timestamp});
+    }
 
-    phaseToEventState_->erase(it);
     return 1;
 }
 
+static void recordStopTheWorldPause(const ev_runtime_phase phase, const StopTheWorldInterval& pause) {
+    aggregator_->recordPhase(phase, REQUIRED_PHASES->at(phase).name, pause.endTimestamp - pause.beginTimestamp);
+    // Every domain collects its minor heap in each minor collection, so a collection is counted once per merged
+    // pause rather than per domain
+    if (phase == EV_MINOR) {
+        minorCollections_++;
+    }
+}
+
+// Called after each poll, merges the overlapping intervals of the domains into pauses
+static void mergeStopTheWorldPauses() {
+    for (auto& it : *stopTheWorldStates_) {
+        StopTheWorldState& state = it.second;
+        if (state.intervals.empty()) {
+            // No domain's still reporting the held back pause
+            if (state.hasPending) {
+                recordStopTheWorldPause(it.first, state.pending);
+                state.hasPending = false;
+            }
+            continue;
+        }
+
+        if (state.hasPending) {
+            state.intervals.push_back(state.pending);
+        }
+        std::sort(
+            state.intervals.begin(),
+            state.intervals.end(),
+            [](const StopTheWorldInterval& left, const StopTheWorldInterval& right) {
+                return left.beginTimestamp < right.beginTimestamp;
+            });
+
+        StopTheWorldInterval pause = state.intervals[0];
+        for (size_t index = 1; index < state.intervals.size(); index++) {
+            const StopTheWorldInterval& interval = state.intervals[index];
+            if (interval.beginTimestamp <= pause.endTimestamp) {
+                pause.endTimestamp = std::max(pause.endTimestamp, interval.endTimestamp);
+            } else {
+                recordStopTheWorldPause(it.first, pause);
+                pause = interval;
+            }
+        }
+
+        state.intervals.clear();
+        state.pending = pause;
+        state.hasPending = true;
+    }
+}
+
+// true if the counter is one of the major heap's
+bool recordHeapCounter(const int domainId, const ev_runtime_counter counter, const uint64_t value) {
+#if OCAML_VERSION >= 50200
+    switch (counter) {
+        case EV_C_MAJOR_HEAP_POOL_WORDS:
+            (*domainHeapStats_)[domainId].poolWords = value;
+            return true;
+        case EV_C_MAJOR_HEAP_POOL_LIVE_WORDS:
+            (*domainHeapStats_)[domainId].poolLiveWords = value;
+            return true;
+        case EV_C_MAJOR_HEAP_POOL_FRAG_WORDS:
+            (*domainHeapStats_)[domainId].poolFragmentWords = value;
+            return true;
+        case EV_C_MAJOR_HEAP_LARGE_WORDS:
+            (*domainHeapStats_)[domainId].largeWords = value;
+            return true;
+        default:
+            return false;
+    }
+#else
+    return false;
+#endif
+}
+
 int eventRingCounter(int domainId, void* data, uint64_t timestamp, ev_runtime_counter counter, uint64_t value) {
+    if (recordHeapCounter(domainId, counter, value)) {
+        return 1;
+    }
+
+    if (counter == EV_C_MINOR_PROMOTED) {
+        promotedWords_ += value;
+    } else if (counter == EV_C_MINOR_ALLOCATED) {
+        minorAllocatedWords_ += value;
+    }
+
     const auto& phaseIt = REQUIRED_COUNTERS->find(counter);
     if (phaseIt == REQUIRED_COUNTERS->end()) {
         return 1;
@@ -193,37 +547,198 @@ int eventRingCounter(int domainId, void* data, uint64_t timestamp, ev_runtime_co
         unit = MetricUnit::BYTES;
     }
 
-    struct MetricListenerEntry entry{};
-    entry.name = phaseIt->second;
-    entry.unit = unit;
-    entry.variability = MetricVariability::VARIABLE;
-    entry.data.type = MetricDataType::LONG;
-    // uint64 to int64 conversion
-    entry.data.valueLong = value;
-
-    PollState* pollState = (PollState*) data;
-    pollState->addEntry(entry, timestamp);
+    aggregator_->recordCounter(domainId, counter, phaseIt->second, unit, value);
     return 1;
 }
 
 int  eventRingLostEvents(int domainId, void* data, int lost_events) {
     // printf("eventRingLostEvents %d\n", lost_events);
-    PollState* pollState = (PollState*) data;
-    pollState->lostEvents(lost_events);
+    aggregator_->lostEvents(lost_events);
+
+    // Lost begin or end events would leave this domain's phases unmatched, so start tracking them afresh. The intervals
+    // and held back pauses already read are complete, so they're still merged and recorded after the poll, at worst
+    // missing this domain's part of a pause.
+    for (auto it = phaseToEventState_->begin(); it != phaseToEventState_->end();) {
+        if (domainOfKey(it->first) == domainId) {
+            it = phaseToEventState_->erase(it);
+        } else {
+            ++it;
+        }
+    }
     return 1;
 }
 
+// ---- BEGIN Consumer Thread ----
+
+// The ring is drained on its own thread, rather than the metrics thread, so that it can be polled as often as the
+// application's events need, eg: during an allocation burst, without waiting for the metrics tick.
+
+static const char* const EVENTS_THREAD_NAME = "Opsian Events";
+static const uint64_t MIN_POLL_SLEEP_IN_US = 100;
+static const uint64_t MAX_POLL_SLEEP_IN_US = 50000;
+// Polls are scheduled to find the ring about this full, leaving headroom for the rate to jump before the next poll
+static const double TARGET_FILL_RATIO = 0.25;
+// The runtime's default, changed with the e= OCAMLRUNPARAM option
+static const int DEFAULT_RING_LOG_WSIZE = 16;
+// Phase events are a header and a timestamp, counters also have a value, so this errs towards overestimating fill
+static const int WORDS_PER_EVENT = 3;
+
+// Guards cursor_, aggregator_ and the state updated by the event callbacks, which run on the consumer thread. A
+// pointer so that it can be replaced in a forked child, where the consumer thread may have been holding it.
+boost::mutex* eventsMutex_ = new boost::mutex();
+pthread_t consumerThread_{};
+std::atomic_bool consumerRunning_(false);
+std::atomic_bool registeredConsumerExit_(false);
+
+// Each domain has its own ring of 2^e words, so a poll can read more than this when several domains are busy
+static double ringCapacityInEvents() {
+    int logWsize = DEFAULT_RING_LOG_WSIZE;
+
+    const char* runParam = getenv("OCAMLRUNPARAM");
+    if (runParam == nullptr) {
+        runParam = getenv("CAMLRUNPARAM");
+    }
+
+    // Comma separated options, eg: "s=4M,e=18"
+    for (const char* option = runParam; option != nullptr; option = strchr(option, ',')) {
+        if (*option == ',') {
+            option++;
+        }
+
+        if (option[0] == 'e' && option[1] == '=') {
+            const int parsed = atoi(option + 2);
+            if (parsed > 0) {
+                logWsize = parsed;
+            }
+        }
+    }
+
+    return (double) (1UL << logWsize) / WORDS_PER_EVENT;
+}
+
+static uint64_t elapsedInUs(const timespec& start, const timespec& end) {
+    return (end.tv_sec - start.tv_sec) * 1000000UL + (end.tv_nsec - start.tv_nsec) / 1000;
+}
+
+static void sleepForUs(const uint64_t durationInUs) {
+    timespec duration;
+    duration.tv_sec = durationInUs / 1000000;
+    duration.tv_nsec = (durationInUs % 1000000) * 1000;
+    nanosleep(&duration, nullptr);
+}
+
+// Tight polling whilst the ring is filling quickly, backing off towards the maximum sleep whilst it's idle
+static uint64_t nextPollSleepInUs(
+    const uint64_t previousSleepInUs,
+    const uint64_t sincePreviousPollInUs,
+    const uintnat eventsRead,
+    const double fillRatio) {
+
+    if (eventsRead >= MAX_EVENTS || fillRatio >= TARGET_FILL_RATIO) {
+        return 0;
+    }
+
+    if (eventsRead == 0) {
+        return std::min(std::max(previousSleepInUs * 2, MIN_POLL_SLEEP_IN_US), MAX_POLL_SLEEP_IN_US);
+    }
+
+    // Assume the ring keeps filling at the rate it did since the previous poll
+    const uint64_t untilTargetInUs = (uint64_t) (sincePreviousPollInUs * (TARGET_FILL_RATIO / fillRatio));
+    return std::min(std::max(untilTargetInUs, MIN_POLL_SLEEP_IN_US), MAX_POLL_SLEEP_IN_US);
+}
+
+void* runEventsConsumer(void* arg) {
+    // Avoid having the events thread also receive the PROF signals
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigaddset(&mask, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) < 0) {
+        logError("ERROR: failed to set events thread signal mask\n");
+    }
+
+    on_events_thread_start();
+
+    const double capacityInEvents = ringCapacityInEvents();
+    uint64_t sleepInUs = MIN_POLL_SLEEP_IN_US;
+    timespec previousPoll {0};
+    clock_gettime(CLOCK_MONOTONIC, &previousPoll);
+
+    while (consumerRunning_) {
+        timespec poll {0};
+        clock_gettime(CLOCK_MONOTONIC, &poll);
+
+        uintnat eventsRead = 0;
+        double fillRatio = 0;
+        {
+            boost::lock_guard<boost::mutex> guard(*eventsMutex_);
+
+            runtime_events_error error = caml_runtime_events_read_poll(cursor_, nullptr, MAX_EVENTS, &eventsRead);
+            if (error != E_SUCCESS) {
+                logError("caml_runtime_events_read_poll error: %d\n", (int)error);
+            }
+            mergeStopTheWorldPauses();
+
+            fillRatio = eventsRead / capacityInEvents;
+            aggregator_->recordPoll((int) std::min(fillRatio * 100, 100.0));
+        }
+
+        sleepInUs = nextPollSleepInUs(sleepInUs, elapsedInUs(previousPoll, poll), eventsRead, fillRatio);
+        previousPoll = poll;
+
+        if (sleepInUs > 0) {
+            sleepForUs(sleepInUs);
+        }
+    }
+
+    on_events_thread_stop();
+
+    return nullptr;
+}
+
+static void stopEventsConsumer() {
+    if (consumerRunning_) {
+        consumerRunning_ = false;
+
+        int result = pthread_join(consumerThread_, nullptr);
+        if (result) {
+            logError("ERROR: failed to join events thread %d\n", result);
+        }
+    }
+}
+
+static void startEventsConsumer() {
+    if (!registeredConsumerExit_.exchange(true)) {
+        atexit(stopEventsConsumer);
+    }
+
+    consumerRunning_ = true;
+    int result = pthread_create(&consumerThread_, nullptr, &runEventsConsumer, nullptr);
+    if (result) {
+        logError("ERROR: failed to start events thread %d\n", result);
+        consumerRunning_ = false;
+        return;
+    }
+
+    pthread_setname_np(consumerThread_, EVENTS_THREAD_NAME);
+}
+
+// ---- END Consumer Thread ----
+
 bool has_runtime_events() {
     return true;
 }
 
 void disable_runtime_events() {
+    stopEventsConsumer();
+
     if (calledStart_) {
         caml_acquire_runtime_system();
         caml_runtime_events_pause();
         caml_release_runtime_system();
     }
 
+    boost::lock_guard<boost::mutex> guard(*eventsMutex_);
     if (cursor_ != nullptr) {
         caml_runtime_events_free_cursor(cursor_);
         cursor_ = nullptr;
@@ -236,18 +751,12 @@ bool enable_runtime_events(const bool wasEnabled, const bool enable) {
         if (!calledStart_) {
             // first time ever
             init_counters();
+            aggregator_ = new EventAggregator();
 
             caml_acquire_runtime_system();
             caml_runtime_events_start();
             caml_release_runtime_system();
 
-            timespec ts {0};
-            clock_gettime(CLOCK_REALTIME, &ts);
-            const long clockRealTimeInMs = toMillis(ts);
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            const long clockMonotonicInMs = toMillis(ts);
-            MONOTONIC_TO_REALTIME_ADJUSTMENT_IN_MS = clockRealTimeInMs - clockMonotonicInMs;
-
             calledStart_ = true;
         } else {
             caml_acquire_runtime_system();
@@ -266,6 +775,7 @@ bool enable_runtime_events(const bool wasEnabled, const bool enable) {
             caml_runtime_events_set_runtime_end(cursor_, eventRingEnd);
             caml_runtime_events_set_runtime_counter(cursor_, eventRingCounter);
             caml_runtime_events_set_lost_events(cursor_, eventRingLostEvents);
+            startEventsConsumer();
             return true;
         }
     } else if (wasEnabled && !enable) {
@@ -276,17 +786,53 @@ bool enable_runtime_events(const bool wasEnabled, const bool enable) {
     return enable;
 }
 
-uint32_t read_runtime_events(MetricDataListener& listener) {
-    uintnat eventsRead = 0;
-
+void flush_runtime_events(MetricDataListener& listener, const long timestampInMs) {
+    boost::lock_guard<boost::mutex> guard(*eventsMutex_);
     if (cursor_ != nullptr) {
-        PollState pollState(listener);
-        runtime_events_error error = caml_runtime_events_read_poll(cursor_, &pollState, MAX_EVENTS, &eventsRead);
-        if (error != E_SUCCESS) {
-            logError("caml_runtime_events_read_poll error: %d\n", (int)error);
-        }
-        pollState.push();
+        aggregator_->flush(listener);
     }
+}
 
-    return eventsRead;
+void on_fork_runtime_events() {
+    // The consumer thread doesn't exist in the child and the cursor is reading the parent's ring, the child's ring is
+    // opened afresh when the metrics are re-enabled.
+    eventsMutex_ = new boost::mutex();
+    consumerRunning_ = false;
+    cursor_ = nullptr;
+}
+
+void read_heap_stats(HeapStats& stats) {
+    boost::lock_guard<boost::mutex> guard(*eventsMutex_);
+    if (cursor_ == nullptr) {
+        return;
+    }
+
+    stats.set(MINOR_COLLECTIONS, minorCollections_);
+    stats.set(MAJOR_COLLECTIONS, majorCollections_);
+    stats.set(MINOR_ALLOCATED, minorAllocatedWords_ * WORD_SIZE);
+    stats.set(PROMOTED, promotedWords_ * WORD_SIZE);
+
+    // Not sampled until the first major cycle ends
+    if (domainHeapStats_->empty()) {
+        return;
+    }
+
+    uint64_t poolWords = 0;
+    uint64_t poolLiveWords = 0;
+    uint64_t poolFragmentWords = 0;
+    uint64_t largeWords = 0;
+    for (auto& it : *domainHeapStats_) {
+        poolWords += it.second.poolWords;
+        poolLiveWords += it.second.poolLiveWords;
+        poolFragmentWords += it.second.poolFragmentWords;
+        largeWords += it.second.largeWords;
+    }
+
+    // Large allocations are individually malloc'd, so are always live until swept
+    stats.set(HEAP_SIZE, (poolWords + largeWords) * WORD_SIZE);
+    stats.set(HEAP_LIVE, (poolLiveWords + largeWords) * WORD_SIZE);
+    stats.set(HEAP_FRAGMENTS, poolFragmentWords * WORD_SIZE);
+    if (poolWords >= poolLiveWords + poolFragmentWords) {
+        stats.set(HEAP_FREE, (poolWords - poolLiveWords - poolFragmentWords) * WORD_SIZE);
+    }
 }
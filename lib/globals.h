@@ -13,6 +13,8 @@
 #include <atomic>
 
 extern "C" int linkable_handle(CallFrame* frames, ErrorHolder* errorHolder);
+// Takes the runtime lock, so it's only called from a thread registered with the runtime
+extern "C" int linkable_ocaml_locations(uint64_t pc, OcamlLocation* locations, int maxLocations);
 
 #ifdef __MACH__
 #   include <mach/clock.h>
@@ -89,6 +91,31 @@ char *safe_copy_string(const char *value, const char *next);
 
 #define DEFAULT_PROMETHEUS_PROCESS_SAMPLE_RATE 100
 #define DEFAULT_PROMETHEUS_ELAPSED_SAMPLE_RATE 100
+// Number of scrapes a call tree node can go unseen before it's pruned, 0 disables pruning
+#define DEFAULT_PROMETHEUS_PRUNE_PHASES 10
+// Number of delta encoded MetricSamples between keyframes
+#define DEFAULT_METRICS_KEYFRAME_INTERVAL 60
+
+// Wallclock signals per second across all threads, 0 arms a wallclock timer per thread instead
+#define DEFAULT_WALLCLOCK_SIGNAL_BUDGET 0
+
+// One in this many of each thread's off-CPU wallclock samples are kept and weighted to stand for the rest, 0 drops
+// them all
+#define DEFAULT_WALLCLOCK_OFF_CPU_SAMPLE_RATIO 1
+
+// Runtime lock waits at least this long are sampled with their stacks, shorter ones only count towards the histogram
+#define DEFAULT_RUNTIME_LOCK_WAIT_THRESHOLD_US 1000
+
+// Periods of the perf event stack samples, see perf_events.h, 0 leaves an event off
+#define DEFAULT_PERF_TASK_CLOCK_INTERVAL_US 0
+#define DEFAULT_PERF_PAGE_FAULT_PERIOD 0
+#define DEFAULT_PERF_CONTEXT_SWITCH_PERIOD 0
+
+// How CPU samples are signalled: by the process-wide ITIMER_PROF, or by a CLOCK_THREAD_CPUTIME_ID timer per thread
+enum class CpuSamplingMode {
+    PROCESS,
+    THREAD
+};
 
 
 struct ConfigurationOptions {
@@ -110,6 +137,17 @@ struct ConfigurationOptions {
     std::string prometheusSegment;
     int prometheusProcessSampleRate;
     int prometheusElapsedSampleRate;
+    int prometheusPrunePhases;
+    bool metricsDeltaEncoding;
+    int metricsKeyframeInterval;
+    CpuSamplingMode cpuSamplingMode;
+    int wallclockSignalBudget;
+    int wallclockOffCpuSampleRatio;
+    bool runtimeLockProfiling;
+    int runtimeLockWaitThresholdUs;
+    int perfTaskClockIntervalUs;
+    int perfPageFaultPeriod;
+    int perfContextSwitchPeriod;
 
     ConfigurationOptions() :
             logFilePath(""),
@@ -129,7 +167,18 @@ struct ConfigurationOptions {
             prometheusPorts(),
             prometheusSegment(""),
             prometheusProcessSampleRate(DEFAULT_PROMETHEUS_PROCESS_SAMPLE_RATE),
-            prometheusElapsedSampleRate(DEFAULT_PROMETHEUS_ELAPSED_SAMPLE_RATE) {
+            prometheusElapsedSampleRate(DEFAULT_PROMETHEUS_ELAPSED_SAMPLE_RATE),
+            prometheusPrunePhases(DEFAULT_PROMETHEUS_PRUNE_PHASES),
+            metricsDeltaEncoding(false),
+            metricsKeyframeInterval(DEFAULT_METRICS_KEYFRAME_INTERVAL),
+            cpuSamplingMode(CpuSamplingMode::PROCESS),
+            wallclockSignalBudget(DEFAULT_WALLCLOCK_SIGNAL_BUDGET),
+            wallclockOffCpuSampleRatio(DEFAULT_WALLCLOCK_OFF_CPU_SAMPLE_RATIO),
+            runtimeLockProfiling(false),
+            runtimeLockWaitThresholdUs(DEFAULT_RUNTIME_LOCK_WAIT_THRESHOLD_US),
+            perfTaskClockIntervalUs(DEFAULT_PERF_TASK_CLOCK_INTERVAL_US),
+            perfPageFaultPeriod(DEFAULT_PERF_PAGE_FAULT_PERIOD),
+            perfContextSwitchPeriod(DEFAULT_PERF_CONTEXT_SWITCH_PERIOD) {
     }
 
     ~ConfigurationOptions() {
@@ -0,0 +1,83 @@
+#include "heap_stats_reader.h"
+
+static const string HEAP_STATS_NAME = string("ocaml.heap");
+static const string PROMOTED_PER_SECOND_NAME = string("ocaml.heap.promoted_per_second");
+
+struct HeapStatDefinition {
+    const char* name;
+    MetricUnit unit;
+    MetricVariability variability;
+};
+
+// Indexed by HeapStat
+static const HeapStatDefinition HEAP_STATS[] = {
+    {"ocaml.heap.size", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"ocaml.heap.top_size", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"ocaml.heap.live", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"ocaml.heap.free", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"ocaml.heap.fragments", MetricUnit::BYTES, MetricVariability::VARIABLE},
+    {"ocaml.heap.chunks", MetricUnit::NONE, MetricVariability::VARIABLE},
+    {"ocaml.heap.compactions", MetricUnit::EVENTS, MetricVariability::MONOTONIC},
+    {"ocaml.heap.minor_collections", MetricUnit::EVENTS, MetricVariability::MONOTONIC},
+    {"ocaml.heap.major_collections", MetricUnit::EVENTS, MetricVariability::MONOTONIC},
+    {"ocaml.heap.minor_allocated", MetricUnit::BYTES, MetricVariability::MONOTONIC},
+    {"ocaml.heap.promoted", MetricUnit::BYTES, MetricVariability::MONOTONIC}
+};
+
+HeapStatsReader::HeapStatsReader(vector<string>& disabledPrefixes)
+  : enabled(false),
+    handles_(),
+    promotedPerSecondHandle_(INVALID_METRIC_HANDLE),
+    hasPrevious_(false),
+    previousPromoted_(0),
+    previousTimestampInMs_(0) {
+
+    updateEntryPrefixes(disabledPrefixes);
+}
+
+void HeapStatsReader::read(MetricDataListener& listener, const long timestampInMs) {
+    if (!enabled) {
+        return;
+    }
+
+    HeapStats stats{};
+    read_heap_stats(stats);
+
+    for (int stat = 0; stat < NUMBER_OF_HEAP_STATS; stat++) {
+        if (stats.available[stat]) {
+            const HeapStatDefinition& definition = HEAP_STATS[stat];
+            listener.record(
+                handles_[stat], definition.name, definition.unit, definition.variability, stats.values[stat]);
+        }
+    }
+
+    // The rate at which the application's allocations survive into the major heap, which drives its growth
+    if (stats.available[PROMOTED]) {
+        const int64_t promoted = stats.values[PROMOTED];
+        if (hasPrevious_ && timestampInMs > previousTimestampInMs_ && promoted >= previousPromoted_) {
+            const int64_t promotedPerSecond =
+                ((promoted - previousPromoted_) * 1000) / (timestampInMs - previousTimestampInMs_);
+            listener.record(
+                promotedPerSecondHandle_,
+                PROMOTED_PER_SECOND_NAME.c_str(),
+                MetricUnit::BYTES,
+                MetricVariability::VARIABLE,
+                promotedPerSecond);
+        }
+
+        hasPrevious_ = true;
+        previousPromoted_ = promoted;
+        previousTimestampInMs_ = timestampInMs;
+    } else {
+        hasPrevious_ = false;
+    }
+}
+
+void HeapStatsReader::updateEntryPrefixes(vector<string>& disabledPrefixes) {
+    enabled = !isPrefixDisabled(HEAP_STATS_NAME, disabledPrefixes);
+}
+
+const bool HeapStatsReader::hasEmittedConstantMetrics() {
+    // There are no constant metrics
+    return true;
+}
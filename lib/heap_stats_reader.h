@@ -0,0 +1,67 @@
+#ifndef OPSIAN_HEAP_STATS_READER_H
+#define OPSIAN_HEAP_STATS_READER_H
+
+#include "globals.h"
+#include "metric_types.h"
+
+using std::string;
+using std::vector;
+
+enum HeapStat {
+    // Major heap sizes, in bytes
+    HEAP_SIZE,
+    HEAP_TOP_SIZE,
+    HEAP_LIVE,
+    HEAP_FREE,
+    HEAP_FRAGMENTS,
+    HEAP_CHUNKS,
+    // Totals over the lifetime of the process
+    HEAP_COMPACTIONS,
+    MINOR_COLLECTIONS,
+    MAJOR_COLLECTIONS,
+    MINOR_ALLOCATED,
+    PROMOTED,
+    NUMBER_OF_HEAP_STATS
+};
+
+// Which statistics are available depends on the OCaml version
+struct HeapStats {
+    int64_t values[NUMBER_OF_HEAP_STATS];
+    bool available[NUMBER_OF_HEAP_STATS];
+
+    void set(const HeapStat stat, const int64_t value) {
+        values[stat] = value;
+        available[stat] = true;
+    }
+};
+
+// Provided in events.enabled.cpp / events.disabled.cpp. On OCaml 5 the statistics come from runtime events, so are
+// only available whilst the event ring is enabled, on OCaml 4 they're read from the runtime's counters.
+void read_heap_stats(HeapStats& stats);
+
+// Samples the OCaml heap's size and occupancy, and the GC's totals, on each metrics tick
+class HeapStatsReader {
+public:
+    HeapStatsReader(vector<string>& disabledPrefixes);
+
+    void read(MetricDataListener& listener, const long timestampInMs);
+
+    void updateEntryPrefixes(vector<string>& disabledPrefixes);
+
+    const bool hasEmittedConstantMetrics();
+
+private:
+    bool enabled;
+
+    MetricHandle handles_[NUMBER_OF_HEAP_STATS];
+    MetricHandle promotedPerSecondHandle_;
+
+    // For the promotion rate
+    bool hasPrevious_;
+    int64_t previousPromoted_;
+    long previousTimestampInMs_;
+
+    DISALLOW_COPY_AND_ASSIGN(HeapStatsReader);
+};
+
+#endif // OPSIAN_HEAP_STATS_READER_H
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "globals.h"
 #include "profiler.h"
+#include "thread_state.h"
 #include <execinfo.h>
 #include <signal.h>
 #include <time.h>
@@ -83,6 +84,40 @@ void parseArguments(char *options, ConfigurationOptions &configuration) {
                 configuration.prometheusProcessSampleRate = atoi(value);
             } else if (strstr(key, "prometheusElapsedSampleRate") == key) {
                 configuration.prometheusElapsedSampleRate = atoi(value);
+            } else if (strstr(key, "prometheusPrunePhases") == key) {
+                configuration.prometheusPrunePhases = atoi(value);
+            } else if (strstr(key, "metricsDeltaEncoding") == key) {
+                char metricsDeltaEncodingValue = *value;
+                configuration.metricsDeltaEncoding =
+                    (metricsDeltaEncodingValue == 'y' || metricsDeltaEncodingValue == 'Y');
+            } else if (strstr(key, "metricsKeyframeInterval") == key) {
+                configuration.metricsKeyframeInterval = atoi(value);
+            } else if (strstr(key, "cpuSamplingMode") == key) {
+                string mode;
+                assign_range(value, next, mode);
+                if (mode == "thread") {
+                    configuration.cpuSamplingMode = CpuSamplingMode::THREAD;
+                } else if (mode == "process") {
+                    configuration.cpuSamplingMode = CpuSamplingMode::PROCESS;
+                } else {
+                    logError("WARN: Unknown cpuSamplingMode: %s\n", mode.c_str());
+                }
+            } else if (strstr(key, "wallclockSignalBudget") == key) {
+                configuration.wallclockSignalBudget = atoi(value);
+            } else if (strstr(key, "wallclockOffCpuSampleRatio") == key) {
+                configuration.wallclockOffCpuSampleRatio = atoi(value);
+            } else if (strstr(key, "runtimeLockProfiling") == key) {
+                char runtimeLockProfilingValue = *value;
+                configuration.runtimeLockProfiling =
+                    (runtimeLockProfilingValue == 'y' || runtimeLockProfilingValue == 'Y');
+            } else if (strstr(key, "runtimeLockWaitThresholdUs") == key) {
+                configuration.runtimeLockWaitThresholdUs = atoi(value);
+            } else if (strstr(key, "perfTaskClockIntervalUs") == key) {
+                configuration.perfTaskClockIntervalUs = atoi(value);
+            } else if (strstr(key, "perfPageFaultPeriod") == key) {
+                configuration.perfPageFaultPeriod = atoi(value);
+            } else if (strstr(key, "perfContextSwitchPeriod") == key) {
+                configuration.perfContextSwitchPeriod = atoi(value);
             } else if (strstr(key, "__logCorruption") == key) {
                 char logCorruptionValue = *value;
                 configuration.logCorruption = (logCorruptionValue == 'y' || logCorruptionValue == 'Y');
@@ -216,6 +251,9 @@ CAMLprim void start_opsian_native(
         ERROR_FILE = new ofstream(errorLogPath);
     }
 
+    // The Thread module has been initialized by lib_opsian.ml and we hold the runtime lock
+    install_thread_state_hooks();
+
     prof = new Profiler(CONFIGURATION, ocaml_version);
     pthread_atfork(&prepare_fork, &parent_fork, &child_fork);
     prof->start();
@@ -230,9 +268,7 @@ bool setup_configuration() {
 }
 
 void bootstrapHandle(int signum, siginfo_t *info, void *context) {
-    IMPLICITLY_USE(info)
-
-    prof->handle(signum, context);
+    prof->handle(signum, info, context);
 }
 
 void sleep_ms(uint64_t durationInMs) {
@@ -1,6 +1,36 @@
 (* Entrypoint into the native code *)
 external start_opsian_native : string -> string -> string -> unit = "start_opsian_native"
 
+(* Allocation profiling, the agent starts and stops Gc.Memprof through the callbacks registered below. Each sampled
+   allocation calls back into the agent on the allocating thread, which unwinds the stack from there and returns the
+   id that the sample is tracked by until it's deallocated, or -1 if it isn't tracked. *)
+external memprof_alloc : int -> int -> bool -> int = "opsian_memprof_alloc"
+external memprof_promote : int -> unit = "opsian_memprof_promote" [@@noalloc]
+external memprof_dealloc : int -> unit = "opsian_memprof_dealloc" [@@noalloc]
+
+let memprof_tracked id = if id < 0 then None else Some id
+
+let memprof_tracker =
+  { Gc.Memprof.alloc_minor =
+      (fun info -> memprof_tracked (memprof_alloc info.Gc.Memprof.n_samples info.Gc.Memprof.size false));
+    alloc_major =
+      (fun info -> memprof_tracked (memprof_alloc info.Gc.Memprof.n_samples info.Gc.Memprof.size true));
+    promote = (fun id -> memprof_promote id; Some id);
+    dealloc_minor = memprof_dealloc;
+    dealloc_major = memprof_dealloc }
+
+(* Gc.Memprof is available on OCaml 4.12–4.14 and 5.3 onwards, it fails on 5.0 to 5.2, which don't implement it *)
+let memprof_start sampling_rate =
+  try
+    ignore (Gc.Memprof.start ~sampling_rate ~callstack_size:0 memprof_tracker);
+    true
+  with Failure _ -> false
+
+let memprof_stop () =
+  try Gc.Memprof.stop () with Failure _ -> ()
+
 let () =
+  Callback.register "opsian_memprof_start" memprof_start;
+  Callback.register "opsian_memprof_stop" memprof_stop;
   let (_ : Thread.t) = Thread.self () in
   start_opsian_native (Sys.ocaml_version) (Sys.executable_name) (Sys.argv.(0))
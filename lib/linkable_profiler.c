@@ -16,6 +16,7 @@
 #include "caml/misc.h"
 #include "caml/mlvalues.h"
 #include "caml/stack.h"
+#include "caml/threads.h"
 #include "caml/version.h"
 #include <inttypes.h>
 
@@ -139,3 +140,65 @@ int linkable_handle(CallFrame* frames, ErrorHolder* holder) {
 
     return num_frames;
 }
+
+// Finds the frame descriptor whose return address is pc, or NULL if there isn't one, eg: because the pc isn't a
+// call site within OCaml code. Must hold the runtime lock: Dynlink reallocates and frees the table when it registers
+// a plugin's frametable. The descriptors themselves live in the code's data, which is never unloaded.
+static frame_descr* find_frame_descriptor(uint64_t pc) {
+#ifdef MULTICORE
+    return caml_find_frame_descr(caml_get_frame_descrs(), (uintnat) pc);
+#else
+    if (caml_frame_descriptors == NULL) {
+        return NULL;
+    }
+
+    uintnat h = Hash_retaddr(pc);
+    while (1) {
+        frame_descr* d = caml_frame_descriptors[h];
+        if (d == NULL) {
+            return NULL;
+        }
+        if (d->retaddr == pc) {
+            return d;
+        }
+        h = (h + 1) & caml_frame_descriptors_mask;
+    }
+#endif
+}
+
+// Decodes the debuginfo the OCaml compiler attaches to frame descriptors, innermost inlined location first.
+// Doesn't allocate: the strings are owned by the debuginfo tables.
+int linkable_ocaml_locations(uint64_t pc, OcamlLocation* locations, int max_locations) {
+    caml_acquire_runtime_system();
+    frame_descr* fd = find_frame_descriptor(pc);
+    caml_release_runtime_system();
+
+    // Special frames (callback boundaries) have no debuginfo, even though their low bit is set
+    if (fd == NULL || fd->frame_size == 0xFFFF) {
+        return 0;
+    }
+
+    int num_locations = 0;
+    debuginfo dbg = caml_debuginfo_extract((backtrace_slot) fd);
+    while (dbg != NULL && num_locations < max_locations) {
+        struct caml_loc_info li;
+        caml_debuginfo_location(dbg, &li);
+        if (!li.loc_valid) {
+            break;
+        }
+
+        OcamlLocation* location = &locations[num_locations];
+        location->fileName = li.loc_filename;
+        #if OCAML_VERSION >= 41100
+        location->functionName = li.loc_defname;
+        #else
+        location->functionName = NULL;
+        #endif
+        location->lineNumber = li.loc_lnum;
+        num_locations += 1;
+
+        dbg = caml_debuginfo_next(dbg);
+    }
+
+    return num_locations;
+}
@@ -16,6 +16,8 @@ typedef struct {
     int num_frames;
     pthread_t threadId;
     CallFrame* frames;
+    // The number of samples this one stands for, more than 1 when only a subset of the threads are sampled
+    int weight;
 } CallTrace;
 
 typedef uint64_t VMSymbol;
@@ -34,4 +36,15 @@ typedef struct {
     ErrorType type;
 } ErrorHolder;
 
+// A single source location decoded from an OCaml frame descriptor's debuginfo. The strings point into the
+// debuginfo tables that the compiler emits alongside the code, so they live as long as the code itself does.
+typedef struct {
+    const char* fileName;
+    const char* functionName;
+    int lineNumber;
+} OcamlLocation;
+
+// Inlining depth beyond this is truncated
+#define MAX_OCAML_LOCATIONS 32
+
 #endif // LINKABLE_PROFILER_H
@@ -0,0 +1,59 @@
+#ifndef OPSIAN_LOG_LINEAR_BUCKETS_H
+#define OPSIAN_LOG_LINEAR_BUCKETS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <math.h>
+
+// Log-linear histogram buckets. Values below SUB_BUCKET_COUNT get their own bucket, above that each power of two is
+// split into SUB_BUCKET_COUNT buckets, so a bucket's upper bound is within 1/SUB_BUCKET_COUNT of any value in it
+// whilst NUMBER_OF_BUCKETS covers the full uint64_t range.
+template <int SUB_BUCKET_BITS>
+struct LogLinearBuckets {
+    static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+    static const int NUMBER_OF_BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+    static int index(const uint64_t value) {
+        if (value < SUB_BUCKET_COUNT) {
+            return (int) value;
+        }
+
+        const int highestBit = 63 - __builtin_clzll(value);
+        const int shift = highestBit - SUB_BUCKET_BITS;
+        return (shift + 1) * SUB_BUCKET_COUNT + (int) ((value >> shift) & (SUB_BUCKET_COUNT - 1));
+    }
+
+    // The highest value that falls into the bucket
+    static uint64_t upperBound(const int index) {
+        if (index < SUB_BUCKET_COUNT) {
+            return index;
+        }
+
+        const int shift = index / SUB_BUCKET_COUNT - 1;
+        const uint64_t subBucket = index % SUB_BUCKET_COUNT;
+        return ((SUB_BUCKET_COUNT + subBucket) << shift) + ((1ULL << shift) - 1);
+    }
+
+    // The value at the given fraction of the count values in buckets[minIndex, maxIndex], capped at the exact max
+    static uint64_t percentile(
+        const uint64_t* buckets,
+        const int minIndex,
+        const int maxIndex,
+        const uint64_t count,
+        const uint64_t max,
+        const double fraction) {
+
+        const uint64_t rank = std::max((uint64_t) 1, (uint64_t) ceil(fraction * count));
+        uint64_t seen = 0;
+        for (int index = minIndex; index <= maxIndex; index++) {
+            seen += buckets[index];
+            if (seen >= rank) {
+                return std::min(upperBound(index), max);
+            }
+        }
+
+        return max;
+    }
+};
+
+#endif // OPSIAN_LOG_LINEAR_BUCKETS_H
@@ -1,5 +1,8 @@
 #include "log_writer.h"
 #include "collector_controller.h"
+#include "perf_events.h"
+#include "runtime_lock_profiler.h"
+#include <algorithm>
 #include <cstdlib>
 #include "unistd.h"
 #include <google/protobuf/util/delimited_message_util.h>
@@ -84,6 +87,13 @@ void LogWriter::recordStackTrace(
 
     data::StackSample* stackSample = frameAgentEnvelope_.mutable_stack_sample();
     setSampleType(signum, stackSample);
+    // A runtime lock wait sample's weight is its wait, otherwise a weighted sample stands for that many intervals of
+    // the thread's time
+    stackSample->set_wait_time_micros(signum == RUNTIME_LOCK_SIGNUM ? trace.weight : 0);
+    if (signum != RUNTIME_LOCK_SIGNUM && trace.weight > 1) {
+        stackSample->set_sample_rate_millis(stackSample->sample_rate_millis() * trace.weight);
+        stackSample->set_sample_rate_micros(stackSample->sample_rate_micros() * trace.weight);
+    }
     setSampleTime(ts, stackSample);
 
     threadName(trace.threadId, stackSample);
@@ -104,13 +114,24 @@ void LogWriter::recordStackTrace(
         debugLogger_ << "Broken stack trace len=" << numFrames << endl;
     }
 
-    for (int frameIndex = NUMBER_OF_SIGNAL_HANDLER_FRAMES; frameIndex < numFrames; frameIndex++) {
+    // Allocation and runtime lock wait samples are taken outside of a signal handler and start at the sampled site
+    const bool isSignalled =
+        signum == SIGPROF || signum == SIGALRM || perf_event_of_signal(signum) != NUMBER_OF_PERF_EVENTS;
+    const int firstFrame = isSignalled ? NUMBER_OF_SIGNAL_HANDLER_FRAMES : 0;
+    // Frames are innermost first, so the first GC entry point found is the phase the sample was taken in
+    GcPhase gcPhase = GC_PHASE_MUTATOR;
+    for (int frameIndex = firstFrame; frameIndex < numFrames; frameIndex++) {
         uintptr_t pc = frames[frameIndex].frame;
         bool isForeign = frames[frameIndex].isForeign;
         vector<Location>& locations = lookup_locations(pc, isForeign);
         addFrames(locations, stackSample, isError, debugLogger_);
+        if (isForeign && gcPhase == GC_PHASE_MUTATOR) {
+            gcPhase = gc_phase_of_frame(locations, GC_PHASE_MUTATOR);
+        }
     }
 
+    stackSample->set_gc_phase(static_cast<data::GcPhase>(gcPhase));
+
     stackSample->set_has_max_frames(numFrames >= MAX_FRAMES);
 
     recordWithSize(frameAgentEnvelope_);
@@ -131,13 +152,35 @@ void LogWriter::recordWithSize(data::AgentEnvelope& envelope) {
     debugLogger_ << "end send" << endl;
 }
 
+// Indexed by PerfEvent
+static const data::SampleTimeType PERF_EVENT_SAMPLE_TYPES[] = {
+    data::TASK_CLOCK,
+    data::PAGE_FAULTS,
+    data::CONTEXT_SWITCHES
+};
+
 void LogWriter::setSampleType(int signum, data::StackSample *stackSample) const {
+    const PerfEvent perfEvent = perf_event_of_signal(signum);
+    stackSample->set_event_period(perfEvent != NUMBER_OF_PERF_EVENTS ? perf_event_period(perfEvent) : 0);
+    stackSample->set_sample_rate_micros(0);
     if (signum == SIGPROF) {
         stackSample->set_type(data::PROCESS_TIME);
         stackSample->set_sample_rate_millis(controller_.processTimeStackSampleIntervalMillis());
     } else if (signum == SIGALRM) {
         stackSample->set_type(data::ELAPSED_TIME);
         stackSample->set_sample_rate_millis(controller_.elapsedTimeStackSampleIntervalMillis());
+    } else if (perfEvent == PERF_EVENT_TASK_CLOCK) {
+        // The task clock's period is in nanoseconds, and a whole number of microseconds
+        const uint64_t sampleRateMicros = perf_event_period(perfEvent) / 1000;
+        stackSample->set_type(data::TASK_CLOCK);
+        stackSample->set_sample_rate_micros(sampleRateMicros);
+        stackSample->set_sample_rate_millis(std::max((uint64_t) 1, (sampleRateMicros + 500) / 1000));
+    } else if (perfEvent != NUMBER_OF_PERF_EVENTS) {
+        stackSample->set_type(PERF_EVENT_SAMPLE_TYPES[perfEvent]);
+        stackSample->set_sample_rate_millis(0);
+    } else if (signum == RUNTIME_LOCK_SIGNUM) {
+        stackSample->set_type(data::RUNTIME_LOCK_WAIT);
+        stackSample->set_sample_rate_millis(0);
     } else {
         stackSample->set_type(data::ALLOCATION);
         stackSample->set_sample_rate_millis(0);
@@ -201,34 +244,47 @@ void LogWriter::threadName(pthread_t threadId, data::StackSample* stackSample) {
 //      Inspection code
 // ----------------------------
 
+// Pushed by the thread hooks as threads start and are named, threads that started before the hooks were enabled are
+// looked up with pthread_getname_np on their first sample instead
 void LogWriter::recordThread(
         int threadId,
         const string& name) {
 
-    // TODO: either re-add this when we hook thread creation or remove it.
-    /*ThreadInformation threadInformation = {
-        threadId,
-        name
-    };
+    const char* threadName = name.c_str();
+    if (!IsStructurallyValidUTF8(name.data(), name.size())) {
+        logError("Invalid thread name from thread hook '%s'\n", threadName);
+        threadName = "Invalid";
+    }
 
-    threadIdToInformation.insert({threadId, threadInformation});*/
+    ThreadInformation& threadInformation = threadIdToInformation[threadId];
+    threadInformation.threadId = threadId;
+    threadInformation.name = threadName;
 }
 
-void LogWriter::recordAllocation(uintptr_t allocationSize, bool outsideTlab, VMSymbol *symbol) {
+void LogWriter::recordThreadExit(int threadId) {
+    threadIdToInformation.erase(threadId);
+}
+
+void LogWriter::recordAllocation(
+    uintptr_t allocationSize,
+    uint32_t numberOfAllocations,
+    bool outsideTlab,
+    const CallFrame& site) {
+
     debugLogger_ << "LogWriter::recordAllocation" << endl;
 
-    AllocationKey key = make_pair(symbol, outsideTlab);
+    // Sends the method information for the site, if it's new, so the row's symbol is the method id. The innermost
+    // location is the function that allocated, even if it was inlined.
+    vector<Location>& locations = lookup_locations(site.frame, site.isForeign);
+    if (locations.empty()) {
+        return;
+    }
 
-    /*if ( !nameLookup_.isSymbolKnown(symbol) ) {
-        data::SymbolInformation* symbolInformation = frameAgentEnvelope_.mutable_symbol_information();
-        symbolInformation->set_symbol(reinterpret_cast<google::protobuf::uint64>(symbol));
-        symbolInformation->set_name(symbol->body(), symbol->length());
-        recordWithSize(frameAgentEnvelope_);
-    }*/
+    AllocationKey key = make_pair(locations.front().methodId, outsideTlab);
 
     AllocationRow &info = allocationsTable[key];
     info.totalBytesAllocated += allocationSize;
-    info.numberofAllocations++;
+    info.numberofAllocations += numberOfAllocations;
 }
 
 void LogWriter::recordAllocationTable() {
@@ -238,7 +294,9 @@ void LogWriter::recordAllocationTable() {
     // and thus can overlap with other log writing operations
     data::AgentEnvelope agentEnvelope_;
     data::AllocationTable* allocationTable = agentEnvelope_.mutable_allocation_table();
-    allocationTable->set_time_epoch_millis(0);
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    allocationTable->set_time_epoch_millis((now.tv_sec * 1000) + (now.tv_nsec / 1000000));
 
     AllocationsTable::iterator it = allocationsTable.begin();
     while (it != allocationsTable.end()) {
@@ -246,7 +304,7 @@ void LogWriter::recordAllocationTable() {
         AllocationRow& info = it->second;
 
         data::AllocationRow* row = allocationTable->add_rows();
-        row->set_symbol(reinterpret_cast<google::protobuf::uint64>(key.first));
+        row->set_symbol(key.first);
         row->set_number_of_allocations(info.numberofAllocations);
         row->set_total_bytes_allocated(info.totalBytesAllocated);
         row->set_outside_tlab(key.second);
@@ -259,6 +317,39 @@ void LogWriter::recordAllocationTable() {
     allocationsTable.clear();
 }
 
+void LogWriter::recordHeapProfile(const vector<HeapProfileRow>& rows) {
+    debugLogger_ << "LogWriter::recordHeapProfile" << endl;
+
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const long nowMillis = (now.tv_sec * 1000) + (now.tv_nsec / 1000000);
+
+    // Stack allocated for the same reason as recordAllocationTable's
+    data::AgentEnvelope agentEnvelope;
+    data::HeapProfile* heapProfile = agentEnvelope.mutable_heap_profile();
+    heapProfile->set_time_epoch_millis(nowMillis);
+    heapProfile->set_period_millis(previousHeapProfileMillis_ > 0 ? nowMillis - previousHeapProfileMillis_ : 0);
+    previousHeapProfileMillis_ = nowMillis;
+
+    for (auto it = rows.begin(); it != rows.end(); ++it) {
+        data::HeapProfileRow* row = heapProfile->add_rows();
+        for (auto frame = it->frames.begin(); frame != it->frames.end(); ++frame) {
+            vector<Location>& locations = lookup_locations(frame->frame, frame->isForeign);
+            for (auto location = locations.begin(); location != locations.end(); ++location) {
+                data::CompressedFrameEntry* frameEntry = row->add_compressedframes();
+                frameEntry->set_methodid(location->methodId);
+                frameEntry->set_line(location->lineNumber);
+            }
+        }
+        row->set_live_bytes(it->liveBytes);
+        row->set_live_samples(it->liveSamples);
+        row->set_promoted_bytes(it->promotedBytes);
+        row->set_promoted_samples(it->promotedSamples);
+    }
+
+    recordWithSize(agentEnvelope);
+}
+
 void LogWriter::recordNotification(data::NotificationCategory category, const string &initialPayload, const int value) {
     string payload;
 
@@ -351,9 +442,22 @@ void LogWriter::recordMetricInformation(const MetricInformation& info) {
     infoEnvelope->set_variability(var);
     infoEnvelope->set_unit(unit);
 
+    // A re-registered id's first value is absolute
+    MetricEncodingState& state = metricEncodingState(info.id);
+    state.isCounter = info.variability == MetricVariability::MONOTONIC;
+    state.hasPrevious = false;
+
     recordWithSize(frameAgentEnvelope_);
 }
 
+LogWriter::MetricEncodingState& LogWriter::metricEncodingState(const uint32_t metricId) {
+    if (metricId >= metricEncodingStates_.size()) {
+        metricEncodingStates_.resize(metricId + 1, MetricEncodingState{false, false, 0, false});
+    }
+
+    return metricEncodingStates_[metricId];
+}
+
 // override
 void LogWriter::recordMetricSamples(const long time_epoch_millis, const vector<MetricSample>& metricSamples) {
     auto samples_envelope = frameAgentEnvelope_.mutable_metric_samples();
@@ -361,6 +465,11 @@ void LogWriter::recordMetricSamples(const long time_epoch_millis, const vector<M
     samples_envelope->set_time_epoch_millis(static_cast<google::protobuf::uint64>(time_epoch_millis));
     samples_envelope->clear_samples();
 
+    if (deltaEncodeMetrics_) {
+        recordDeltaEncodedMetricSamples(samples_envelope, metricSamples);
+        return;
+    }
+
     for (auto it = metricSamples.begin(); it != metricSamples.end(); ++it) {
         auto& sample = *it;
         auto sample_envelope = samples_envelope->add_samples();
@@ -378,6 +487,69 @@ void LogWriter::recordMetricSamples(const long time_epoch_millis, const vector<M
     recordWithSize(frameAgentEnvelope_);
 }
 
+// See MetricSamples in data.proto for the encoding
+void LogWriter::recordDeltaEncodedMetricSamples(
+    data::MetricSamples* samplesEnvelope,
+    const vector<MetricSample>& metricSamples) {
+
+    const bool isKeyframe = metricSamplesSinceKeyframe_ == 0;
+    samplesEnvelope->clear_packed_metric_ids();
+    samplesEnvelope->clear_packed_long_values();
+    samplesEnvelope->clear_absent_metric_ids();
+    samplesEnvelope->set_keyframe(isKeyframe);
+
+    for (auto it = metricSamples.begin(); it != metricSamples.end(); ++it) {
+        auto& sample = *it;
+
+        if (sample.data.type == MetricDataType::STRING) {
+            auto sample_envelope = samplesEnvelope->add_samples();
+            sample_envelope->set_metricid(sample.id);
+            sample_envelope->set_stringvalue(sample.data.valueString);
+            continue;
+        }
+
+        if (sample.data.type != MetricDataType::LONG) {
+            continue;
+        }
+
+        MetricEncodingState& state = metricEncodingState(sample.id);
+        const int64_t value = sample.data.valueLong;
+        state.isSampled = true;
+        if (!isKeyframe && state.hasPrevious && state.previous == value) {
+            continue;
+        }
+
+        const bool isDelta = !isKeyframe && state.hasPrevious && state.isCounter;
+        samplesEnvelope->add_packed_metric_ids(sample.id);
+        samplesEnvelope->add_packed_long_values(isDelta ? value - state.previous : value);
+        state.previous = value;
+        state.hasPrevious = true;
+    }
+
+    // Some metrics are only sampled on some ticks, eg: a histogram's percentiles when it had observations, or a
+    // thread's metrics until it exits. Omitting them would be read as unchanged, so they're listed as absent.
+    for (uint32_t metricId = 0; metricId < metricEncodingStates_.size(); metricId++) {
+        MetricEncodingState& state = metricEncodingStates_[metricId];
+        if (!state.isSampled && state.hasPrevious) {
+            samplesEnvelope->add_absent_metric_ids(metricId);
+            state.hasPrevious = false;
+        }
+        state.isSampled = false;
+    }
+
+    metricSamplesSinceKeyframe_ = (metricSamplesSinceKeyframe_ + 1) % metricsKeyframeInterval_;
+
+    // Nothing changed, the next message can still be decoded against the same previous values
+    if (!isKeyframe &&
+        samplesEnvelope->packed_metric_ids_size() == 0 &&
+        samplesEnvelope->absent_metric_ids_size() == 0 &&
+        samplesEnvelope->samples_size() == 0) {
+        return;
+    }
+
+    recordWithSize(frameAgentEnvelope_);
+}
+
 void LogWriter::recordConstantMetricsComplete() {
     frameAgentEnvelope_.mutable_constant_metrics_complete();
     recordWithSize(frameAgentEnvelope_);
@@ -385,4 +557,11 @@ void LogWriter::recordConstantMetricsComplete() {
 
 void LogWriter::onSocketConnected() {
     clear_symbols();
+
+    // The collector decodes each connection's metric samples independently, so start it with a keyframe
+    metricSamplesSinceKeyframe_ = 0;
+    for (auto& state : metricEncodingStates_) {
+        state.hasPrevious = false;
+    }
+    previousHeapProfileMillis_ = 0;
 }
@@ -4,6 +4,7 @@
 #include <cstring>
 
 #include "circular_queue.h"
+#include "memory_profiler.h"
 #include "network.h"
 #include "symbol_table.h"
 
@@ -38,7 +39,8 @@ struct AllocationRow {
     }
 };
 
-typedef pair<VMSymbol*, bool> AllocationKey;
+// The allocating function's method id and whether the allocation was outside of the minor heap
+typedef pair<uint64_t, bool> AllocationKey;
 typedef unordered_map<AllocationKey, AllocationRow, boost::hash<AllocationKey>> AllocationsTable;
 
 void onNewFileCallback(void *data, const uint64_t fileId, const std::string& fileName);
@@ -56,7 +58,9 @@ public:
         CollectorController& controller,
         DebugLogger& debugLogger,
         int maxFramesToCapture,
-        bool logCorruption)
+        bool logCorruption,
+        bool deltaEncodeMetrics,
+        int metricsKeyframeInterval)
             : output_(output),
               buffer_(buffer),
               network_(network),
@@ -67,7 +71,12 @@ public:
               nameAgentEnvelope_(),
               debugLogger_(debugLogger),
               maxFramesToCapture_(maxFramesToCapture),
-              logCorruption_(logCorruption) {
+              logCorruption_(logCorruption),
+              deltaEncodeMetrics_(deltaEncodeMetrics),
+              metricsKeyframeInterval_(metricsKeyframeInterval > 0 ? metricsKeyframeInterval : 1),
+              metricSamplesSinceKeyframe_(0),
+              metricEncodingStates_(),
+              previousHeapProfileMillis_(0) {
         GOOGLE_PROTOBUF_VERIFY_VERSION;
 
         init_symbols(handleBtErrorCallback, onNewFileCallback, onNewFunctionCallback, &debugLogger, this);
@@ -92,9 +101,13 @@ public:
             int threadId,
             const string& name);
 
+    // override
+    virtual void recordThreadExit(int threadId);
+
     // override
     virtual void
-    recordAllocation(uintptr_t allocationSize, bool outsideTlab, VMSymbol* symbol);
+    recordAllocation(
+        uintptr_t allocationSize, uint32_t numberOfAllocations, bool outsideTlab, const CallFrame& site);
 
     // override
     virtual void
@@ -109,6 +122,8 @@ public:
     // override
     virtual void recordAllocationTable();
 
+    void recordHeapProfile(const vector<HeapProfileRow>& rows);
+
     // override
     virtual void recordConstantMetricsComplete();
 
@@ -145,6 +160,34 @@ private:
 
     bool logCorruption_;
 
+    // The last value sent of a metric, for delta encoding
+    struct MetricEncodingState {
+        bool isCounter;
+        bool hasPrevious;
+        int64_t previous;
+        // Whether it was sampled in the MetricSamples being encoded, metrics that had a value and weren't are sent
+        // as absent
+        bool isSampled;
+    };
+
+    bool deltaEncodeMetrics_;
+
+    int metricsKeyframeInterval_;
+
+    // 0 when the next MetricSamples is a keyframe
+    int metricSamplesSinceKeyframe_;
+
+    // Indexed by metric id
+    vector<MetricEncodingState> metricEncodingStates_;
+
+    long previousHeapProfileMillis_;
+
+    MetricEncodingState& metricEncodingState(const uint32_t metricId);
+
+    void recordDeltaEncodedMetricSamples(
+        data::MetricSamples* samplesEnvelope,
+        const vector<MetricSample>& metricSamples);
+
     void recordWithSize(data::AgentEnvelope& envelope);
 
     void setSampleTime(const timespec &ts, data::StackSample *stackSample) const;
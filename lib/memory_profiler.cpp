@@ -0,0 +1,328 @@
+#include "memory_profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+#include <unordered_map>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+
+extern "C" {
+
+#include "misc.h"
+
+#include <caml/alloc.h>
+#include <caml/callback.h>
+#include <caml/mlvalues.h>
+#include <caml/threads.h>
+
+  CAMLprim value opsian_memprof_alloc(value samples, value sizeInWords, value isMajor);
+  CAMLprim value opsian_memprof_promote(value sampleId);
+  CAMLprim value opsian_memprof_dealloc(value sampleId);
+}
+
+// Registered by lib_opsian.ml
+static const char* const START_CALLBACK_NAME = "opsian_memprof_start";
+static const char* const STOP_CALLBACK_NAME = "opsian_memprof_stop";
+
+static CircularQueue* queue_ = nullptr;
+
+// Read on the allocating threads
+static std::atomic_bool running_(false);
+static std::atomic_bool stackTraces_(false);
+static std::atomic<uint32_t> sampleIntervalWords_(DEFAULT_ALLOCATION_SAMPLE_INTERVAL_WORDS);
+
+// Only accessed on the processor thread
+static bool started_ = false;
+static bool registeredExit_ = false;
+static std::atomic_bool exiting_(false);
+
+// The main thread holds the runtime lock whilst it joins the processor thread at exit, so the profile can't be
+// stopped from the processor thread by then. This is registered after the processor thread's exit handler, so runs
+// before it.
+static void onMemoryProfilerExit() {
+    exiting_ = true;
+    running_ = false;
+}
+
+// ---- BEGIN Live Heap ----
+
+struct TrackedSample {
+    uint64_t stackHash;
+    uint64_t bytes;
+    bool live;
+};
+
+// Pointers so that they can be replaced in a forked child, where an allocating thread may have been holding the lock
+static boost::mutex* liveHeapMutex_ = new boost::mutex();
+// Indexed by slot, guarded by liveHeapMutex_
+static vector<TrackedSample>* trackedSamples_ = new vector<TrackedSample>();
+static vector<uint32_t>* freeSlots_ = new vector<uint32_t>();
+static std::unordered_map<uint64_t, HeapProfileRow>* heapStacks_ = new std::unordered_map<uint64_t, HeapProfileRow>();
+// Sample ids include the generation, so that the callbacks for blocks tracked by a previous profile are ignored
+static uint64_t generation_ = 0;
+
+static uint64_t hashFrames(const CallFrame* frames, const int numFrames) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037UL;
+    for (int i = 0; i < numFrames; i++) {
+        hash = (hash ^ frames[i].frame) * 1099511628211UL;
+        hash = (hash ^ frames[i].isForeign) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// Called with liveHeapMutex_, nullptr if the sample isn't tracked by the current profile
+static TrackedSample* findTrackedSample(const int64_t sampleId) {
+    if (sampleId < 0 || (uint64_t) sampleId / MAX_TRACKED_SAMPLES != generation_) {
+        return nullptr;
+    }
+
+    const uint32_t slot = sampleId % MAX_TRACKED_SAMPLES;
+    if (slot >= trackedSamples_->size() || !(*trackedSamples_)[slot].live) {
+        return nullptr;
+    }
+
+    return &(*trackedSamples_)[slot];
+}
+
+static int64_t trackSample(const CallFrame* frames, const int numFrames, const uint64_t bytes) {
+    const int stackFrames = std::min(numFrames, MAX_HEAP_PROFILE_FRAMES);
+    const uint64_t stackHash = hashFrames(frames, stackFrames);
+
+    boost::lock_guard<boost::mutex> guard(*liveHeapMutex_);
+
+    uint32_t slot;
+    if (!freeSlots_->empty()) {
+        slot = freeSlots_->back();
+        freeSlots_->pop_back();
+    } else if (trackedSamples_->size() < MAX_TRACKED_SAMPLES) {
+        slot = trackedSamples_->size();
+        trackedSamples_->push_back(TrackedSample());
+    } else {
+        return -1;
+    }
+
+    TrackedSample& sample = (*trackedSamples_)[slot];
+    sample.stackHash = stackHash;
+    sample.bytes = bytes;
+    sample.live = true;
+
+    auto it = heapStacks_->find(stackHash);
+    if (it == heapStacks_->end()) {
+        HeapProfileRow row;
+        row.frames.assign(frames, frames + stackFrames);
+        row.liveBytes = 0;
+        row.liveSamples = 0;
+        row.promotedBytes = 0;
+        row.promotedSamples = 0;
+        it = heapStacks_->insert({stackHash, row}).first;
+    }
+    it->second.liveBytes += bytes;
+    it->second.liveSamples++;
+
+    return (int64_t) (generation_ * MAX_TRACKED_SAMPLES + slot);
+}
+
+// Called when the profile starts or stops, Gc.Memprof doesn't call back for the blocks of a stopped profile
+static void clearLiveHeap() {
+    boost::lock_guard<boost::mutex> guard(*liveHeapMutex_);
+    generation_++;
+    trackedSamples_->clear();
+    freeSlots_->clear();
+    heapStacks_->clear();
+}
+
+void MemoryProfiler::onPromotion(const int64_t sampleId) {
+    boost::lock_guard<boost::mutex> guard(*liveHeapMutex_);
+
+    TrackedSample* sample = findTrackedSample(sampleId);
+    if (sample != nullptr) {
+        HeapProfileRow& row = (*heapStacks_)[sample->stackHash];
+        row.promotedBytes += sample->bytes;
+        row.promotedSamples++;
+    }
+}
+
+void MemoryProfiler::onDeallocation(const int64_t sampleId) {
+    boost::lock_guard<boost::mutex> guard(*liveHeapMutex_);
+
+    TrackedSample* sample = findTrackedSample(sampleId);
+    if (sample != nullptr) {
+        HeapProfileRow& row = (*heapStacks_)[sample->stackHash];
+        row.liveBytes -= sample->bytes;
+        row.liveSamples--;
+
+        sample->live = false;
+        freeSlots_->push_back(sampleId % MAX_TRACKED_SAMPLES);
+    }
+}
+
+void MemoryProfiler::snapshotHeapProfile(vector<HeapProfileRow>& rows) {
+    boost::lock_guard<boost::mutex> guard(*liveHeapMutex_);
+
+    auto it = heapStacks_->begin();
+    while (it != heapStacks_->end()) {
+        HeapProfileRow& row = it->second;
+        if (row.liveSamples > 0 || row.promotedSamples > 0) {
+            rows.push_back(row);
+        }
+
+        row.promotedBytes = 0;
+        row.promotedSamples = 0;
+
+        // Stacks are only kept whilst they've got live samples
+        if (row.liveSamples == 0) {
+            it = heapStacks_->erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// ---- END Live Heap ----
+
+static bool callMemprof(const char* callbackName, value argument) {
+    const value* callback = caml_named_value(callbackName);
+    if (callback == nullptr) {
+        logError("ERROR: %s isn't registered\n", callbackName);
+        return false;
+    }
+
+    const value result = caml_callback_exn(*callback, argument);
+    if (Is_exception_result(result)) {
+        logError("ERROR: %s raised an exception\n", callbackName);
+        return false;
+    }
+
+    return Bool_val(result);
+}
+
+void MemoryProfiler::init(CircularQueue* queue) {
+    queue_ = queue;
+}
+
+bool MemoryProfiler::start(const uint32_t sampleIntervalWords, const bool stackTraces) {
+    if (exiting_) {
+        return false;
+    }
+
+    if (!registeredExit_) {
+        atexit(onMemoryProfilerExit);
+        registeredExit_ = true;
+    }
+
+    const uint32_t intervalWords =
+        sampleIntervalWords > 0 ? sampleIntervalWords : DEFAULT_ALLOCATION_SAMPLE_INTERVAL_WORDS;
+    stackTraces_ = stackTraces;
+
+    if (started_ && intervalWords == sampleIntervalWords_) {
+        return true;
+    }
+
+    if (started_) {
+        stop();
+    }
+
+    sampleIntervalWords_ = intervalWords;
+    clearLiveHeap();
+
+    caml_acquire_runtime_system();
+    const value samplingRate = caml_copy_double(1.0 / intervalWords);
+    started_ = callMemprof(START_CALLBACK_NAME, samplingRate);
+    caml_release_runtime_system();
+
+    running_ = started_;
+    return started_;
+}
+
+void MemoryProfiler::stop() {
+    running_ = false;
+
+    if (started_ && !exiting_) {
+        caml_acquire_runtime_system();
+        callMemprof(STOP_CALLBACK_NAME, Val_unit);
+        caml_release_runtime_system();
+    }
+
+    started_ = false;
+    clearLiveHeap();
+}
+
+int64_t MemoryProfiler::onAllocation(const int64_t samples, const int64_t sizeInWords, const bool isMajor) {
+    if (!running_ || samples <= 0 || sizeInWords <= 0) {
+        return -1;
+    }
+
+    CallFrame frames[MAX_FRAMES];
+    ErrorHolder errorHolder;
+    errorHolder.errorCode = 0;
+    errorHolder.type = SUCCESS;
+
+    const int numFrames = linkable_handle(frames, &errorHolder);
+    if (errorHolder.type != SUCCESS) {
+        CircularQueue::allocationFailures++;
+        return -1;
+    }
+
+    // The stack starts with this function, the stub and caml_c_call, then the tracker's closure and then the code
+    // that allocated, as the unwinder follows the callback into OCaml back to the allocation.
+    int site = 0;
+    while (site < numFrames && frames[site].isForeign) {
+        site++;
+    }
+    site++;
+    if (site >= numFrames) {
+        CircularQueue::allocationFailures++;
+        return -1;
+    }
+
+    // Each sample stands for sampleIntervalWords_ words on average, so these are unbiased estimates of the site's
+    // allocations
+    const uint32_t intervalWords = sampleIntervalWords_;
+    const uintptr_t estimatedBytes = samples * intervalWords * sizeof(value);
+    const uint32_t estimatedAllocations = std::max((int64_t) 1, (samples * intervalWords) / sizeInWords);
+
+    // A major heap allocation is the analogue of an allocation outside of a TLAB
+    queue_->pushAllocation(estimatedBytes, estimatedAllocations, isMajor, frames[site]);
+
+    if (stackTraces_) {
+        CallTrace trace;
+        trace.frames = frames + site;
+        trace.num_frames = numFrames - site;
+        trace.threadId = pthread_self();
+        trace.weight = 1;
+        if (!queue_->pushStackTrace(trace, ALLOCATION_SIGNUM, 0, 0)) {
+            CircularQueue::allocationStackTraceFailures++;
+        }
+    }
+
+    return trackSample(frames + site, numFrames - site, estimatedBytes);
+}
+
+void MemoryProfiler::on_fork() {
+    // Memprof carries on in the child, but it's the collector's job to switch it back on
+    running_ = false;
+    started_ = false;
+
+    liveHeapMutex_ = new boost::mutex();
+    trackedSamples_->clear();
+    freeSlots_->clear();
+    heapStacks_->clear();
+}
+
+// ---- BEGIN OCaml stubs ----
+
+CAMLprim value opsian_memprof_alloc(value samples, value sizeInWords, value isMajor) {
+    return Val_long(MemoryProfiler::onAllocation(Long_val(samples), Long_val(sizeInWords), Bool_val(isMajor)));
+}
+
+CAMLprim value opsian_memprof_promote(value sampleId) {
+    MemoryProfiler::onPromotion(Long_val(sampleId));
+    return Val_unit;
+}
+
+CAMLprim value opsian_memprof_dealloc(value sampleId) {
+    MemoryProfiler::onDeallocation(Long_val(sampleId));
+    return Val_unit;
+}
@@ -0,0 +1,69 @@
+#ifndef OPSIAN_MEMORY_PROFILER_H
+#define OPSIAN_MEMORY_PROFILER_H
+
+#include "globals.h"
+#include "circular_queue.h"
+
+#include <vector>
+
+using std::vector;
+
+// Statistical allocation profiling using OCaml's Gc.Memprof, available on 4.12–4.14 and 5.3 onwards. The runtime
+// samples allocated words at random and calls the tracker registered in lib_opsian.ml, which calls back into
+// onAllocation on the allocating thread. Each sample is attributed to the allocation site's function in the allocation
+// table and, when stack traces are on, enqueued as an ALLOCATION stack sample.
+//
+// Samples are also tracked through their promotion to the major heap and their deallocation, in a table keyed by
+// sample id, so that the live sampled bytes and the bytes promoted of each allocation stack can be sent periodically
+// as a heap profile.
+
+// On average one sample is taken per this many words allocated, used when the collector doesn't specify a rate
+static const uint32_t DEFAULT_ALLOCATION_SAMPLE_INTERVAL_WORDS = 10000;
+static const uint64_t DEFAULT_ALLOCATION_PUSH_RATE_MILLIS = 10000;
+
+// Allocation stack samples aren't taken in a signal handler, so have no signal handler frames to skip
+static const int ALLOCATION_SIGNUM = 0;
+
+// Bounds the memory used by the live heap table, samples beyond this aren't tracked
+static const uint32_t MAX_TRACKED_SAMPLES = 1 << 18;
+// Heap profile stacks are truncated to this many frames from the allocation site
+static const int MAX_HEAP_PROFILE_FRAMES = 64;
+
+// The sampled allocations of an allocation stack
+struct HeapProfileRow {
+    vector<CallFrame> frames;
+    // Of the samples that are still alive
+    uint64_t liveBytes;
+    uint32_t liveSamples;
+    // Since the previous snapshot
+    uint64_t promotedBytes;
+    uint32_t promotedSamples;
+};
+
+class MemoryProfiler {
+public:
+    static void init(CircularQueue* queue);
+
+    // Called on the processor thread, takes the runtime lock. Restarts the profile if the interval has changed,
+    // returns false if Gc.Memprof isn't available in this OCaml version.
+    static bool start(const uint32_t sampleIntervalWords, const bool stackTraces);
+
+    // Called on the processor thread, takes the runtime lock
+    static void stop();
+
+    // Called on the allocating thread, from within the Gc.Memprof tracker. Returns the id to track the sample by, or
+    // -1 if it isn't tracked.
+    static int64_t onAllocation(const int64_t samples, const int64_t sizeInWords, const bool isMajor);
+
+    // Called from within the Gc.Memprof tracker, on whichever thread ran the collection
+    static void onPromotion(const int64_t sampleId);
+    static void onDeallocation(const int64_t sampleId);
+
+    // Called on the processor thread, the rows of the stacks with live samples or promotions since the previous
+    // snapshot
+    static void snapshotHeapProfile(vector<HeapProfileRow>& rows);
+
+    static void on_fork();
+};
+
+#endif // OPSIAN_MEMORY_PROFILER_H
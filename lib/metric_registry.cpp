@@ -0,0 +1,111 @@
+#include "metric_registry.h"
+
+MetricRegistry::MetricRegistry(CircularQueue& queue)
+    : queue_(queue),
+      registrations_(),
+      nameToHandle_(),
+      unannounced_(),
+      recorded_(),
+      samples_(),
+      pendingConstants_(0) {
+}
+
+MetricHandle MetricRegistry::registerMetric(
+    const string& name,
+    const MetricUnit unit,
+    const MetricVariability variability,
+    const MetricDataType dataType) {
+
+    auto it = nameToHandle_.find(name);
+    if (it != nameToHandle_.end()) {
+        return it->second;
+    }
+
+    // Handles start at 1 so that INVALID_METRIC_HANDLE is never handed out
+    const MetricHandle handle = (MetricHandle) registrations_.size() + 1;
+    nameToHandle_.insert({name, handle});
+
+    registrations_.push_back(Registration{
+        MetricInformation{name, handle, variability, dataType, unit},
+        false,
+        false,
+        MetricData{dataType, "", 0}
+    });
+
+    Registration& registration = registrations_.back();
+    registration.announced = queue_.pushMetricInformation(registration.info);
+    if (!registration.announced) {
+        unannounced_.push_back(handle);
+    }
+
+    return handle;
+}
+
+void MetricRegistry::markRecorded(Registration& registration, const MetricHandle handle) {
+    if (!registration.hasValue) {
+        registration.hasValue = true;
+        recorded_.push_back(handle);
+    }
+}
+
+void MetricRegistry::recordLong(const MetricHandle handle, const int64_t value) {
+    Registration& registration = registrations_[handle - 1];
+    markRecorded(registration, handle);
+    registration.value.valueLong = value;
+}
+
+void MetricRegistry::recordString(const MetricHandle handle, const string& value) {
+    Registration& registration = registrations_[handle - 1];
+    markRecorded(registration, handle);
+    registration.value.valueString = value;
+}
+
+void MetricRegistry::recordNotification(const data::NotificationCategory category, const string& payload) {
+    queue_.pushNotification(category, payload.c_str());
+}
+
+void MetricRegistry::flush(const long timestampInMs) {
+    for (auto it = unannounced_.begin(); it != unannounced_.end();) {
+        Registration& registration = registrations_[*it - 1];
+        registration.announced = queue_.pushMetricInformation(registration.info);
+        if (registration.announced) {
+            it = unannounced_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    samples_.clear();
+    pendingConstants_ = 0;
+
+    // Compact the recorded handles in place, keeping only the constants that couldn't be sent
+    auto kept = recorded_.begin();
+    for (auto it = recorded_.begin(); it != recorded_.end(); ++it) {
+        const MetricHandle handle = *it;
+        Registration& registration = registrations_[handle - 1];
+
+        if (registration.announced) {
+            samples_.push_back(MetricSample{handle, registration.value});
+        } else if (registration.info.variability == MetricVariability::CONSTANT) {
+            *kept++ = handle;
+            pendingConstants_++;
+            continue;
+        }
+
+        registration.hasValue = false;
+    }
+    recorded_.erase(kept, recorded_.end());
+
+    if (!samples_.empty()) {
+        queue_.pushMetricSamples(samples_, timestampInMs);
+    }
+}
+
+void MetricRegistry::clear() {
+    registrations_.clear();
+    nameToHandle_.clear();
+    unannounced_.clear();
+    recorded_.clear();
+    samples_.clear();
+    pendingConstants_ = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef OPSIAN_METRIC_REGISTRY_H
+#define OPSIAN_METRIC_REGISTRY_H
+
+#include "metric_types.h"
+#include "circular_queue.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+// Owns the metrics that the readers have registered. A metric's MetricInformation is only enqueued when it's
+// registered, after that values are recorded into a slot indexed by its handle and all the values recorded in a tick
+// are enqueued as one MetricSamples by flush(). Only used on the metrics thread, whilst holding the readers mutex.
+class MetricRegistry : public MetricDataListener {
+public:
+    explicit MetricRegistry(CircularQueue& queue);
+
+    virtual MetricHandle registerMetric(
+        const string& name,
+        const MetricUnit unit,
+        const MetricVariability variability,
+        const MetricDataType dataType);
+
+    virtual void recordLong(const MetricHandle handle, const int64_t value);
+
+    virtual void recordString(const MetricHandle handle, const string& value);
+
+    virtual void recordNotification(const data::NotificationCategory category, const string& payload);
+
+    // Retries announcing the metrics whose MetricInformation didn't fit in the queue and then enqueues the values
+    // recorded since the last flush. Values of metrics that still aren't announced are dropped, except for constants
+    // which are kept until their metric is announced.
+    void flush(const long timestampInMs);
+
+    bool noRemainingConstantsToSend() const {
+        return pendingConstants_ == 0;
+    }
+
+    // Forgets every registration, handles returned before are no longer valid
+    void clear();
+
+private:
+    struct Registration {
+        MetricInformation info;
+        bool announced;
+        bool hasValue;
+        MetricData value;
+    };
+
+    CircularQueue& queue_;
+    // Indexed by handle - 1
+    vector<Registration> registrations_;
+    // Only looked up when registering
+    unordered_map<string, MetricHandle> nameToHandle_;
+    vector<MetricHandle> unannounced_;
+    // Handles with a value recorded since the last flush
+    vector<MetricHandle> recorded_;
+    vector<MetricSample> samples_;
+    size_t pendingConstants_;
+
+    void markRecorded(Registration& registration, const MetricHandle handle);
+};
+
+#endif // OPSIAN_METRIC_REGISTRY_H
@@ -41,20 +41,43 @@ struct MetricData {
     int64_t valueLong;
 };
 
-struct MetricListenerEntry {
-    string name;
-    MetricVariability variability;
-    MetricUnit unit;
-    MetricData data;
-};
+// Identifies a registered metric, it's also the id the metric is announced with
+typedef uint32_t MetricHandle;
+
+static const MetricHandle INVALID_METRIC_HANDLE = 0;
 
 class MetricDataListener {
 public:
 
-    virtual void recordEntries(std::vector <MetricListenerEntry> &entries, const long timestampInMs) = 0;
+    // Registers a metric and announces it, returning the handle to record its values with. Registering a name that's
+    // already registered returns the existing handle.
+    virtual MetricHandle registerMetric(
+        const string& name,
+        const MetricUnit unit,
+        const MetricVariability variability,
+        const MetricDataType dataType) = 0;
+
+    virtual void recordLong(const MetricHandle handle, const int64_t value) = 0;
+
+    virtual void recordString(const MetricHandle handle, const string& value) = 0;
 
     virtual void recordNotification(const data::NotificationCategory category, const string& payload) = 0;
 
+    // Registers the metric on first use, so that readers only register the metrics that they emit
+    void record(
+        MetricHandle& handle,
+        const char* name,
+        const MetricUnit unit,
+        const MetricVariability variability,
+        const int64_t value) {
+
+        if (handle == INVALID_METRIC_HANDLE) {
+            handle = registerMetric(name, unit, variability, MetricDataType::LONG);
+        }
+
+        recordLong(handle, value);
+    }
+
     virtual ~MetricDataListener() = default;
 };
 
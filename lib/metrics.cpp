@@ -9,7 +9,6 @@
 #include <sys/types.h>
 
 static const string DURATION_NAME = "opsian.metrics.read_duration";
-static const uint32_t DURATION_ID = 1;
 static const uint32_t NANOS_IN_SECOND = 1000000000;
 static const uint64_t MAX_SLEEP_IN_MS = 200;
 
@@ -20,14 +19,6 @@ bool metrics_thread_running() {
     return running;
 }
 
-static const MetricInformation DURATION_INFO{
-    DURATION_NAME,
-    DURATION_ID,
-    MetricVariability::VARIABLE,
-    MetricDataType::LONG,
-    MetricUnit::NANOSECONDS
-};
-
 bool isPrefixDisabled(const string& entryName, vector<string>& disabledPrefixes) {
     for (auto it = disabledPrefixes.begin(); it != disabledPrefixes.end(); ++it) {
         const auto& enabledPrefix = *it;
@@ -89,12 +80,19 @@ void Metrics::enable(vector<string>& disabledPrefixes) {
 
     if (!enabled_) {
         cpudataReader_ = new CPUDataReader(disabledPrefixes);
+        cgroupReader_ = new CgroupReader(disabledPrefixes);
+        appMetricsReader_ = new AppMetricsReader(disabledPrefixes);
+        heapStatsReader_ = new HeapStatsReader(disabledPrefixes);
+        runtimeLockReader_ = new RuntimeLockReader(disabledPrefixes);
         eventRingReader_ = new EventRingReader(disabledPrefixes);
 
-        mustSendDurationMetric.store(true);
         needsToSendConstantMetrics = true;
     } else {
         cpudataReader_->updateEntryPrefixes(disabledPrefixes);
+        cgroupReader_->updateEntryPrefixes(disabledPrefixes);
+        appMetricsReader_->updateEntryPrefixes(disabledPrefixes);
+        heapStatsReader_->updateEntryPrefixes(disabledPrefixes);
+        runtimeLockReader_->updateEntryPrefixes(disabledPrefixes);
         eventRingReader_->updateEntryPrefixes(disabledPrefixes);
     }
 
@@ -110,13 +108,21 @@ void Metrics::disable() {
     if (enabled_) {
         delete cpudataReader_;
         cpudataReader_ = nullptr;
+        delete cgroupReader_;
+        cgroupReader_ = nullptr;
+        delete appMetricsReader_;
+        appMetricsReader_ = nullptr;
+        delete heapStatsReader_;
+        heapStatsReader_ = nullptr;
+        delete runtimeLockReader_;
+        runtimeLockReader_ = nullptr;
         eventRingReader_->disable();
         delete eventRingReader_;
         eventRingReader_ = nullptr;
-        metricNameToId.clear();
+        registry_.clear();
+        durationHandle_ = INVALID_METRIC_HANDLE;
     }
 
-    mustSendDurationMetric.store(false);
     enabled_ = false;
 }
 
@@ -131,117 +137,10 @@ time_t deltaInNs(timespec& start, timespec& end) {
     return durationInNs;
 }
 
-class InternalDataListener : public MetricDataListener {
-public:
-    InternalDataListener(unordered_map<string, uint32_t>& metricNameToId, CircularQueue& queue)
-            : queue_(queue),
-              metricNametoId_(metricNameToId),
-              retryEntries_() {}
-
-    virtual void recordEntries(
-        vector<MetricListenerEntry>& entries,
-        const long timestampInMs) {
-
-        vector<MetricSample> samples;
-        vector<MetricListenerEntry> failedConstantEntries;
-
-        attemptRecordEntries(entries, samples, failedConstantEntries);
-        attemptRecordEntries(retryEntries_, samples, failedConstantEntries);
-
-        queue_.pushMetricSamples(samples, timestampInMs);
-
-        retryEntries_ = failedConstantEntries;
-    }
-
-    void attemptRecordEntries(
-        const vector <MetricListenerEntry> &entries,
-        vector <MetricSample> &samples,
-        vector <MetricListenerEntry> &failedConstantEntries) {
-
-        for (auto it = entries.begin(); it != entries.end(); ++it) {
-            auto& entry = *it;
-            uint32_t metricId = findOrCreateMetricId(entry);
-
-            // If the metricId we get back is 0 then we failed to publish the MetricInformation to the buffer
-            // which means any samples we send would be unnamed. Instead we discard this sample and on the next
-            // iteration we'll try again for the next sample.
-            if (metricId == 0) {
-
-                // ... unless it's a constant in which case we keep it around for the next attempt
-                if (entry.variability == MetricVariability::CONSTANT) {
-                    failedConstantEntries.push_back(entry);
-                }
-
-                continue;
-            }
-
-            MetricSample sample;
-            sample.id = metricId;
-            sample.data = entry.data;
-
-            samples.push_back(sample);
-        }
-    }
-
-    bool noRemainingConstantsToSend() {
-        return retryEntries_.empty();
-    }
-
-    virtual void recordNotification(const data::NotificationCategory category, const string& payload) {
-        queue_.pushNotification(category, payload.c_str());
-        (payload.c_str());
-    }
-
-    void sendDuration(const uint64_t durationInMs, const timespec& timestamp) {
-        MetricSample durationSample{
-            DURATION_ID,
-            {MetricDataType::LONG, "", (int64_t) durationInMs}
-        };
-        std::vector<MetricSample> samples{};
-        samples.push_back(durationSample);
-        queue_.pushMetricSamples(samples, toMillis(timestamp));
-    }
-
-private:
-    uint32_t findOrCreateMetricId(const MetricListenerEntry& entry) {
-        auto mapIt = metricNametoId_.find(entry.name);
-
-        if (mapIt != metricNametoId_.end()) {
-            // Found it in the map
-            return mapIt->second;
-        } else {
-            // Didn't find it in the map, we need to create a new one
-            // also we need to publish the MetricInformation in to the queue
-            uint32_t metricId = (uint32_t) metricNametoId_.size() + 1; // start ids at 1
-            metricNametoId_.insert({entry.name, metricId});
-
-            MetricInformation info;
-            info.name = entry.name;
-            info.id = metricId;
-            info.dataType = entry.data.type;
-            info.variability = entry.variability;
-            info.unit = entry.unit;
-
-            if (queue_.pushMetricInformation(info)) {
-                return metricId;
-            } else {
-                metricNametoId_.erase(entry.name);
-                return 0;
-            }
-        }
-    }
-
-    CircularQueue& queue_;
-    unordered_map<string, uint32_t>& metricNametoId_;
-    vector<MetricListenerEntry> retryEntries_;
-};
-
 #define deltaInMs(start, end) deltaInNs(startWork, endWork) / 1000000
 
 void Metrics::run() {
     try {
-        InternalDataListener metricListener(metricNameToId, queue_);
-
         on_metrics_thread_start();
 
         scan_threads();
@@ -253,70 +152,71 @@ void Metrics::run() {
             // First do all the necessary work on the duty cycle
             clock_gettime(CLOCK_REALTIME, &startWork);
             const long startWorkInMs = toMillis(startWork);
-            sendDurationMetricId();
             scan_threads();
-            bool hasRemainingEvents = false;
             {
                 // Take the lock because we're going to be using the readers
                 // (also not safe to read enabled without it)
                 boost::lock_guard<boost::mutex> guard(readersMutex);
 
                 if (enabled_) {
-                    cpudataReader_->read(metricListener, startWorkInMs);
-                    hasRemainingEvents = eventRingReader_->read(metricListener, startWorkInMs) > 0;
-                    const bool noRemainingConstantsToSend = metricListener.noRemainingConstantsToSend();
-                    if (needsToSendConstantMetrics) {
-                        if (cpudataReader_->hasEmittedConstantMetrics() &&
-                            eventRingReader_->hasEmittedConstantMetrics() &&
-                            noRemainingConstantsToSend) {
-                            needsToSendConstantMetrics = !queue_.pushConstantMetricsComplete();
-                        }
-                    }
+                    cpudataReader_->read(registry_, startWorkInMs);
+                    cgroupReader_->read(registry_, startWorkInMs);
+                    appMetricsReader_->read(registry_, startWorkInMs);
+                    runtimeLockReader_->read(registry_, startWorkInMs);
+                    eventRingReader_->read(registry_, startWorkInMs);
+                    eventRingReader_->flush(registry_, startWorkInMs);
+                    // After the event ring's been read, on OCaml 5 that's where the heap statistics come from
+                    heapStatsReader_->read(registry_, startWorkInMs);
                 }
             }
 
             clock_gettime(CLOCK_REALTIME, &endWork);
 
-            time_t workInMs = deltaInMs(startWork, endWork);
+            const time_t workInMs = deltaInMs(startWork, endWork);
 //            printf("workInMs=%lu\n", workInMs);
 
             // Calculate the remaining time on the duty cycle window
             const uint64_t sampleRateInMs = sampleRateMillis_.load();
-            if (sampleRateInMs > workInMs) {
-                uint64_t remainingWindowInMs = sampleRateInMs - workInMs;
-//                printf("remainingWindowInMs=%lu\n", remainingWindowInMs);
-
-                // Poll as much as possible to try and eliminate the lost events messages
-                while (hasRemainingEvents) {
-                    clock_gettime(CLOCK_REALTIME, &startWork);
-                    const long startWorkInMs = toMillis(startWork);
-                    {
-                        boost::lock_guard <boost::mutex> guard(readersMutex);
-                        if (enabled_) {
-                            hasRemainingEvents = eventRingReader_->read(metricListener, startWorkInMs) > 0;
-                        } else {
-                            break;
-                        }
-                    }
-                    clock_gettime(CLOCK_REALTIME, &endWork);
-                    workInMs = deltaInMs(startWork, endWork);
-//                    printf("elimination poll workInMs=%lu\n", workInMs);
-                    if (workInMs >= remainingWindowInMs) {
-                        remainingWindowInMs = 0;
-                    } else {
-                        remainingWindowInMs -= workInMs;
+            const bool withinWindow = sampleRateInMs > workInMs;
+            const uint64_t remainingWindowInMs = withinWindow ? sampleRateInMs - workInMs : 0;
+//            printf("remainingWindowInMs=%lu\n", remainingWindowInMs);
+
+            {
+                boost::lock_guard<boost::mutex> guard(readersMutex);
+
+                if (enabled_) {
+                    if (withinWindow) {
+                        const uint64_t durationInMs = workInMs;
+                        registry_.record(
+                            durationHandle_,
+                            DURATION_NAME.c_str(),
+                            MetricUnit::MILLISECONDS,
+                            MetricVariability::VARIABLE,
+                            (int64_t) durationInMs);
                     }
-                }
 
-                const uint64_t durationInMs = sampleRateInMs - remainingWindowInMs;
-                metricListener.sendDuration(durationInMs, endWork);
+                    // Everything recorded on this tick is enqueued as one batch of samples
+                    registry_.flush(startWorkInMs);
 
-                // Sleep for any remaining time on the duty cycle
-//                printf("remaining sleep in ms=%lu\n", remainingWindowInMs);
-                if (remainingWindowInMs > 0 && running) {
-                    sleep_ms(remainingWindowInMs);
+                    if (needsToSendConstantMetrics) {
+                        if (cpudataReader_->hasEmittedConstantMetrics() &&
+                            cgroupReader_->hasEmittedConstantMetrics() &&
+                            appMetricsReader_->hasEmittedConstantMetrics() &&
+                            heapStatsReader_->hasEmittedConstantMetrics() &&
+                            runtimeLockReader_->hasEmittedConstantMetrics() &&
+                            eventRingReader_->hasEmittedConstantMetrics() &&
+                            registry_.noRemainingConstantsToSend()) {
+                            needsToSendConstantMetrics = !queue_.pushConstantMetricsComplete();
+                        }
+                    }
                 }
             }
+
+            // Sleep for any remaining time on the duty cycle
+//            printf("remaining sleep in ms=%lu\n", remainingWindowInMs);
+            if (remainingWindowInMs > 0 && running) {
+                sleep_ms(remainingWindowInMs);
+            }
         }
     } catch (const std::exception& e) {
         const char* what = e.what();
@@ -325,32 +225,27 @@ void Metrics::run() {
     }
 }
 
-void
-Metrics::sendDurationMetricId() {
-    // NB: Don't holding the readersMutex when enqueuing because the retrying of the queue can
-    // deadlock with the processor thread.
-    if (mustSendDurationMetric.load()) {
-        metricNameToId.insert({DURATION_NAME, DURATION_ID});
-        while (!queue_.pushMetricInformation(DURATION_INFO)) {
-            sleep_ms(1);
-        }
-
-        mustSendDurationMetric.store(false);
-    }
-}
-
 Metrics::~Metrics() {
     delete cpudataReader_;
+    delete cgroupReader_;
+    delete appMetricsReader_;
+    delete heapStatsReader_;
+    delete runtimeLockReader_;
     delete eventRingReader_;
 }
 
 void Metrics::on_fork() {
-    mustSendDurationMetric = false;
     enabled_ = false;
     sampleRateMillis_ = DEFAULT_METRICS_SAMPLE_RATE_MILLIS;
     cpudataReader_ = nullptr;
+    cgroupReader_ = nullptr;
+    appMetricsReader_ = nullptr;
+    heapStatsReader_ = nullptr;
+    runtimeLockReader_ = nullptr;
     eventRingReader_ = nullptr;
+    on_fork_runtime_events();
 //    readersMutex();
-    metricNameToId.clear();
+    registry_.clear();
+    durationHandle_ = INVALID_METRIC_HANDLE;
     needsToSendConstantMetrics = false;
 }
@@ -6,7 +6,12 @@
 #include <unordered_map>
 
 #include "cpudata_reader.h"
+#include "cgroup_reader.h"
+#include "app_metrics.h"
+#include "heap_stats_reader.h"
+#include "runtime_lock_profiler.h"
 #include "metric_types.h"
+#include "metric_registry.h"
 #include "circular_queue.h"
 #include "log_writer.h"
 #include "event_ring_reader.h"
@@ -29,13 +34,17 @@ public:
     explicit Metrics(DebugLogger& debugLogger, CircularQueue& queue)
     : debugLogger_(debugLogger),
       queue_(queue),
-      mustSendDurationMetric(false),
       enabled_(false),
       sampleRateMillis_(DEFAULT_METRICS_SAMPLE_RATE_MILLIS),
       eventRingReader_(nullptr),
       cpudataReader_(nullptr),
+      cgroupReader_(nullptr),
+      appMetricsReader_(nullptr),
+      heapStatsReader_(nullptr),
+      runtimeLockReader_(nullptr),
       readersMutex(),
-      metricNameToId(),
+      registry_(queue),
+      durationHandle_(INVALID_METRIC_HANDLE),
       needsToSendConstantMetrics(false) {}
 
     ~Metrics();
@@ -55,20 +64,23 @@ public:
 private:
     DebugLogger& debugLogger_;
     CircularQueue& queue_;
-    std::atomic_bool mustSendDurationMetric;
     bool enabled_;
     std::atomic<uint64_t> sampleRateMillis_;
 
     EventRingReader* eventRingReader_;
     CPUDataReader* cpudataReader_;
+    CgroupReader* cgroupReader_;
+    AppMetricsReader* appMetricsReader_;
+    HeapStatsReader* heapStatsReader_;
+    RuntimeLockReader* runtimeLockReader_;
     // Mutex can be held on the processor thread or metrics thread
     // Should not hold this mutex whilst retrying the enqueuing as that could deadlock with
     // the processor thread
     boost::mutex readersMutex;
-    unordered_map<string, uint32_t> metricNameToId;
+    // Guarded by readersMutex, the registry never retries enqueuing
+    MetricRegistry registry_;
+    MetricHandle durationHandle_;
     bool needsToSendConstantMetrics;
-
-    void sendDurationMetricId();
 };
 
 #endif // METRICS_H
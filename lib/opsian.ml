@@ -0,0 +1,68 @@
+(* Application metrics, published alongside the agent's own metrics and on the Prometheus endpoint.
+
+   Metrics are registered once, eg: at module initialisation, updates are then a single atomic write into memory
+   owned by the agent with no allocation and no lock, so they're cheap enough for hot paths. Names are prefixed with
+   "app." and any character other than [a-zA-Z0-9_-] is replaced with '_', so they can be disabled with the "app"
+   metrics prefix. *)
+
+type metric_unit =
+  | Count
+  | Bytes
+  | Milliseconds
+  | Nanoseconds
+
+(* The kinds must match AppMetricKind in app_metrics.h *)
+let counter_kind = 0
+let gauge_kind = 1
+let histogram_kind = 2
+
+external register_native : string -> int -> metric_unit -> int = "opsian_app_metric_register"
+
+let register kind ~metric_unit name =
+  let id = register_native name kind metric_unit in
+  if id < 0 then
+    invalid_arg ("Opsian: unable to register metric " ^ name ^
+                 ", too many metrics or it's already registered as a different kind");
+  id
+
+(* A total that only goes up, eg: requests handled. Exported as a Prometheus counter. *)
+module Counter = struct
+  type t = int
+
+  external add_native : (int [@untagged]) -> (int [@untagged]) -> unit =
+    "opsian_app_counter_add_byte" "opsian_app_counter_add" [@@noalloc]
+
+  let make ?(metric_unit = Count) name : t = register counter_kind ~metric_unit name
+
+  (* Negative amounts are ignored *)
+  let add (t : t) n = add_native t n [@@inline]
+
+  let incr (t : t) = add_native t 1 [@@inline]
+end
+
+(* A value that's sampled as it is at each metrics tick, eg: a queue's depth *)
+module Gauge = struct
+  type t = int
+
+  external set_native : (int [@untagged]) -> (int [@untagged]) -> unit =
+    "opsian_app_gauge_set_byte" "opsian_app_gauge_set" [@@noalloc]
+
+  let make ?(metric_unit = Count) name : t = register gauge_kind ~metric_unit name
+
+  let set (t : t) v = set_native t v [@@inline]
+end
+
+(* The distribution of observations, eg: request latencies. Each metrics tick reports the count, sum, max and the
+   50th, 90th and 99th percentiles of that tick's observations, which are exported as a Prometheus summary.
+   Percentiles are within 12.5% of the true value. *)
+module Histogram = struct
+  type t = int
+
+  external observe_native : (int [@untagged]) -> (int [@untagged]) -> unit =
+    "opsian_app_histogram_observe_byte" "opsian_app_histogram_observe" [@@noalloc]
+
+  let make ?(metric_unit = Count) name : t = register histogram_kind ~metric_unit name
+
+  (* Negative observations are recorded as 0 *)
+  let observe (t : t) v = observe_native t v [@@inline]
+end
@@ -0,0 +1,171 @@
+#include "perf_events.h"
+#include "globals.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct PerfEventDefinition {
+    const char* name;
+    uint64_t config;
+    // Context switches are counted in the kernel's scheduler, so are only seen when kernel events are included
+    bool include_kernel;
+};
+
+// Indexed by PerfEvent
+static const PerfEventDefinition PERF_EVENTS[] = {
+    {"task clock", PERF_COUNT_SW_TASK_CLOCK, false},
+    {"page faults", PERF_COUNT_SW_PAGE_FAULTS, false},
+    {"context switches", PERF_COUNT_SW_CONTEXT_SWITCHES, true}
+};
+
+static const uint64_t NANOS_IN_MICRO = 1000;
+// The kernel raises shorter task clock periods to this, as its hrtimer can't fire any faster
+static const uint64_t MIN_TASK_CLOCK_INTERVAL_US = 10;
+
+static uint64_t periods_[NUMBER_OF_PERF_EVENTS] = {0, 0, 0};
+// Set when a counter fails to open, eg: because perf_event_paranoid forbids it, so that the error's only logged once
+static std::atomic_bool unavailable_[NUMBER_OF_PERF_EVENTS];
+
+// Each counter holds a descriptor for as long as its thread lives, so the counters are limited to a share of the
+// process' descriptor limit, leaving the rest to the application. Threads started past the limit aren't counted.
+static const uint64_t DESCRIPTOR_LIMIT_SHARE = 4;
+static uint64_t maxOpenCounters_ = UINT64_MAX;
+static std::atomic<uint64_t> openCounters_(0);
+static std::atomic_bool loggedCounterLimit_(false);
+static std::atomic_bool loggedDescriptorsExhausted_(false);
+
+void configure_perf_events(const uint64_t taskClockIntervalInUs, const uint64_t pageFaultPeriod,
+                           const uint64_t contextSwitchPeriod) {
+    uint64_t taskClockInterval = taskClockIntervalInUs;
+    if (taskClockInterval > 0 && taskClockInterval < MIN_TASK_CLOCK_INTERVAL_US) {
+        logError("WARN: perfTaskClockIntervalUs of %lu is below the kernel's minimum, using %lu\n",
+                 taskClockInterval, MIN_TASK_CLOCK_INTERVAL_US);
+        taskClockInterval = MIN_TASK_CLOCK_INTERVAL_US;
+    }
+    periods_[PERF_EVENT_TASK_CLOCK] = taskClockInterval * NANOS_IN_MICRO;
+    periods_[PERF_EVENT_PAGE_FAULTS] = pageFaultPeriod;
+    periods_[PERF_EVENT_CONTEXT_SWITCHES] = contextSwitchPeriod;
+
+    rlimit descriptorLimit;
+    if (getrlimit(RLIMIT_NOFILE, &descriptorLimit) == 0 && descriptorLimit.rlim_cur != RLIM_INFINITY) {
+        maxOpenCounters_ = descriptorLimit.rlim_cur / DESCRIPTOR_LIMIT_SHARE;
+    }
+}
+
+bool is_perf_event_configured(const PerfEvent event) {
+    return periods_[event] > 0;
+}
+
+uint64_t perf_event_period(const PerfEvent event) {
+    return periods_[event];
+}
+
+int perf_event_signal(const PerfEvent event) {
+    return SIGRTMIN + event;
+}
+
+PerfEvent perf_event_of_signal(const int signum) {
+    const int event = signum - SIGRTMIN;
+    if (event < 0 || event >= NUMBER_OF_PERF_EVENTS || !is_perf_event_configured(static_cast<PerfEvent>(event))) {
+        return NUMBER_OF_PERF_EVENTS;
+    }
+
+    return static_cast<PerfEvent>(event);
+}
+
+void rearm_perf_event(const siginfo_t* info) {
+    if (info != nullptr && info->si_fd > 0) {
+        ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+}
+
+static int perf_event_open(perf_event_attr* attr, const pid_t tid) {
+    return syscall(__NR_perf_event_open, attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Delivers the counter's overflow signal to the thread that it counts, with the counter's fd in si_fd
+static bool own_perf_event(const int fd, const pid_t tid, const int signum) {
+    f_owner_ex owner;
+    owner.type = F_OWNER_TID;
+    owner.pid = tid;
+
+    const int flags = fcntl(fd, F_GETFL);
+    return flags != -1 &&
+        fcntl(fd, F_SETFL, flags | O_ASYNC) == 0 &&
+        fcntl(fd, F_SETSIG, signum) == 0 &&
+        fcntl(fd, F_SETOWN_EX, &owner) == 0;
+}
+
+int open_perf_event(const pid_t tid, const PerfEvent event) {
+    if (!is_perf_event_configured(event) || unavailable_[event].load()) {
+        return -1;
+    }
+
+    const PerfEventDefinition& definition = PERF_EVENTS[event];
+
+    if (openCounters_.fetch_add(1) >= maxOpenCounters_) {
+        openCounters_--;
+        if (!loggedCounterLimit_.exchange(true)) {
+            logError("WARN: %lu perf event counters are open, a 1/%lu share of the descriptor limit, later threads "
+                     "won't be sampled by perf events until others exit. Raise the limit with ulimit -n.\n",
+                     maxOpenCounters_, DESCRIPTOR_LIMIT_SHARE);
+        }
+        return -1;
+    }
+
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_SOFTWARE;
+    attr.config = definition.config;
+    attr.sample_period = periods_[event];
+    attr.disabled = 1;
+    attr.exclude_kernel = definition.include_kernel ? 0 : 1;
+    attr.exclude_hv = 1;
+
+    const int fd = perf_event_open(&attr, tid);
+    if (fd == -1) {
+        openCounters_--;
+        if (errno == EMFILE || errno == ENFILE) {
+            // Descriptors can be freed up again, so later threads still get counters
+            if (!loggedDescriptorsExhausted_.exchange(true)) {
+                logError("WARN: Out of file descriptors opening the %s perf event, some threads won't be sampled "
+                         "by perf events: %s\n", definition.name, strerror(errno));
+            }
+        } else if (errno != ESRCH && !unavailable_[event].exchange(true)) {
+            // A thread that's exited since it was listed isn't an error, anything else, eg: EACCES, ENOENT or
+            // EOPNOTSUPP, won't change for the life of the process
+            logError("Unable to open the %s perf event, it won't be sampled: %s\n", definition.name, strerror(errno));
+        }
+        return -1;
+    }
+
+    if (!own_perf_event(fd, tid, perf_event_signal(event)) ||
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0) != 0 ||
+        ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) != 0) {
+        logError("Unable to arm the %s perf event: %s\n", definition.name, strerror(errno));
+        close(fd);
+        openCounters_--;
+        return -1;
+    }
+
+    return fd;
+}
+
+void close_perf_event(const int fd) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    close(fd);
+    openCounters_--;
+}
+
+void close_inherited_perf_event(const int fd) {
+    close(fd);
+    openCounters_--;
+}
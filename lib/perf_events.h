@@ -0,0 +1,45 @@
+#ifndef OPSIAN_PERF_EVENTS_H
+#define OPSIAN_PERF_EVENTS_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Stack sampling driven by perf_event_open software events rather than timers. Each sampled thread has a counter per
+// configured event, which signals the thread itself through F_SETSIG once every period events, so that page fault
+// and context switch samples are taken on the thread at the point it faulted or was switched back in. The task clock
+// is the thread's CPU time at the kernel's hrtimer precision, which is finer than ITIMER_PROF's.
+//
+// Each counter is disabled after it signals and rearmed by the signal handler, so a thread has at most one of each
+// event's signals pending. The counters are opened and closed with the thread registry in proc_scanner.cpp.
+
+enum PerfEvent {
+    PERF_EVENT_TASK_CLOCK,
+    PERF_EVENT_PAGE_FAULTS,
+    PERF_EVENT_CONTEXT_SWITCHES,
+    NUMBER_OF_PERF_EVENTS
+};
+
+// Called before the profiler starts, a period of 0 leaves that event off
+void configure_perf_events(const uint64_t taskClockIntervalInUs, const uint64_t pageFaultPeriod,
+                           const uint64_t contextSwitchPeriod);
+
+bool is_perf_event_configured(const PerfEvent event);
+// The task clock's period is in nanoseconds, the others' in events
+uint64_t perf_event_period(const PerfEvent event);
+
+// Each event signals with its own real time signal
+int perf_event_signal(const PerfEvent event);
+// The event that signals with signum, or NUMBER_OF_PERF_EVENTS if it isn't a perf event signal
+PerfEvent perf_event_of_signal(const int signum);
+
+// Called from the signal handler with the signal's info, counting restarts towards the next signal
+void rearm_perf_event(const siginfo_t* info);
+
+// Opens and arms the event's counter for the thread, returns its file descriptor or -1
+int open_perf_event(const pid_t tid, const PerfEvent event);
+void close_perf_event(const int fd);
+// Closes a counter inherited across fork, which mustn't be disabled as the parent shares it
+void close_inherited_perf_event(const int fd);
+
+#endif //OPSIAN_PERF_EVENTS_H
@@ -0,0 +1,160 @@
+#include "proc_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// Most of the files we read are well below this, it grows if not
+static const size_t INITIAL_BUFFER_SIZE = 4096;
+
+ProcFile::ProcFile(const char* name)
+  : fd_(open(name, O_RDONLY | O_CLOEXEC)),
+    buffer_(INITIAL_BUFFER_SIZE),
+    length_(0),
+    openError_(fd_ < 0),
+    error_(fd_ < 0 ? strerror(errno) : "") {
+}
+
+ProcFile::ProcFile()
+  : fd_(-1),
+    buffer_(INITIAL_BUFFER_SIZE),
+    length_(0),
+    openError_(false),
+    error_("") {
+}
+
+ProcFile::~ProcFile() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool ProcFile::read() {
+    return readFrom(fd_);
+}
+
+bool ProcFile::read(const char* path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    const bool isRead = readFrom(fd);
+    close(fd);
+    return isRead;
+}
+
+bool ProcFile::readFrom(const int fd) {
+    if (fd < 0) {
+        return false;
+    }
+
+    length_ = 0;
+    while (true) {
+        // Leave space for the nul terminator
+        const size_t available = buffer_.size() - length_ - 1;
+        const ssize_t bytesRead = pread(fd, buffer_.data() + length_, available, length_);
+        if (bytesRead < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            length_ = 0;
+            buffer_[0] = '\0';
+            return false;
+        }
+
+        if (bytesRead == 0) {
+            break;
+        }
+
+        length_ += bytesRead;
+        if (length_ == buffer_.size() - 1) {
+            buffer_.resize(buffer_.size() * 2);
+        }
+    }
+
+    buffer_[length_] = '\0';
+    return true;
+}
+
+bool ProcLineParser::nextLine(const char*& begin, const char* end, const char*& lineEnd) {
+    if (begin >= end) {
+        return false;
+    }
+
+    lineEnd = (const char*) memchr(begin, '\n', end - begin);
+    if (lineEnd == nullptr) {
+        lineEnd = end;
+    }
+
+    return true;
+}
+
+// A trailing newline is treated as a separator so that single value files can be parsed without splitting lines
+static inline bool isSeparator(const char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+void ProcLineParser::skipSpaces() {
+    while (cursor_ < end_ && isSeparator(*cursor_)) {
+        cursor_++;
+    }
+}
+
+bool ProcLineParser::nextField(const char*& fieldBegin, size_t& fieldLength) {
+    skipSpaces();
+    if (cursor_ >= end_) {
+        return false;
+    }
+
+    fieldBegin = cursor_;
+    while (cursor_ < end_ && !isSeparator(*cursor_)) {
+        cursor_++;
+    }
+    fieldLength = cursor_ - fieldBegin;
+
+    return true;
+}
+
+bool ProcLineParser::nextInt64(int64_t& value) {
+    skipSpaces();
+
+    bool negative = false;
+    if (cursor_ < end_ && *cursor_ == '-') {
+        negative = true;
+        cursor_++;
+    }
+
+    const char* digitsBegin = cursor_;
+    int64_t result = 0;
+    while (cursor_ < end_ && *cursor_ >= '0' && *cursor_ <= '9') {
+        result = result * 10 + (*cursor_ - '0');
+        cursor_++;
+    }
+
+    // Must have at least one digit and end at a field boundary
+    if (cursor_ == digitsBegin || (cursor_ < end_ && !isSeparator(*cursor_))) {
+        return false;
+    }
+
+    value = negative ? -result : result;
+    return true;
+}
+
+bool ProcLineParser::skipFields(int count) {
+    const char* field;
+    size_t fieldLength;
+    for (int i = 0; i < count; i++) {
+        if (!nextField(field, fieldLength)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool fieldEquals(const char* field, const size_t fieldLength, const char* expected) {
+    return strncmp(field, expected, fieldLength) == 0 && expected[fieldLength] == '\0';
+}
@@ -0,0 +1,93 @@
+#ifndef OPSIAN_PROC_FILE_H
+#define OPSIAN_PROC_FILE_H
+
+#include "globals.h"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// A /proc (or /sys) file that's kept open and re-read with pread() from offset 0 on each read(), into a buffer that's
+// reused across reads. Avoids the open/close and the stream and string allocations per read on the metrics thread.
+class ProcFile {
+public:
+    explicit ProcFile(const char* name);
+
+    // Not bound to a file, only read(path) can be used. For files that there are too many of to keep open, eg: those of
+    // each thread, the buffer is shared by all of them.
+    ProcFile();
+
+    ~ProcFile();
+
+    // Reads the whole file, returns false if the file couldn't be opened or read. The contents are nul terminated
+    // and only valid until the next read().
+    bool read();
+
+    // Opens, reads and closes the file at path, with the same contract as read()
+    bool read(const char* path);
+
+    const char* begin() const {
+        return buffer_.data();
+    }
+
+    const char* end() const {
+        return buffer_.data() + length_;
+    }
+
+    bool hasOpenError() {
+        if (openError_) {
+            openError_ = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    string& getError() {
+        return error_;
+    }
+
+private:
+    int fd_;
+    vector<char> buffer_;
+    size_t length_;
+    bool openError_;
+    string error_;
+
+    bool readFrom(const int fd);
+
+    DISALLOW_COPY_AND_ASSIGN(ProcFile);
+};
+
+// Scans the fields of a line in place, fields are separated by one or more spaces, tabs or newlines.
+class ProcLineParser {
+public:
+    ProcLineParser(const char* begin, const char* end)
+      : cursor_(begin),
+        end_(end) {
+    }
+
+    // Finds the next line of the contents starting at begin, returns false at the end of the contents
+    static bool nextLine(const char*& begin, const char* end, const char*& lineEnd);
+
+    // Returns the next field, or false if there are no more fields on the line
+    bool nextField(const char*& fieldBegin, size_t& fieldLength);
+
+    // Parses the next field as a (possibly negative) decimal integer, returns false if it's missing or malformed
+    bool nextInt64(int64_t& value);
+
+    // Skips a number of fields, returns false if the line has fewer fields
+    bool skipFields(int count);
+
+private:
+    const char* cursor_;
+    const char* end_;
+
+    void skipSpaces();
+};
+
+// true if the field is exactly the expected nul terminated string
+bool fieldEquals(const char* field, const size_t fieldLength, const char* expected);
+
+#endif //OPSIAN_PROC_FILE_H
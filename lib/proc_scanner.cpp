@@ -1,26 +1,117 @@
 #include "proc_scanner.h"
 #include "globals.h"
 #include "debug_logger.h"
+#include "perf_events.h"
+#include "wallclock_sampler.h"
 #include "limits.h"
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
 #include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <stdlib.h>
+#include <vector>
 
 #define MS_TO_NS 1000000
+#define S_TO_NS 1000000000
 #define NOT_SCANNING ULONG_MAX
+// Threads are registered by the pthread_create hook as they start, the /proc scan only has to find the threads that
+// weren't, eg: those started before the agent, so it's run every this many metrics ticks. Until the hook's seen to run,
+// eg: in bytecode, where the dlopen'ed stubs don't interpose libc's pthread_create, the scan's run on every tick.
+#define TICKS_BETWEEN_PROC_SCANS 10
+// The CPU time clock of another thread of the process, as glibc's pthread_getcpuclockid makes it:
+// MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED). CLOCK_THREAD_CPUTIME_ID is always the calling thread's.
+#define THREAD_CPU_CLOCK(tid) ((~(clockid_t) (tid) << 3) | 6)
+
+// A registered thread
+struct RegisteredThread {
+    // Of the /proc scan it was registered in
+    uint64_t scan_generation;
+    clockid_t cpu_clock;
+};
+
+struct ThreadTimer {
+    timer_t timer_id;
+    clockid_t clock;
+};
+
+// A timer per thread, signalling the thread at an interval of a clock. The interval's set by the processor thread
+// and picked up by the metrics thread on its next scan.
+struct ThreadTimers {
+    // The thread's own CPU time clock, otherwise CLOCK_MONOTONIC
+    const bool is_cpu_time;
+    const int signal_number;
+    std::atomic_uint64_t atomic_interval_in_ns;
+    uint64_t local_interval_in_ns;
+    // Keyed by the thread the timer signals, so that the timers of exited threads can be deleted
+    std::unordered_map<pid_t, ThreadTimer> timers;
+
+    ThreadTimers(const bool is_cpu_time, const int signal_number)
+        : is_cpu_time(is_cpu_time),
+          signal_number(signal_number),
+          atomic_interval_in_ns(NOT_SCANNING),
+          local_interval_in_ns(NOT_SCANNING),
+          timers() {
+    }
 
+    bool is_running() const {
+        return local_interval_in_ns != NOT_SCANNING;
+    }
+};
+
+// A perf event counter per thread, switched on and off by the processor thread and picked up by the metrics thread on
+// its next scan
+struct ThreadPerfEvents {
+    std::atomic_bool atomic_running;
+    bool local_running;
+    // Keyed by the thread the counter counts
+    std::unordered_map<pid_t, int> fds;
+
+    ThreadPerfEvents()
+        : atomic_running(false),
+          local_running(false),
+          fds() {
+    }
+};
+
+// Guards registered_threads_, scan_generation_, the timers and the perf events, which are updated by the metrics
+// thread and by threads as they start and exit. A pointer so that it can be replaced in a forked child, where another
+// thread may have been holding it.
+boost::mutex* threads_mutex_ = new boost::mutex();
+// The live threads, excluding the agent's own, to the generation of the /proc scan they were registered in
+std::unordered_map<pid_t, RegisteredThread> registered_threads_{};
+// Threads that the exit hook has unregistered, to the scan generation they exited in. A thread's still listed in /proc
+// for a moment after its exit hook runs, so a scan mustn't register it again. Kept until a scan that started after the
+// exit has finished.
+std::unordered_map<pid_t, uint64_t> exited_threads_{};
+uint64_t scan_generation_(0);
+int ticks_until_proc_scan_(0);
+
+// The registered threads as of the last tick, only used on the metrics thread
 std::unordered_set<pid_t> last_scan_threads_{};
-std::unordered_set<timer_t> timers_{};
+
+ThreadTimers wallclock_timers_(false, SIGALRM);
+// Only used in the per-thread CPU sampling mode, otherwise the process-wide ITIMER_PROF signals CPU samples
+ThreadTimers cpu_timers_(true, SIGPROF);
+// Indexed by PerfEvent
+ThreadPerfEvents perf_events_[NUMBER_OF_PERF_EVENTS];
 
 pid_t metrics_thread_id_(0);
 pid_t processor_thread_id_(0);
+std::atomic<pid_t> events_thread_id_(0);
+std::atomic<pid_t> sampler_thread_id_(0);
 
 std::atomic_bool metrics_thread_started_(false);
 std::atomic_bool processor_thread_started_(false);
+std::atomic_bool thread_list_required_(false);
+// The hooks are ignored until the agent has initialized, the first /proc scan finds the threads started before then
+std::atomic_bool thread_hooks_enabled_(false);
+// Set the first time the pthread_create hook starts a thread, which it only does when it's interposed
+std::atomic_bool thread_hooks_live_(false);
 
-std::atomic_uint64_t atomic_interval_in_ns_(NOT_SCANNING);
-uint64_t local_interval_in_ns_(NOT_SCANNING);
+void forget_thread(const pid_t tid);
 
 // --------------------
 //   Processor Thread
@@ -28,19 +119,54 @@ uint64_t local_interval_in_ns_(NOT_SCANNING);
 
 void on_processor_thread_start() {
     processor_thread_id_ = getTid();
+    forget_thread(processor_thread_id_);
     processor_thread_started_.store(true);
 }
 
 bool is_scanning_threads() {
-    return atomic_interval_in_ns_.load() != NOT_SCANNING;
+    return wallclock_timers_.atomic_interval_in_ns.load() != NOT_SCANNING;
 }
 
 void update_scanning_threads_interval(const uint64_t interval_in_ms) {
-    atomic_interval_in_ns_.store(interval_in_ms * MS_TO_NS);
+    wallclock_timers_.atomic_interval_in_ns.store(interval_in_ms * MS_TO_NS);
 }
 
 void stop_scanning_threads() {
-    update_scanning_threads_interval(NOT_SCANNING);
+    wallclock_timers_.atomic_interval_in_ns.store(NOT_SCANNING);
+}
+
+bool is_cpu_timing_threads() {
+    return cpu_timers_.atomic_interval_in_ns.load() != NOT_SCANNING;
+}
+
+void update_cpu_timers_interval(const uint64_t interval_in_ms) {
+    cpu_timers_.atomic_interval_in_ns.store(interval_in_ms * MS_TO_NS);
+}
+
+void stop_cpu_timers() {
+    cpu_timers_.atomic_interval_in_ns.store(NOT_SCANNING);
+}
+
+bool is_counting_perf_events() {
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        if (perf_events_[event].atomic_running.load()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void start_perf_events() {
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        perf_events_[event].atomic_running.store(is_perf_event_configured(static_cast<PerfEvent>(event)));
+    }
+}
+
+void stop_perf_events() {
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        perf_events_[event].atomic_running.store(false);
+    }
 }
 
 // -------------------
@@ -49,13 +175,43 @@ void stop_scanning_threads() {
 
 void on_metrics_thread_start() {
     metrics_thread_id_ = getTid();
+    forget_thread(metrics_thread_id_);
     metrics_thread_started_.store(true);
 }
 
+void set_thread_list_required(const bool required) {
+    thread_list_required_.store(required);
+}
+
+const std::unordered_set<pid_t>& scanned_threads() {
+    return last_scan_threads_;
+}
+
+void start_perf_event(const pid_t tid, const PerfEvent event) {
+    const int fd = open_perf_event(tid, event);
+    if (fd != -1) {
+        perf_events_[event].fds[tid] = fd;
+    }
+}
+
+void close_thread_perf_event(const pid_t tid, ThreadPerfEvents& thread_perf_events) {
+    auto it = thread_perf_events.fds.find(tid);
+    if (it != thread_perf_events.fds.end()) {
+        close_perf_event(it->second);
+        thread_perf_events.fds.erase(it);
+    }
+}
+
+size_t live_timer_count() {
+    boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+    return wallclock_timers_.timers.size() + cpu_timers_.timers.size();
+}
+
 void set_timer_interval(const long interval_ns, const timer_t& timer_id) {
     struct itimerspec timerSpec;
-    timerSpec.it_interval.tv_sec = 0;
-    timerSpec.it_interval.tv_nsec = interval_ns;
+    // tv_nsec must be under a second
+    timerSpec.it_interval.tv_sec = interval_ns / S_TO_NS;
+    timerSpec.it_interval.tv_nsec = interval_ns % S_TO_NS;
     timerSpec.it_value = timerSpec.it_interval;
     const int ret = timer_settime(timer_id, 0, &timerSpec, 0);
     if (ret) {
@@ -63,12 +219,8 @@ void set_timer_interval(const long interval_ns, const timer_t& timer_id) {
     }
 }
 
-void start_timer(
-    const pid_t tid,
-    const clockid_t clock_type,
-    const int signal_number,
-    const long interval_ns) {
-
+void start_timer(const pid_t tid, const RegisteredThread& thread, ThreadTimers& thread_timers) {
+    const clockid_t clock = thread_timers.is_cpu_time ? thread.cpu_clock : CLOCK_MONOTONIC;
     struct sigevent sevp;
     timer_t timer_id;
     memset(&sevp, 0, sizeof(sevp));
@@ -78,43 +230,193 @@ void start_timer(
     // the internal linux kernel data structures having that field.
     // See https://sourceware.org/bugzilla/show_bug.cgi?id=27417 for portable solution
     sevp._sigev_un._tid = tid; // for per-thread
-    sevp.sigev_signo = signal_number;
-    const int ret = timer_create(clock_type, &sevp, &timer_id);
+    sevp.sigev_signo = thread_timers.signal_number;
+    const int ret = timer_create(clock, &sevp, &timer_id);
     if (ret != 0) {
         logError("aborting due to timer_create error: %s", strerror(errno));
         return;
     }
 
-    timers_.insert(timer_id);
+    thread_timers.timers[tid] = ThreadTimer{timer_id, clock};
 
-    set_timer_interval(interval_ns, timer_id);
+    set_timer_interval(thread_timers.local_interval_in_ns, timer_id);
 }
 
-void start_profiling_thread(const pid_t& tid) {
-    start_timer(tid, CLOCK_MONOTONIC, SIGALRM, local_interval_in_ns_);
-    // We can use CLOCK_THREAD_CPUTIME_ID if we want to to do per thread CPU timers
+void start_profiling_thread(const pid_t tid, const RegisteredThread& thread) {
+    if (wallclock_timers_.is_running() && !is_wallclock_sampler_configured()) {
+        start_timer(tid, thread, wallclock_timers_);
+    }
+
+    // A timer on the thread's CPU time clock only advances whilst that thread is on a CPU, so busy threads are sampled
+    // in proportion to their CPU time however many are running, unlike ITIMER_PROF's signals which go to whichever
+    // thread the kernel picks.
+    if (cpu_timers_.is_running()) {
+        start_timer(tid, thread, cpu_timers_);
+    }
+
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        if (perf_events_[event].local_running) {
+            start_perf_event(tid, static_cast<PerfEvent>(event));
+        }
+    }
 }
 
-void on_interval_change(const uint64_t atomic_interval_in_ns) {
-    const uint64_t old_local_interval_in_ns = local_interval_in_ns_;
-    local_interval_in_ns_ = atomic_interval_in_ns;
+// The kernel keeps a thread's timers until they're deleted, even once the thread has exited
+void delete_timer(const pid_t tid, ThreadTimers& thread_timers) {
+    auto it = thread_timers.timers.find(tid);
+    if (it != thread_timers.timers.end()) {
+        timer_delete(it->second.timer_id);
+        thread_timers.timers.erase(it);
+    }
+}
+
+void on_interval_change(ThreadTimers& thread_timers, const uint64_t atomic_interval_in_ns) {
+    const uint64_t old_local_interval_in_ns = thread_timers.local_interval_in_ns;
+    thread_timers.local_interval_in_ns = atomic_interval_in_ns;
 
     if (atomic_interval_in_ns == NOT_SCANNING) {
         // printf("stop scanning, disabled and delete existing timers\n");
-        for (const timer_t& timer: timers_) {
-            timer_delete(timer);
+        for (const auto& timer: thread_timers.timers) {
+            timer_delete(timer.second.timer_id);
         }
 
-        timers_.clear();
+        thread_timers.timers.clear();
     } else if (old_local_interval_in_ns == NOT_SCANNING) {
         // printf("start scanning, create timers\n");
-        for (const pid_t& thread: last_scan_threads_) {
-            start_profiling_thread(thread);
+        for (const auto& thread: registered_threads_) {
+            start_timer(thread.first, thread.second, thread_timers);
         }
     } else {
         // printf("update timer intervals\n");
-        for (const timer_t& timer: timers_) {
-            set_timer_interval(local_interval_in_ns_, timer);
+        for (const auto& timer: thread_timers.timers) {
+            set_timer_interval(thread_timers.local_interval_in_ns, timer.second.timer_id);
+        }
+    }
+}
+
+void check_interval_change(ThreadTimers& thread_timers) {
+    const uint64_t atomic_interval_in_ns = thread_timers.atomic_interval_in_ns.load();
+    if (atomic_interval_in_ns != thread_timers.local_interval_in_ns) {
+        on_interval_change(thread_timers, atomic_interval_in_ns);
+    }
+}
+
+void check_perf_event_change(const PerfEvent event) {
+    ThreadPerfEvents& thread_perf_events = perf_events_[event];
+    const bool atomic_running = thread_perf_events.atomic_running.load();
+    if (atomic_running == thread_perf_events.local_running) {
+        return;
+    }
+
+    thread_perf_events.local_running = atomic_running;
+    if (atomic_running) {
+        for (const auto& thread: registered_threads_) {
+            start_perf_event(thread.first, event);
+        }
+    } else {
+        for (const auto& fd: thread_perf_events.fds) {
+            close_perf_event(fd.second);
+        }
+
+        thread_perf_events.fds.clear();
+    }
+}
+
+// With a signal budget the wallclock timers are replaced by the sampler thread, which is given the threads to signal
+// after each tick. Called without holding threads_mutex_, as starting and stopping the sampler thread runs its hooks.
+void check_sampler_interval_change() {
+    const uint64_t atomic_interval_in_ns = wallclock_timers_.atomic_interval_in_ns.load();
+    if (atomic_interval_in_ns != wallclock_timers_.local_interval_in_ns) {
+        {
+            boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+            wallclock_timers_.local_interval_in_ns = atomic_interval_in_ns;
+        }
+
+        if (atomic_interval_in_ns == NOT_SCANNING) {
+            stop_wallclock_sampler();
+        } else {
+            start_wallclock_sampler(atomic_interval_in_ns);
+        }
+    }
+}
+
+bool is_agent_thread(const pid_t tid) {
+    return tid == metrics_thread_id_ || tid == processor_thread_id_ || tid == events_thread_id_.load() ||
+        tid == sampler_thread_id_.load();
+}
+
+void register_thread(const pid_t tid, const clockid_t cpu_clock) {
+    auto inserted = registered_threads_.insert({tid, RegisteredThread{scan_generation_, cpu_clock}});
+    if (inserted.second) {
+        start_profiling_thread(tid, inserted.first->second);
+    }
+}
+
+void unregister_thread(const pid_t tid) {
+    registered_threads_.erase(tid);
+    delete_timer(tid, wallclock_timers_);
+    delete_timer(tid, cpu_timers_);
+    for (auto& thread_perf_events: perf_events_) {
+        close_thread_perf_event(tid, thread_perf_events);
+    }
+}
+
+// Finds the threads that weren't registered by the hooks, and those that exited without unregistering
+void scan_proc_threads() {
+    uint64_t generation;
+    {
+        boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+        generation = ++scan_generation_;
+    }
+
+    DIR* task = opendir("/proc/self/task");
+    if (!task) {
+        logError("task opendir failed: %d\n", task);
+        return;
+    }
+
+    std::unordered_set<pid_t> currentThreads{};
+    struct dirent *procThread;
+    while ((procThread = readdir(task)) != NULL) {
+        // filter self and parent entries
+        if (procThread->d_name[0] == '.') {
+            continue;
+        }
+
+        pid_t pid = strtol(procThread->d_name, NULL, 0);
+        if (!is_agent_thread(pid)) {
+            currentThreads.insert(pid);
+        }
+    }
+
+    closedir(task);
+
+    boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+    for (const pid_t& thread: currentThreads) {
+        if (registered_threads_.count(thread) == 0 && exited_threads_.count(thread) == 0) {
+            *_DEBUG_LOGGER <<  "New Thread from /proc scanner: " << thread << endl;
+            register_thread(thread, THREAD_CPU_CLOCK(thread));
+        }
+    }
+
+    // Threads registered by the hooks since the scan started may not have been listed
+    std::vector<pid_t> exitedThreads;
+    for (const auto& thread: registered_threads_) {
+        if (thread.second.scan_generation < generation && currentThreads.count(thread.first) == 0) {
+            exitedThreads.push_back(thread.first);
+        }
+    }
+
+    for (const pid_t& thread: exitedThreads) {
+        *_DEBUG_LOGGER << "Exited Thread from /proc scanner: " << thread << endl;
+        unregister_thread(thread);
+    }
+
+    for (auto it = exited_threads_.begin(); it != exited_threads_.end();) {
+        if (it->second < generation) {
+            it = exited_threads_.erase(it);
+        } else {
+            ++it;
         }
     }
 }
@@ -123,60 +425,147 @@ void scan_threads() {
     if (metrics_thread_started_.load() && processor_thread_started_.load()) {
         // Do it C-style to anticipate our migration over to C.
 
-        const uint64_t atomic_interval_in_ms = atomic_interval_in_ns_.load();
-        if (atomic_interval_in_ms != local_interval_in_ns_) {
-            on_interval_change(atomic_interval_in_ms);
+        const bool wallclock_sampler = is_wallclock_sampler_configured();
+        if (wallclock_sampler) {
+            check_sampler_interval_change();
         }
 
-        if (local_interval_in_ns_ == NOT_SCANNING) {
-            return;
+        {
+            boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+            if (!wallclock_sampler) {
+                check_interval_change(wallclock_timers_);
+            }
+            check_interval_change(cpu_timers_);
+            for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+                check_perf_event_change(static_cast<PerfEvent>(event));
+            }
         }
 
-        DIR* task = opendir("/proc/self/task");
-        if (!task) {
-            logError("task opendir failed: %d\n", task);
+        bool profiling = wallclock_timers_.is_running() || cpu_timers_.is_running();
+        for (const auto& thread_perf_events: perf_events_) {
+            profiling = profiling || thread_perf_events.local_running;
+        }
+        if (!profiling && !thread_list_required_.load()) {
             return;
         }
 
-        std::unordered_set<pid_t> currentThreads{};
-        struct dirent *procThread;
-        while ((procThread = readdir(task)) != NULL) {
-            // filter self and parent entries
-            if (procThread->d_name[0] == '.') {
-                continue;
-            }
+        if (ticks_until_proc_scan_ <= 0) {
+            scan_proc_threads();
+            ticks_until_proc_scan_ = thread_hooks_live_.load() ? TICKS_BETWEEN_PROC_SCANS : 1;
+        }
+        ticks_until_proc_scan_--;
 
-            pid_t pid = strtol(procThread->d_name, NULL, 0);
-            if (pid == metrics_thread_id_ || pid == processor_thread_id_) {
-                continue;
+        {
+            boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+            last_scan_threads_.clear();
+            for (const auto& thread: registered_threads_) {
+                last_scan_threads_.insert(thread.first);
             }
+        }
 
-            currentThreads.insert(pid);
+        if (wallclock_sampler && wallclock_timers_.is_running()) {
+            update_wallclock_sampler_threads(last_scan_threads_);
+        }
+    }
+}
+
+// -------------------
+//   Any Thread
+// -------------------
 
-            if (last_scan_threads_.count(pid) == 0) {
-                *_DEBUG_LOGGER <<  "New Thread from /proc scanner: " << pid << endl;
+void enable_thread_hooks() {
+    thread_hooks_enabled_.store(true);
+}
 
-                start_profiling_thread(pid);
-            }
+void on_thread_start(const pid_t tid) {
+    thread_hooks_live_.store(true);
+    if (thread_hooks_enabled_.load()) {
+        clockid_t cpu_clock;
+        if (pthread_getcpuclockid(pthread_self(), &cpu_clock) != 0) {
+            cpu_clock = THREAD_CPU_CLOCK(tid);
         }
 
-        last_scan_threads_ = currentThreads;
+        boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+        // An entry for the tid is a thread that exited without the hook and whose tid's been reused, its timers and
+        // counters were for the old thread
+        exited_threads_.erase(tid);
+        unregister_thread(tid);
+        register_thread(tid, cpu_clock);
+    }
+}
 
-        closedir(task);
+void on_thread_exit(const pid_t tid) {
+    if (thread_hooks_enabled_.load()) {
+        boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+        unregister_thread(tid);
+        exited_threads_[tid] = scan_generation_;
     }
 }
 
+// The agent's threads are started with pthread_create too, so are registered by the hook
+void forget_thread(const pid_t tid) {
+    boost::lock_guard<boost::mutex> guard(*threads_mutex_);
+    unregister_thread(tid);
+}
+
+// -------------------
+//   Events Thread
+// -------------------
+
+void on_events_thread_start() {
+    events_thread_id_.store(getTid());
+    forget_thread(events_thread_id_.load());
+}
+
+void on_events_thread_stop() {
+    events_thread_id_.store(0);
+}
+
+// -------------------
+//   Sampler Thread
+// -------------------
+
+void on_sampler_thread_start() {
+    sampler_thread_id_.store(getTid());
+    forget_thread(sampler_thread_id_.load());
+}
+
+void on_sampler_thread_stop() {
+    sampler_thread_id_.store(0);
+}
+
 // -------------------
 //   Fork Thread
 // -------------------
 
 void reset_scan_threads() {
+    threads_mutex_ = new boost::mutex();
+    registered_threads_.clear();
+    exited_threads_.clear();
+    scan_generation_ = 0;
+    ticks_until_proc_scan_ = 0;
     last_scan_threads_.clear();
-    timers_.clear();
+    thread_list_required_.store(false);
+    wallclock_timers_.timers.clear();
+    cpu_timers_.timers.clear();
+    // Unlike timers, the counters' fds are inherited by the child, though they count the parent's threads
+    for (auto& thread_perf_events: perf_events_) {
+        for (const auto& fd: thread_perf_events.fds) {
+            close_inherited_perf_event(fd.second);
+        }
+        thread_perf_events.fds.clear();
+        thread_perf_events.atomic_running.store(false);
+        thread_perf_events.local_running = false;
+    }
     metrics_thread_id_ = 0;
     processor_thread_id_ = 0;
+    events_thread_id_.store(0);
+    sampler_thread_id_.store(0);
+    on_fork_wallclock_sampler();
     metrics_thread_started_.store(false);
     processor_thread_started_.store(false);
-    atomic_interval_in_ns_.store(NOT_SCANNING);
-    local_interval_in_ns_ = NOT_SCANNING;
+    wallclock_timers_.atomic_interval_in_ns.store(NOT_SCANNING);
+    wallclock_timers_.local_interval_in_ns = NOT_SCANNING;
+    cpu_timers_.atomic_interval_in_ns.store(NOT_SCANNING);
+    cpu_timers_.local_interval_in_ns = NOT_SCANNING;
 }
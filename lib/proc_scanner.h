@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <sys/types.h>
+#include <unordered_set>
 
 // --------------------
 //   Processor Thread
@@ -12,6 +13,16 @@ bool is_scanning_threads();
 void update_scanning_threads_interval(const uint64_t interval_in_ms);
 void stop_scanning_threads();
 
+// Per-thread CPU time timers, used instead of ITIMER_PROF in the thread CPU sampling mode
+bool is_cpu_timing_threads();
+void update_cpu_timers_interval(const uint64_t interval_in_ms);
+void stop_cpu_timers();
+
+// Per-thread perf event counters for the events configured in perf_events.h
+bool is_counting_perf_events();
+void start_perf_events();
+void stop_perf_events();
+
 void on_processor_thread_start();
 
 // -------------------
@@ -21,6 +32,39 @@ void on_processor_thread_start();
 void on_metrics_thread_start();
 void scan_threads();
 
+// Keeps the thread list up to date even when not profiling, for readers of per-thread metrics
+void set_thread_list_required(const bool required);
+// The threads found by the last scan, excluding the agent's own threads
+const std::unordered_set<pid_t>& scanned_threads();
+// The per-thread profiling timers that currently exist
+size_t live_timer_count();
+
+// -------------------
+//   Any Thread
+// -------------------
+
+// Called once the agent has initialized, the thread hooks are no-ops until then
+void enable_thread_hooks();
+// Called by the thread hooks on the thread that's starting or exiting, arms or deletes its timers and perf events
+void on_thread_start(const pid_t tid);
+void on_thread_exit(const pid_t tid);
+
+// -------------------
+//   Events Thread
+// -------------------
+
+// The runtime events consumer thread comes and goes as the event ring is enabled and disabled
+void on_events_thread_start();
+void on_events_thread_stop();
+
+// -------------------
+//   Sampler Thread
+// -------------------
+
+// The wallclock sampler thread, see wallclock_sampler.h
+void on_sampler_thread_start();
+void on_sampler_thread_stop();
+
 // -------------------
 //   Fork Thread
 // -------------------
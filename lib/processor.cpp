@@ -3,6 +3,7 @@
 #include "processor.h"
 #include "globals.h"
 #include "proc_scanner.h"
+#include "symbol_table.h"
 
 extern "C" {
 
@@ -72,6 +73,8 @@ void* callbackToRunProcessor(void *arg) {
 }
 
 void onProcessorExit() {
+    // The processor thread flushes its last samples after the loop ends, which mustn't wait for the runtime lock
+    disable_ocaml_locations();
     processorRunning = false;
 
     int result = pthread_join(processorThread, nullptr);
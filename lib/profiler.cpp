@@ -1,7 +1,15 @@
 #include "profiler.h"
+#include "cgroup_reader.h"
+#include "memory_profiler.h"
+#include "perf_events.h"
 #include "proc_scanner.h"
 #include "prometheus_exporter.h"
+#include "runtime_lock_profiler.h"
+#include "thread_hooks.h"
+#include "thread_state.h"
+#include "wallclock_sampler.h"
 
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -71,13 +79,36 @@ void pushError(ErrorHolder* errorHolder, CircularQueue* queue) {
     queue->pushNotification(data::NotificationCategory::USER_ERROR, buf);
 }
 
-void Profiler::handle(int signum, void* context) {
-    if (! (signum == SIGPROF || signum == SIGALRM)) {
+void Profiler::handle(int signum, siginfo_t* info, void* context) {
+    const PerfEvent perfEvent = perf_event_of_signal(signum);
+    if (! (signum == SIGPROF || signum == SIGALRM || perfEvent != NUMBER_OF_PERF_EVENTS)) {
         buffer->pushNotification(
                 data::NotificationCategory::USER_ERROR, "Signal number out of range: ", signum);
         return;
     }
 
+    // Timer signals are a single sample, the wallclock sampler queues a weight with its signals
+    int weight = (info != nullptr && info->si_code == SI_QUEUE && info->si_value.sival_int > 0)
+        ? info->si_value.sival_int : 1;
+
+    int threadState = THREAD_STATE_UNKNOWN;
+    const uint32_t offCpuSampleRatio = std::max(0, configuration_->wallclockOffCpuSampleRatio);
+    const bool threadStateOn = collectorController->isThreadStateOn();
+    if (signum == SIGALRM && (threadStateOn || offCpuSampleRatio != 1)) {
+        const ThreadState state = capture_thread_state();
+        if (threadStateOn) {
+            threadState = state;
+        }
+
+        // Checked before unwinding, so that the samples that are dropped cost little
+        if (is_off_cpu(state) && offCpuSampleRatio != 1) {
+            if (!keep_off_cpu_sample(offCpuSampleRatio)) {
+                return;
+            }
+            weight *= offCpuSampleRatio;
+        }
+    }
+
     CallFrame frames[MAX_FRAMES];
     ErrorHolder errorHolder;
     errorHolder.errorCode = 0;
@@ -97,19 +128,43 @@ void Profiler::handle(int signum, void* context) {
     trace.frames = frames;
     trace.num_frames = is_error ? -1 * num_frames : num_frames;
     trace.threadId = pthread_self();
-    const bool enqueued = buffer->pushStackTrace(trace, signum, 0, stack_ts - start_ts);
+    trace.weight = weight;
+    const bool enqueued = buffer->pushStackTrace(trace, signum, threadState, stack_ts - start_ts);
     if (!enqueued) {
         if (signum == SIGPROF) {
             CircularQueue::cputimeFailures++;
+        } else if (perfEvent != NUMBER_OF_PERF_EVENTS) {
+            CircularQueue::perfEventFailures++;
         } else {
             CircularQueue::wallclockFailures++;
         }
     }
+
+    // The counter was disabled when it signalled
+    if (perfEvent != NUMBER_OF_PERF_EVENTS) {
+        rearm_perf_event(info);
+    }
 }
 
 void Profiler::start() {
-    handler_->SetAction(SIGPROF, SIGALRM, &bootstrapHandle);
-    handler_->SetAction(SIGALRM, SIGPROF, &bootstrapHandle);
+    // The profiling signals mask each other, so that a sample's never taken within another sample's handler
+    sigset_t profilingSignals;
+    sigemptyset(&profilingSignals);
+    sigaddset(&profilingSignals, SIGPROF);
+    sigaddset(&profilingSignals, SIGALRM);
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        if (is_perf_event_configured(static_cast<PerfEvent>(event))) {
+            sigaddset(&profilingSignals, perf_event_signal(static_cast<PerfEvent>(event)));
+        }
+    }
+
+    handler_->SetAction(SIGPROF, profilingSignals, &bootstrapHandle);
+    handler_->SetAction(SIGALRM, profilingSignals, &bootstrapHandle);
+    for (int event = 0; event < NUMBER_OF_PERF_EVENTS; event++) {
+        if (is_perf_event_configured(static_cast<PerfEvent>(event))) {
+            handler_->SetAction(perf_event_signal(static_cast<PerfEvent>(event)), profilingSignals, &bootstrapHandle);
+        }
+    }
 
     processor->start();
     metrics->startThread();
@@ -175,12 +230,23 @@ void Profiler::configure() {
 
     handler_ = new SignalHandler();
 
-    const int processorCount = 1;
+    const uint32_t processorCount = effective_cpu_count();
     const bool isOn = (!apiKey.empty() && hasHostName == 0) || configuration_->prometheusEnabled;
 
     buffer = new CircularQueue(configuration_->maxFramesToCapture);
 
     metrics = new Metrics(*debugLogger_, *buffer);
+    MemoryProfiler::init(buffer);
+    init_thread_hooks(buffer);
+    configure_wallclock_sampler(std::max(0, configuration_->wallclockSignalBudget));
+    configure_runtime_lock_profiler(
+        buffer,
+        configuration_->runtimeLockProfiling,
+        std::max(0, configuration_->runtimeLockWaitThresholdUs));
+    configure_perf_events(
+        std::max(0, configuration_->perfTaskClockIntervalUs),
+        std::max(0, configuration_->perfPageFaultPeriod),
+        std::max(0, configuration_->perfContextSwitchPeriod));
 
     collectorController = new CollectorController(
         *network_,
@@ -190,7 +256,7 @@ void Profiler::configure() {
         hostname,
         configuration_->applicationVersion,
         ocamlVersion_,
-        static_cast<uint32_t >(processorCount),
+        processorCount,
         boost::bind(&Profiler::onSocketConnected, this),
         boost::bind(&Profiler::recordAllocationTable, this),
         *handler_,
@@ -207,7 +273,9 @@ void Profiler::configure() {
         *collectorController,
         *debugLogger_,
         configuration_->maxFramesToCapture,
-        configuration_->logCorruption);
+        configuration_->logCorruption,
+        configuration_->metricsDeltaEncoding,
+        configuration_->metricsKeyframeInterval);
 
     QueueListener* queueListener = writer;
     if (configuration_->prometheusEnabled) {
@@ -235,6 +303,10 @@ void Profiler::onSocketConnected() {
 void Profiler::recordAllocationTable() {
     if (writer != nullptr) {
         writer->recordAllocationTable();
+
+        vector<HeapProfileRow> rows;
+        MemoryProfiler::snapshotHeapProfile(rows);
+        writer->recordHeapProfile(rows);
     }
 }
 
@@ -259,5 +331,6 @@ void Profiler::on_fork() {
     writer->onSocketConnected();
     network_->on_fork();
     metrics->on_fork();
+    MemoryProfiler::on_fork();
     start();
 }
@@ -38,7 +38,7 @@ public:
 
     void start();
 
-    void handle(int signum, void *context);
+    void handle(int signum, siginfo_t *info, void *context);
 
     void on_fork();
 
@@ -3,8 +3,16 @@
 #include "symbol_table.h"
 #include <boost/asio.hpp>
 #include <boost/system/system_error.hpp>
+#include <algorithm>
+#include <array>
+#include <inttypes.h>
+#include <limits>
+#include <map>
+#include <memory>
+#include <strings.h>
 #include <unordered_map>
 #include <vector>
+#include <zlib.h>
 
 namespace errc = boost::system::errc;
 namespace asio = boost::asio;
@@ -18,9 +26,24 @@ using std::unordered_map;
 // BEGIN Common State
 // ------------------
 
+// The call tree is an arena of nodes addressed by index, with children as an intrusive sibling list and a single
+// hash table from (parent, pc) to child. Locations are interned by pc, so nodes sharing a pc share them.
+typedef uint32_t NodeIndex;
+
+const NodeIndex NO_NODE = std::numeric_limits<NodeIndex>::max();
+const NodeIndex ROOT_NODE = 0;
+
 struct ProfileNode {
-    vector<Location> locations;
-    unordered_map<uintptr_t, ProfileNode*> pcToNode;
+    uintptr_t pc;
+    NodeIndex parent;
+    NodeIndex firstChild;
+    NodeIndex nextSibling;
+    uint32_t locationsId;
+    uint32_t lastSeenPhase;
+    int cpuCount;
+    int wallclockCount;
+    // The innermost GC phase on the path from the root, so every sample counted at this node was taken in it
+    GcPhase gcPhase;
     // true if we need to walk the subtree when printing, ie when there's >= 1 child with a count >= 1
     bool seenInPhase;
 
@@ -33,23 +56,444 @@ struct ProfileNode {
         cpuCount = 0;
         wallclockCount = 0;
     }
+};
+
+struct ChildKey {
+    NodeIndex parent;
+    uintptr_t pc;
+
+    bool operator==(const ChildKey& other) const {
+        return parent == other.parent && pc == other.pc;
+    }
+};
+
+struct ChildKeyHash {
+    size_t operator()(const ChildKey& key) const {
+        return std::hash<uintptr_t>()(key.pc ^ ((uintptr_t) key.parent * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+class ProfileTree {
+public:
+    // prunePhases of 0 disables pruning
+    explicit ProfileTree(const uint32_t prunePhases)
+        : nodes_(),
+          freeNodes_(),
+          touched_(),
+          children_(),
+          pcToLocationsId_(),
+          locationSets_(),
+          phase_(0),
+          prunePhases_(prunePhases) {
+
+        nodes_.emplace_back();
+        initNode(ROOT_NODE, 0, NO_NODE, 0, GC_PHASE_MUTATOR);
+        nodes_[ROOT_NODE].seenInPhase = true;
+    }
+
+    ProfileNode& node(const NodeIndex index) {
+        return nodes_[index];
+    }
+
+    const vector<Location>& locations(const ProfileNode& node) const {
+        return locationSets_[node.locationsId];
+    }
+
+    // Finds or creates the child of parent at pc and marks it as seen in this phase
+    NodeIndex touchChild(const NodeIndex parent, const uintptr_t pc, const bool isForeign) {
+        NodeIndex index;
+        auto it = children_.find({parent, pc});
+        if (it != children_.end()) {
+            index = it->second;
+        } else {
+            index = allocateNode();
+            const uint32_t locationsId = internLocations(pc, isForeign);
+            const GcPhase parentPhase = nodes_[parent].gcPhase;
+            const GcPhase gcPhase =
+                isForeign ? gc_phase_of_frame(locationSets_[locationsId], parentPhase) : parentPhase;
+            initNode(index, pc, parent, locationsId, gcPhase);
+            ProfileNode& parentNode = nodes_[parent];
+            nodes_[index].nextSibling = parentNode.firstChild;
+            parentNode.firstChild = index;
+            children_.insert({{parent, pc}, index});
+        }
+
+        ProfileNode& node = nodes_[index];
+        if (!node.seenInPhase) {
+            node.seenInPhase = true;
+            node.lastSeenPhase = phase_;
+            touched_.push_back(index);
+        }
+
+        return index;
+    }
+
+    // Only resets nodes seen in this phase, then prunes subtrees that haven't been seen for prunePhases_ phases
+    void endPhase() {
+        for (const NodeIndex index : touched_) {
+            nodes_[index].reset();
+        }
+        touched_.clear();
+
+        ProfileNode& root = nodes_[ROOT_NODE];
+        root.reset();
+        root.seenInPhase = true;
+        root.lastSeenPhase = phase_;
+
+        phase_++;
+        if (prunePhases_ != 0 && phase_ % prunePhases_ == 0) {
+            prune();
+        }
+    }
 
 private:
-    int cpuCount;
-    int wallclockCount;
+    void initNode(
+        const NodeIndex index,
+        const uintptr_t pc,
+        const NodeIndex parent,
+        const uint32_t locationsId,
+        const GcPhase gcPhase) {
+
+        ProfileNode& node = nodes_[index];
+        node.pc = pc;
+        node.parent = parent;
+        node.firstChild = NO_NODE;
+        node.nextSibling = NO_NODE;
+        node.locationsId = locationsId;
+        node.gcPhase = gcPhase;
+        node.lastSeenPhase = phase_;
+        node.reset();
+    }
+
+    NodeIndex allocateNode() {
+        if (!freeNodes_.empty()) {
+            const NodeIndex index = freeNodes_.back();
+            freeNodes_.pop_back();
+            return index;
+        }
+
+        nodes_.emplace_back();
+        return nodes_.size() - 1;
+    }
+
+    uint32_t internLocations(const uintptr_t pc, const bool isForeign) {
+        auto it = pcToLocationsId_.find(pc);
+        if (it != pcToLocationsId_.end()) {
+            return it->second;
+        }
+
+        const uint32_t locationsId = locationSets_.size();
+        locationSets_.push_back(lookup_locations(pc, isForeign));
+        pcToLocationsId_.insert({pc, locationsId});
+        return locationsId;
+    }
+
+    // A child is only ever seen when its parent is, so once a node is cold its whole subtree is
+    void prune() {
+        vector<NodeIndex> pending;
+        pending.push_back(ROOT_NODE);
+        while (!pending.empty()) {
+            const NodeIndex parent = pending.back();
+            pending.pop_back();
+
+            NodeIndex* link = &nodes_[parent].firstChild;
+            while (*link != NO_NODE) {
+                const NodeIndex child = *link;
+                ProfileNode& childNode = nodes_[child];
+                if (phase_ - childNode.lastSeenPhase >= prunePhases_) {
+                    *link = childNode.nextSibling;
+                    freeSubtree(child);
+                } else {
+                    pending.push_back(child);
+                    link = &childNode.nextSibling;
+                }
+            }
+        }
+    }
+
+    void freeSubtree(const NodeIndex subtreeRoot) {
+        vector<NodeIndex> pending;
+        pending.push_back(subtreeRoot);
+        while (!pending.empty()) {
+            const NodeIndex index = pending.back();
+            pending.pop_back();
+
+            ProfileNode& node = nodes_[index];
+            for (NodeIndex child = node.firstChild; child != NO_NODE; child = nodes_[child].nextSibling) {
+                pending.push_back(child);
+            }
+
+            children_.erase({node.parent, node.pc});
+            node.firstChild = NO_NODE;
+            freeNodes_.push_back(index);
+        }
+    }
+
+    vector<ProfileNode> nodes_;
+    vector<NodeIndex> freeNodes_;
+    // Nodes seen in the current phase
+    vector<NodeIndex> touched_;
+    unordered_map<ChildKey, NodeIndex, ChildKeyHash> children_;
+    unordered_map<uintptr_t, uint32_t> pcToLocationsId_;
+    vector<vector<Location>> locationSets_;
+    uint32_t phase_;
+    const uint32_t prunePhases_;
+
+    DISALLOW_COPY_AND_ASSIGN(ProfileTree);
 };
 
-ProfileNode* root = nullptr;
+ProfileTree* tree = nullptr;
+uint32_t prunePhases = DEFAULT_PROMETHEUS_PRUNE_PHASES;
+
+enum class ExportedMetricKind {
+    GAUGE,
+    COUNTER,
+    // Each sample is an increment, eg: the events lost since the last sample
+    EVENT_COUNTER,
+    // One statistic of an interval's runtime events aggregate, eg: ocaml.eventring.EV_MINOR.p99
+    SUMMARY_STATISTIC,
+    INFO
+};
 
-void end_phase_node(ProfileNode* node) {
-    if (node == nullptr) {
+enum class SummaryStatistic {
+    COUNT,
+    SUM,
+    MAX,
+    P50,
+    P90,
+    P99,
+    // The interval's count of values up to a bound, eg: ocaml.eventring.EV_MINOR.bucket_10000
+    BUCKET
+};
+
+const char* const BUCKET_SUFFIX = ".bucket_";
+
+const string EVENT_RING_PREFIX = "ocaml.eventring.";
+// The runtime events metrics whose samples are each a count for their interval, rather than a value
+const string EVENT_RING_COUNTERS[] = { "ocaml.eventring.lost_events", "ocaml.eventring.polls" };
+const string DOMAIN_PREFIX = "ocaml.eventring.domain.";
+const string APP_PREFIX = "app.";
+const string RUNTIME_LOCK_PREFIX = "ocaml.runtime_lock.";
+const int64_t NS_IN_SECOND = 1000000000;
+
+// Built from the per-interval aggregates of a runtime phase or counter, of an application histogram or of the runtime
+// lock waits. The count, sum and buckets accumulate over the lifetime of the process, as Prometheus expects. Aggregates
+// with buckets render as histograms, the others as summaries without quantiles: an interval's percentiles can't be
+// combined into those of a scrape, which usually spans several intervals.
+struct EventSummary {
+    string name;
+    // Eg: domain="2" for a per-domain aggregate, otherwise empty
+    string label;
+    MetricUnit unit;
+    bool hasValue;
+    uint64_t count;
+    int64_t sum;
+    // The largest value since the last scrape
+    int64_t max;
+    // Keyed by the bucket's upper bound, the count of values between the previous bound and it
+    std::map<int64_t, uint64_t> buckets;
+};
+
+struct ExportedMetric {
+    string name;
+    ExportedMetricKind kind;
+    bool hasValue;
+    int64_t valueLong;
+    string valueString;
+    EventSummary* summary;
+    SummaryStatistic statistic;
+    // Only used by BUCKET statistics
+    int64_t bucketBound;
+};
+
+// Ordered by id so that metrics render in a stable order between scrapes
+std::map<uint32_t, ExportedMetric> exportedMetrics;
+// Keyed by the aggregate's name and domain, eg: (ocaml.eventring.domain.EV_MINOR, 2), ordered so that the summaries
+// of a metric family render contiguously
+std::map<std::pair<string, string>, EventSummary> eventSummaries;
+// Eg: segment="api", or empty if there's no segment configured
+string metricLabels;
+
+// Prometheus metric names only allow [a-zA-Z0-9_:]
+string prometheus_metric_name(const string& name) {
+    string sanitized = name;
+    for (char& c : sanitized) {
+        if (!isalnum(c) && c != '_' && c != ':') {
+            c = '_';
+        }
+    }
+    return sanitized;
+}
+
+// Application metric names can't contain a '.', so app.latency.p99 can only be a histogram's statistic
+bool is_summary_family(const string& name) {
+    if (name.compare(0, EVENT_RING_PREFIX.size(), EVENT_RING_PREFIX) == 0 ||
+        name.compare(0, RUNTIME_LOCK_PREFIX.size(), RUNTIME_LOCK_PREFIX) == 0) {
+        return true;
+    }
+
+    return name.compare(0, APP_PREFIX.size(), APP_PREFIX) == 0 && name.find('.', APP_PREFIX.size()) != string::npos;
+}
+
+// Splits eg: ocaml.eventring.EV_MINOR.p99 into ocaml.eventring.EV_MINOR and P99, or
+// ocaml.eventring.EV_MINOR.bucket_10000 into ocaml.eventring.EV_MINOR, BUCKET and a bound of 10000
+bool parse_summary_statistic(
+    const string& name,
+    string& summaryName,
+    SummaryStatistic& statistic,
+    int64_t& bucketBound) {
+
+    static const std::pair<const char*, SummaryStatistic> SUFFIXES[] = {
+        { ".count", SummaryStatistic::COUNT },
+        { ".sum", SummaryStatistic::SUM },
+        { ".max", SummaryStatistic::MAX },
+        { ".p50", SummaryStatistic::P50 },
+        { ".p90", SummaryStatistic::P90 },
+        { ".p99", SummaryStatistic::P99 }
+    };
+
+    if (!is_summary_family(name)) {
+        return false;
+    }
+
+    const size_t bucketStart = name.rfind(BUCKET_SUFFIX);
+    if (bucketStart != string::npos) {
+        const char* boundStart = name.c_str() + bucketStart + strlen(BUCKET_SUFFIX);
+        char* boundEnd;
+        bucketBound = strtoll(boundStart, &boundEnd, 10);
+        if (boundEnd != boundStart && *boundEnd == '\0') {
+            summaryName = name.substr(0, bucketStart);
+            statistic = SummaryStatistic::BUCKET;
+            return true;
+        }
+    }
+
+    for (auto& suffix : SUFFIXES) {
+        const size_t suffixLength = strlen(suffix.first);
+        if (name.size() > suffixLength &&
+            name.compare(name.size() - suffixLength, suffixLength, suffix.first) == 0) {
+            summaryName = name.substr(0, name.size() - suffixLength);
+            statistic = suffix.second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ExportedMetricKind exported_metric_kind(const MetricInformation& info) {
+    if (info.dataType == MetricDataType::STRING) {
+        return ExportedMetricKind::INFO;
+    }
+
+    for (auto& name : EVENT_RING_COUNTERS) {
+        if (info.name == name) {
+            return ExportedMetricKind::EVENT_COUNTER;
+        }
+    }
+
+    return info.variability == MetricVariability::MONOTONIC ? ExportedMetricKind::COUNTER : ExportedMetricKind::GAUGE;
+}
+
+void record_metric_information(const MetricInformation& info) {
+    ExportedMetric& metric = exportedMetrics[info.id];
+    metric.hasValue = false;
+    metric.valueLong = 0;
+    metric.valueString.clear();
+    metric.summary = nullptr;
+
+    string summaryName;
+    if (parse_summary_statistic(info.name, summaryName, metric.statistic, metric.bucketBound)) {
+        metric.kind = ExportedMetricKind::SUMMARY_STATISTIC;
+        // Per-domain aggregates, eg: ocaml.eventring.domain.2.EV_MINOR, are labelled by domain
+        string domain;
+        if (summaryName.compare(0, DOMAIN_PREFIX.size(), DOMAIN_PREFIX) == 0) {
+            const size_t domainEnd = summaryName.find('.', DOMAIN_PREFIX.size());
+            if (domainEnd != string::npos) {
+                domain = summaryName.substr(DOMAIN_PREFIX.size(), domainEnd - DOMAIN_PREFIX.size());
+                summaryName.erase(DOMAIN_PREFIX.size(), domainEnd + 1 - DOMAIN_PREFIX.size());
+            }
+        }
+
+        const std::pair<string, string> key(summaryName, domain);
+        auto it = eventSummaries.find(key);
+        if (it == eventSummaries.end()) {
+            EventSummary summary{};
+            summary.name = prometheus_metric_name(summaryName);
+            if (!domain.empty()) {
+                summary.label = "domain=\"" + domain + "\"";
+            }
+            it = eventSummaries.insert({key, summary}).first;
+        }
+        // The count and buckets are always in events, the other statistics are in the unit of the phase or counter
+        if (metric.statistic != SummaryStatistic::COUNT && metric.statistic != SummaryStatistic::BUCKET) {
+            it->second.unit = info.unit;
+        }
+        metric.summary = &it->second;
         return;
     }
 
-    node->reset();
+    metric.kind = exported_metric_kind(info);
+    metric.name = prometheus_metric_name(info.name);
+    switch (metric.kind) {
+        case ExportedMetricKind::COUNTER:
+        case ExportedMetricKind::EVENT_COUNTER:
+            metric.name += "_total";
+            break;
+        case ExportedMetricKind::INFO:
+            metric.name += "_info";
+            break;
+        default:
+            break;
+    }
+}
+
+void record_summary_statistic(
+    EventSummary& summary,
+    const SummaryStatistic statistic,
+    const int64_t bucketBound,
+    const int64_t value) {
+
+    switch (statistic) {
+        case SummaryStatistic::COUNT:
+            summary.count += value;
+            summary.hasValue = true;
+            break;
+        case SummaryStatistic::SUM:
+            summary.sum += value;
+            break;
+        case SummaryStatistic::MAX:
+            summary.max = std::max(summary.max, value);
+            break;
+        case SummaryStatistic::BUCKET:
+            summary.buckets[bucketBound] += value;
+            break;
+        default:
+            // Percentiles are only meaningful for their own interval, see EventSummary
+            break;
+    }
+}
+
+void record_metric_sample(const MetricSample& sample) {
+    auto it = exportedMetrics.find(sample.id);
+    if (it == exportedMetrics.end()) {
+        return;
+    }
 
-    for (auto& it: node->pcToNode) {
-        end_phase_node(it.second);
+    ExportedMetric& metric = it->second;
+    metric.hasValue = true;
+    switch (metric.kind) {
+        case ExportedMetricKind::SUMMARY_STATISTIC:
+            record_summary_statistic(*metric.summary, metric.statistic, metric.bucketBound, sample.data.valueLong);
+            break;
+        case ExportedMetricKind::EVENT_COUNTER:
+            metric.valueLong += sample.data.valueLong;
+            break;
+        case ExportedMetricKind::INFO:
+            metric.valueString = sample.data.valueString;
+            break;
+        default:
+            metric.valueLong = sample.data.valueLong;
     }
 }
 
@@ -61,37 +505,361 @@ void end_phase_node(ProfileNode* node) {
 // BEGIN IO
 // ----------------
 
-const string prefix_200 =
-    "HTTP/1.1 200 OK\n"
-    "Content-Type: text/html; charset=utf-8\n\n"
+const string content_type = "text/plain; version=0.0.4; charset=utf-8";
+
+const string profile_header =
     "# HELP promfiler_cpu_profile CPU stack trace samples\n"
     "# TYPE promfiler_cpu_profile gauge\n";
 
-const string response_404 =
-    "HTTP/1.1 404 Not Found\n"
-    "Content-Type: text/html; charset=utf-8\n\n"
-    "<html><body><i>Not Found!</i></body></html>";
-
+const string body_404 = "<html><body><i>Not Found!</i></body></html>";
 
 const string prefix_1 = "promfiler_cpu_profile{type=\"";
 const string prefix_2 = "\",signature=\"";
+const string prefix_3 = "\",gc_phase=\"";
 
 string rootCpuPrefix;
 string rootWallclockPrefix;
 
 const int max_length = 1024;
+// Requests larger than this are rejected, Prometheus' requests are a few hundred bytes
+const size_t max_request_length = 16 * 1024;
+const string header_end = "\r\n\r\n";
 
 tcp::acceptor* acceptor_ = NULL;
 tcp::socket* socket_ = NULL;
 DebugLogger* debugLogger_ = NULL;
 
-// Performs an asynchronous read so as not to block the processor thread, but does do a single-threaded synchronous
-// write for simplicity. This isn't an issue with prometheus scraping the data out, but is a limitation to be aware of.
+// Rendered bodies are shared between sessions, so that concurrent scrapers can write them out asynchronously
+// whilst the next scrape renders into a fresh buffer. If nobody else holds the last body its capacity gets reused.
+typedef std::shared_ptr<string> Body;
+Body lastBody_;
+Body lastGzipBody_;
+
+Body acquire_body(Body& last) {
+    if (last && last.use_count() == 1) {
+        last->clear();
+    } else {
+        last = std::make_shared<string>();
+    }
+    return last;
+}
+
+void append_escaped(string& out, const string& value) {
+    for (const char c : value) {
+        switch (c) {
+            case '\\':
+                out += "\\\\";
+                break;
+            case '"':
+                out += "\\\"";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            default:
+                out += c;
+        }
+    }
+}
+
+void append_sample(
+    string& out,
+    const string& prefix,
+    const string& signature,
+    const GcPhase gcPhase,
+    const int count) {
+
+    char countStr[16];
+    const int countLen = snprintf(countStr, sizeof(countStr), "%d", count);
+
+    // Eg: promfiler_cpu_profile{type="cpu",signature="(root)#parserOnHeadersComplete",gc_phase="mutator"} 1\n
+    out += prefix;
+    out += signature;
+    out += prefix_3;
+    out += gc_phase_name(gcPhase);
+    out += "\"} ";
+    out.append(countStr, countLen);
+    out += '\n';
+}
+
+// signature is the escaped label value of the parent node, it's extended in place and restored before returning
+// so that rendering a scrape only allocates when the output buffer grows.
+void render_profile_node(
+    const NodeIndex index,
+    const string& prefix,
+    string& signature,
+    const bool isCpuSample,
+    string& out) {
+
+    ProfileNode& node = tree->node(index);
+    if (!node.seenInPhase) {
+        return;
+    }
+
+    const size_t parentLength = signature.size();
+
+    if (index == ROOT_NODE) {
+        signature += "(root)";
+        append_sample(out, prefix, signature, node.gcPhase, node.count(isCpuSample));
+    } else {
+        // One line for each inlined function at this pc
+        for (auto& location : tree->locations(node)) {
+            signature += '#';
+            append_escaped(signature, location.functionName);
+            append_sample(out, prefix, signature, node.gcPhase, node.count(isCpuSample));
+        }
+    }
+
+    for (NodeIndex child = node.firstChild; child != NO_NODE; child = tree->node(child).nextSibling) {
+        render_profile_node(child, prefix, signature, isCpuSample, out);
+    }
+
+    signature.resize(parentLength);
+}
+
+void append_metric_line(
+    string& out,
+    const string& name,
+    const char* suffix,
+    const string& extraLabel,
+    const char* value) {
+
+    out += name;
+    out += suffix;
+    if (!metricLabels.empty() || !extraLabel.empty()) {
+        out += '{';
+        out += metricLabels;
+        if (!metricLabels.empty() && !extraLabel.empty()) {
+            out += ',';
+        }
+        out += extraLabel;
+        out += '}';
+    }
+    out += ' ';
+    out += value;
+    out += '\n';
+}
+
+void append_metric_type(string& out, const string& name, const char* type) {
+    out += "# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+// Formats a value of the unit in the unit Prometheus expects, ie: seconds rather than nanoseconds
+void format_unit_value(char* value, const size_t size, const MetricUnit unit, const int64_t unitValue) {
+    if (unit == MetricUnit::NANOSECONDS) {
+        snprintf(value, size, "%.9f", unitValue / (double) NS_IN_SECOND);
+    } else {
+        snprintf(value, size, "%" PRId64, unitValue);
+    }
+}
+
+string summary_family_name(const EventSummary& summary) {
+    if (summary.unit == MetricUnit::NANOSECONDS) {
+        return summary.name + "_seconds";
+    } else if (summary.unit == MetricUnit::BYTES) {
+        return summary.name + "_bytes";
+    }
+    return summary.name;
+}
+
+void append_bucket_line(
+    string& out,
+    const EventSummary& summary,
+    const string& name,
+    const char* bound,
+    const uint64_t cumulative) {
+
+    char value[32];
+    string label = summary.label;
+    if (!label.empty()) {
+        label += ',';
+    }
+    label += "le=\"";
+    label += bound;
+    label += '"';
+    snprintf(value, sizeof(value), "%" PRIu64, cumulative);
+    append_metric_line(out, name, "_bucket", label, value);
+}
+
+void render_summary(string& out, const EventSummary& summary, const string& name, const bool isNewFamily) {
+    char value[32];
+    if (isNewFamily) {
+        append_metric_type(out, name, summary.buckets.empty() ? "summary" : "histogram");
+    }
+
+    if (!summary.buckets.empty()) {
+        uint64_t cumulative = 0;
+        for (auto& bucket : summary.buckets) {
+            cumulative += bucket.second;
+            if (summary.unit == MetricUnit::NANOSECONDS) {
+                snprintf(value, sizeof(value), "%g", bucket.first / (double) NS_IN_SECOND);
+            } else {
+                snprintf(value, sizeof(value), "%" PRId64, bucket.first);
+            }
+            append_bucket_line(out, summary, name, value, cumulative);
+        }
+        append_bucket_line(out, summary, name, "+Inf", summary.count);
+    }
+    format_unit_value(value, sizeof(value), summary.unit, summary.sum);
+    append_metric_line(out, name, "_sum", summary.label, value);
+    snprintf(value, sizeof(value), "%" PRIu64, summary.count);
+    append_metric_line(out, name, "_count", summary.label, value);
+}
+
+// The max of each summary is a separate gauge family, so they're rendered after all of the summaries. It's the largest
+// value since the last scrape, or 0 if there weren't any.
+void render_summary_max(string& out, EventSummary& summary, const string& name, const bool isNewFamily) {
+    char value[32];
+    if (isNewFamily) {
+        append_metric_type(out, name, "gauge");
+    }
+
+    format_unit_value(value, sizeof(value), summary.unit, summary.max);
+    append_metric_line(out, name, "", summary.label, value);
+    summary.max = 0;
+}
+
+void render_metrics(string& out) {
+    char value[32];
+    string label;
+    for (auto& it : exportedMetrics) {
+        ExportedMetric& metric = it.second;
+        if (!metric.hasValue) {
+            continue;
+        }
+
+        switch (metric.kind) {
+            case ExportedMetricKind::SUMMARY_STATISTIC:
+                // Rendered as a whole below
+                break;
+            case ExportedMetricKind::INFO:
+                append_metric_type(out, metric.name, "gauge");
+                label = "value=\"";
+                append_escaped(label, metric.valueString);
+                label += '"';
+                append_metric_line(out, metric.name, "", label, "1");
+                break;
+            default: {
+                const bool isCounter = metric.kind != ExportedMetricKind::GAUGE;
+                append_metric_type(out, metric.name, isCounter ? "counter" : "gauge");
+                snprintf(value, sizeof(value), "%" PRId64, metric.valueLong);
+                append_metric_line(out, metric.name, "", "", value);
+            }
+        }
+    }
+
+    string lastFamily;
+    string family;
+    for (auto& it : eventSummaries) {
+        const EventSummary& summary = it.second;
+        if (summary.hasValue) {
+            family = summary_family_name(summary);
+            render_summary(out, summary, family, family != lastFamily);
+            lastFamily = family;
+        }
+    }
+
+    lastFamily.clear();
+    for (auto& it : eventSummaries) {
+        EventSummary& summary = it.second;
+        if (summary.hasValue && summary.count > 0) {
+            family = summary_family_name(summary) + "_max";
+            render_summary_max(out, summary, family, family != lastFamily);
+            lastFamily = family;
+        }
+    }
+}
+
+// Renders the samples of the current phase and starts the next phase
+Body render_profile() {
+    Body body = acquire_body(lastBody_);
+    *body += profile_header;
+
+    string signature;
+    render_profile_node(ROOT_NODE, rootCpuPrefix, signature, true, *body);
+    signature.clear();
+    render_profile_node(ROOT_NODE, rootWallclockPrefix, signature, false, *body);
+    render_metrics(*body);
+
+    tree->endPhase();
+
+    return body;
+}
+
+Body gzip_body(const string& body) {
+    Body compressed = acquire_body(lastGzipBody_);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 + MAX_WBITS selects a gzip wrapper rather than zlib
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nullptr;
+    }
+
+    compressed->resize(deflateBound(&stream, body.size()));
+    stream.next_in = (Bytef*) body.data();
+    stream.avail_in = body.size();
+    stream.next_out = (Bytef*) &(*compressed)[0];
+    stream.avail_out = compressed->size();
+
+    const int ret = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        return nullptr;
+    }
+
+    compressed->resize(stream.total_out);
+    return compressed;
+}
+
+// Returns the value of the header, or an empty string if it's not present. Header names are case insensitive.
+string header_value(const string& request, const char* name) {
+    const size_t nameLen = strlen(name);
+    size_t lineStart = request.find("\r\n");
+    while (lineStart != string::npos) {
+        lineStart += 2;
+        const size_t lineEnd = request.find("\r\n", lineStart);
+        if (lineEnd == string::npos || lineEnd == lineStart) {
+            break;
+        }
+
+        if (lineEnd - lineStart > nameLen &&
+            request[lineStart + nameLen] == ':' &&
+            strncasecmp(request.data() + lineStart, name, nameLen) == 0) {
+
+            size_t valueStart = lineStart + nameLen + 1;
+            while (valueStart < lineEnd && request[valueStart] == ' ') {
+                valueStart++;
+            }
+            return request.substr(valueStart, lineEnd - valueStart);
+        }
+
+        lineStart = lineEnd;
+    }
+
+    return "";
+}
+
+bool contains_token(const string& value, const char* token) {
+    return strcasestr(value.c_str(), token) != nullptr;
+}
+
+// Reads requests asynchronously, and supports HTTP/1.1 keep-alive and pipelining. Responses are rendered into a
+// single buffer and written out with one asynchronous gather write, so a scrape doesn't block the processor thread
+// on the scraper, and several scrapers can be connected at once.
 // NB: socket is closed by the destructor
 class session : public std::enable_shared_from_this<session> {
 public:
     session(tcp::socket socket)
-            : socket_(std::move(socket)) {
+            : socket_(std::move(socket)),
+              request_(),
+              header_(),
+              body_(),
+              keep_alive_(false) {
     }
 
     void start() {
@@ -99,80 +867,113 @@ public:
     }
 
 private:
-    void write(const string& data) {
-        boost::system::error_code write_ec;
-        asio::write(socket_, asio::buffer(data), asio::transfer_all(), write_ec);
-        if (write_ec) {
-            Network::logNetError(write_ec, {"Prometheus write reply error"}, *debugLogger_);
-        }
+    void do_read() {
+        auto self(shared_from_this());
+        socket_.async_read_some(asio::buffer(data_, max_length),
+            [this, self](boost::system::error_code ec, std::size_t length) {
+                if (ec) {
+                    if (ec != error::eof) {
+                        Network::logNetError(ec, {"Prometheus read error"}, *debugLogger_);
+                    }
+                    return;
+                }
+
+                request_.append(data_, length);
+                on_read();
+            });
     }
 
-    // Eg: promfiler_cpu_profile{signature=\"(root)#parserOnHeadersComplete\"} 1;
-    void write_profile_node(ProfileNode* node, const string& prefix, const bool isCpuSample) {
-        if (!node->seenInPhase) {
+    void on_read() {
+        const size_t end = request_.find(header_end);
+        if (end == string::npos) {
+            if (request_.size() > max_request_length) {
+                *debugLogger_ << "Prometheus request too large, closing connection" << endl;
+                return;
+            }
+
+            do_read();
             return;
         }
 
-        vector<string> functions;
-        if (node == root) {
-            functions.emplace_back("(root)");
-        } else {
-            for (auto& location : node->locations) {
-                functions.emplace_back("#" + location.functionName);
+        // Expecting HTTP request like:
+        // GET /metrics HTTP/1.1
+        // Host: localhost:9100
+        // User-Agent: Prometheus/2.22.0+ds
+        // Accept: application/openmetrics-text; version=0.0.1,text/plain;version=0.0.4;q=0.5,*/*;q=0.1
+        // Accept-Encoding: gzip
+        // X-Prometheus-Scrape-Timeout-Seconds: 10.000000
+
+        const string request = request_.substr(0, end + 2);
+        request_.erase(0, end + header_end.size());
+
+        const size_t requestLineEnd = request.find("\r\n");
+        const string requestLine = request.substr(0, requestLineEnd);
+        const bool is_metrics = requestLine.compare(0, 13, "GET /metrics ") == 0;
+        const bool is_http_10 = requestLine.find("HTTP/1.0") != string::npos;
+
+        const string connection = header_value(request, "Connection");
+        keep_alive_ = is_http_10 ? contains_token(connection, "keep-alive") : !contains_token(connection, "close");
+
+        if (is_metrics) {
+            body_ = render_profile();
+            bool gzipped = false;
+            if (contains_token(header_value(request, "Accept-Encoding"), "gzip")) {
+                Body compressed = gzip_body(*body_);
+                if (compressed) {
+                    body_ = compressed;
+                    gzipped = true;
+                }
             }
+            write_response("200 OK", content_type, gzipped);
+        } else {
+            body_ = std::make_shared<string>(body_404);
+            write_response("404 Not Found", "text/html; charset=utf-8", false);
         }
+    }
 
-        string commonStr = prefix;
-        // (root) or #parserOnHeadersComplete
-        for (string& functionName : functions) {
-            // promfiler_cpu_profile{signature="(root)#parserOnHeadersComplete
-            commonStr += functionName;
-
-            // promfiler_cpu_profile{signature="(root)#parserOnHeadersComplete"} 1\n
-            const string line = commonStr + "\"} " + std::to_string(node->count(isCpuSample)) + '\n';
-
-            write(line);
+    void write_response(const char* status, const string& contentType, const bool gzipped) {
+        header_.clear();
+        header_ += "HTTP/1.1 ";
+        header_ += status;
+        header_ += "\r\nContent-Type: ";
+        header_ += contentType;
+        header_ += "\r\nContent-Length: ";
+        header_ += std::to_string(body_->size());
+        if (gzipped) {
+            header_ += "\r\nContent-Encoding: gzip";
         }
-
-        for (auto& it: node->pcToNode) {
-            write_profile_node(it.second, commonStr, isCpuSample);
+        if (!keep_alive_) {
+            header_ += "\r\nConnection: close";
         }
-    }
+        header_ += header_end;
+
+        std::array<asio::const_buffer, 2> buffers = {{
+            asio::buffer(header_),
+            asio::buffer(*body_)
+        }};
 
-    void do_read() {
         auto self(shared_from_this());
-        socket_.async_read_some(asio::buffer(data_, max_length),
+        asio::async_write(socket_, buffers,
             [this, self](boost::system::error_code ec, std::size_t length) {
-                if (ec && ec != error::eof) {
-                    Network::logNetError(ec, {"Prometheus read error"}, *debugLogger_);
+                body_.reset();
+                if (ec) {
+                    Network::logNetError(ec, {"Prometheus write reply error"}, *debugLogger_);
                     return;
                 }
 
-                // Expecting HTTP request like:
-                // GET /metrics HTTP/1.1
-                // Host: localhost:9100
-                // User-Agent: Prometheus/2.22.0+ds
-                // Accept: application/openmetrics-text; version=0.0.1,text/plain;version=0.0.4;q=0.5,*/*;q=0.1
-                // Accept-Encoding: gzip
-                // X-Prometheus-Scrape-Timeout-Seconds: 10.000000
-
-                string str(data_, length);
-                const bool is_metrics = str.find("GET /metrics HTTP/1.1") != string::npos;
-
-                if (is_metrics) {
-                    write(prefix_200);
-                    write_profile_node(root, rootCpuPrefix, true);
-                    write_profile_node(root, rootWallclockPrefix, false);
-                    end_phase_node(root);
-                    root->seenInPhase = true;
-                } else {
-                    write(response_404);
+                if (keep_alive_) {
+                    on_read();
                 }
             });
     }
 
     tcp::socket socket_;
     char data_[max_length];
+    // Bytes read but not yet handled
+    string request_;
+    string header_;
+    Body body_;
+    bool keep_alive_;
 };
 
 void do_accept() {
@@ -197,10 +998,12 @@ bool bind_prometheus(const ConfigurationOptions& configuration, DebugLogger& deb
     const string& segment = configuration.prometheusSegment;
     if (!segment.empty()) {
         prefixEnd = "\",segment=\"" + segment + prefixEnd;
+        metricLabels = "segment=\"" + segment + "\"";
     }
 
     rootCpuPrefix = prefix_1 + "cpu" + prefixEnd;
     rootWallclockPrefix = prefix_1 + "wallclock" + prefixEnd;
+    prunePhases = configuration.prometheusPrunePhases;
 
     const std::string& host = configuration.prometheusHost;
     debugLogger_ = &debugLogger;
@@ -265,6 +1068,11 @@ public:
         int threadState,
         uint64_t time_tsc) {
 
+        // Allocation samples aren't part of the CPU or wallclock profiles
+        if (signum != SIGPROF && signum != SIGALRM) {
+            return;
+        }
+
         const bool isCpuSample = signum == SIGPROF;
         int numFrames = trace.num_frames;
         const bool isError = numFrames < 0;
@@ -276,26 +1084,12 @@ public:
             return;
         }
 
-        ProfileNode* node = root;
+        NodeIndex node = ROOT_NODE;
         for (int frameIndex = numFrames - 1; frameIndex >= NUMBER_OF_SIGNAL_HANDLER_FRAMES; frameIndex--) {
-            const uintptr_t pc = frames[frameIndex].frame;
-
-            auto it = node->pcToNode.find(pc);
-            if (it != node->pcToNode.end()) {
-                node = it->second;
-            } else {
-                const bool isForeign = frames[frameIndex].isForeign;
-
-                ProfileNode* newNode = new ProfileNode();
-                newNode->locations = lookup_locations(pc, isForeign);
-                newNode->count(isCpuSample) = 0;
-
-                node->pcToNode.insert({pc, newNode});
-                node = newNode;
-            }
-            node->seenInPhase = true;
+            const CallFrame& frame = frames[frameIndex];
+            node = tree->touchChild(node, frame.frame, frame.isForeign);
         }
-        node->count(isCpuSample)++;
+        tree->node(node).count(isCpuSample) += trace.weight;
     }
 
     // override
@@ -305,9 +1099,15 @@ public:
         // Deliberately Unused
     }
 
+    // override
+    virtual void recordThreadExit(int threadId) {
+        // Deliberately Unused
+    }
+
     // override
     virtual void
-    recordAllocation(uintptr_t allocationSize, bool outsideTlab, VMSymbol* symbol) {
+    recordAllocation(
+        uintptr_t allocationSize, uint32_t numberOfAllocations, bool outsideTlab, const CallFrame& site) {
         // Deliberately Unused
     }
 
@@ -319,12 +1119,14 @@ public:
 
     // override
     virtual void recordMetricInformation(const MetricInformation& metricInformation) {
-        // Deliberately Unused
+        record_metric_information(metricInformation);
     }
 
     // override
     virtual void recordMetricSamples(const long time_epoch_millis, const vector<MetricSample>& metricSamples) {
-        // Deliberately Unused
+        for (const MetricSample& sample : metricSamples) {
+            record_metric_sample(sample);
+        }
     }
 
     // override
@@ -341,8 +1143,7 @@ public:
 };
 
 QueueListener* prometheus_queue_listener() {
-    root = new ProfileNode();
-    root->reset();
+    tree = new ProfileTree(prunePhases);
 
     return new PrometheusQueueListener();
 }
@@ -0,0 +1,142 @@
+#include "runtime_lock_profiler.h"
+#include "log_linear_buckets.h"
+
+#include <algorithm>
+#include <atomic>
+#include <pthread.h>
+
+typedef LogLinearBuckets<3> WaitBuckets;
+
+static const string RUNTIME_LOCK_NAME = string("ocaml.runtime_lock");
+
+// The stack starts with record_runtime_lock_wait and the leave blocking section hook, then caml_leave_blocking_section
+static const int RUNTIME_LOCK_HOOK_FRAMES = 2;
+
+static const uint64_t NANOS_IN_MICRO = 1000;
+
+static CircularQueue* queue_ = nullptr;
+static std::atomic_bool enabled_(false);
+static uint64_t waitThresholdInNs_ = DEFAULT_RUNTIME_LOCK_WAIT_THRESHOLD_US * NANOS_IN_MICRO;
+
+// Waits are recorded by whichever thread has just reacquired the lock, on OCaml 5 threads of different domains can
+// record at once
+static std::atomic<uint64_t> waitCount_(0);
+static std::atomic<uint64_t> waitSumInNs_(0);
+static std::atomic<uint64_t> waitMaxInNs_(0);
+static std::atomic<uint64_t> waitBuckets_[WaitBuckets::NUMBER_OF_BUCKETS];
+
+void configure_runtime_lock_profiler(CircularQueue* queue, const bool enabled, const uint64_t waitThresholdInUs) {
+    queue_ = queue;
+    waitThresholdInNs_ = waitThresholdInUs * NANOS_IN_MICRO;
+    enabled_.store(enabled);
+}
+
+bool is_runtime_lock_profiling() {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+// Not inlined so that the number of frames to skip is fixed
+__attribute__((noinline)) void record_runtime_lock_wait(const uint64_t waitInNs) {
+    waitBuckets_[WaitBuckets::index(waitInNs)].fetch_add(1, std::memory_order_relaxed);
+    waitCount_.fetch_add(1, std::memory_order_relaxed);
+    waitSumInNs_.fetch_add(waitInNs, std::memory_order_relaxed);
+
+    uint64_t max = waitMaxInNs_.load(std::memory_order_relaxed);
+    while (waitInNs > max && !waitMaxInNs_.compare_exchange_weak(max, waitInNs, std::memory_order_relaxed)) {
+    }
+
+    if (waitInNs < waitThresholdInNs_ || queue_ == nullptr) {
+        return;
+    }
+
+    CallFrame frames[MAX_FRAMES];
+    ErrorHolder errorHolder;
+    errorHolder.errorCode = 0;
+    errorHolder.type = SUCCESS;
+
+    const int numFrames = linkable_handle(frames, &errorHolder);
+    if (errorHolder.type != SUCCESS || numFrames <= RUNTIME_LOCK_HOOK_FRAMES) {
+        return;
+    }
+
+    CallTrace trace;
+    trace.frames = frames + RUNTIME_LOCK_HOOK_FRAMES;
+    trace.num_frames = numFrames - RUNTIME_LOCK_HOOK_FRAMES;
+    trace.threadId = pthread_self();
+    // The wait in microseconds rather than a number of samples
+    trace.weight = (int) std::min(waitInNs / NANOS_IN_MICRO, (uint64_t) INT32_MAX);
+    queue_->pushStackTrace(trace, RUNTIME_LOCK_SIGNUM, 0, 0);
+}
+
+// ---- BEGIN Reader ----
+
+RuntimeLockReader::RuntimeLockReader(vector<string>& disabledPrefixes)
+  : enabled(false),
+    countHandle_(INVALID_METRIC_HANDLE),
+    sumHandle_(INVALID_METRIC_HANDLE),
+    maxHandle_(INVALID_METRIC_HANDLE),
+    p50Handle_(INVALID_METRIC_HANDLE),
+    p90Handle_(INVALID_METRIC_HANDLE),
+    p99Handle_(INVALID_METRIC_HANDLE),
+    buckets_(WaitBuckets::NUMBER_OF_BUCKETS, 0) {
+
+    updateEntryPrefixes(disabledPrefixes);
+}
+
+// Takes the tick's waits, a wait racing with this can have its count in one tick and its bucket in the next, so the
+// percentiles are ranked by the buckets actually taken
+void RuntimeLockReader::read(MetricDataListener& listener, const long timestampInMs) {
+    if (!enabled || !is_runtime_lock_profiling()) {
+        return;
+    }
+
+    const uint64_t count = waitCount_.exchange(0, std::memory_order_relaxed);
+    const uint64_t sum = waitSumInNs_.exchange(0, std::memory_order_relaxed);
+    const uint64_t max = waitMaxInNs_.exchange(0, std::memory_order_relaxed);
+
+    uint64_t bucketsCount = 0;
+    int minIndex = WaitBuckets::NUMBER_OF_BUCKETS;
+    int maxIndex = -1;
+    for (int index = 0; index < WaitBuckets::NUMBER_OF_BUCKETS; index++) {
+        if (waitBuckets_[index].load(std::memory_order_relaxed) != 0) {
+            const uint64_t bucketCount = waitBuckets_[index].exchange(0, std::memory_order_relaxed);
+            buckets_[index] = bucketCount;
+            bucketsCount += bucketCount;
+            minIndex = std::min(minIndex, index);
+            maxIndex = std::max(maxIndex, index);
+        }
+    }
+
+    listener.record(countHandle_, "ocaml.runtime_lock.wait.count", MetricUnit::EVENTS,
+                    MetricVariability::VARIABLE, (int64_t) count);
+    listener.record(sumHandle_, "ocaml.runtime_lock.wait.sum", MetricUnit::NANOSECONDS,
+                    MetricVariability::VARIABLE, (int64_t) sum);
+
+    if (bucketsCount > 0) {
+        const uint64_t* buckets = buckets_.data();
+        listener.record(maxHandle_, "ocaml.runtime_lock.wait.max", MetricUnit::NANOSECONDS,
+                        MetricVariability::VARIABLE, (int64_t) max);
+        listener.record(p50Handle_, "ocaml.runtime_lock.wait.p50", MetricUnit::NANOSECONDS,
+                        MetricVariability::VARIABLE,
+                        (int64_t) WaitBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.5));
+        listener.record(p90Handle_, "ocaml.runtime_lock.wait.p90", MetricUnit::NANOSECONDS,
+                        MetricVariability::VARIABLE,
+                        (int64_t) WaitBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.9));
+        listener.record(p99Handle_, "ocaml.runtime_lock.wait.p99", MetricUnit::NANOSECONDS,
+                        MetricVariability::VARIABLE,
+                        (int64_t) WaitBuckets::percentile(buckets, minIndex, maxIndex, bucketsCount, max, 0.99));
+
+        std::fill(buckets_.begin() + minIndex, buckets_.begin() + maxIndex + 1, 0);
+    }
+}
+
+void RuntimeLockReader::updateEntryPrefixes(vector<string>& disabledPrefixes) {
+    enabled = !isPrefixDisabled(RUNTIME_LOCK_NAME, disabledPrefixes);
+}
+
+const bool RuntimeLockReader::hasEmittedConstantMetrics() {
+    // There are no constant metrics
+    return true;
+}
+
+// ---- END Reader ----
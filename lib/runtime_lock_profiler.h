@@ -0,0 +1,56 @@
+#ifndef OPSIAN_RUNTIME_LOCK_PROFILER_H
+#define OPSIAN_RUNTIME_LOCK_PROFILER_H
+
+#include "globals.h"
+#include "circular_queue.h"
+#include "metric_types.h"
+
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// Runtime lock contention profiling. A thread leaving a blocking section has to reacquire the runtime lock, the
+// master lock on OCaml 4 or its domain's lock on OCaml 5, and the time it waits is invisible to CPU samples and
+// spread thinly across wallclock samples. When enabled, the leave blocking section hook in thread_state.cpp times
+// each reacquisition into a histogram, and waits over the threshold are sampled as RUNTIME_LOCK_WAIT stack samples
+// from the point where the thread reacquired the lock.
+
+// Runtime lock wait samples aren't taken in a signal handler, and are told apart from allocation samples by this
+static const int RUNTIME_LOCK_SIGNUM = -1;
+
+// Called before the profiler starts
+void configure_runtime_lock_profiler(CircularQueue* queue, const bool enabled, const uint64_t waitThresholdInUs);
+
+bool is_runtime_lock_profiling();
+
+// Called from the leave blocking section hook, on the thread that's just reacquired the runtime lock
+void record_runtime_lock_wait(const uint64_t waitInNs);
+
+// Emits the distribution of the tick's runtime lock waits
+class RuntimeLockReader {
+public:
+    RuntimeLockReader(vector<string>& disabledPrefixes);
+
+    void read(MetricDataListener& listener, const long timestampInMs);
+
+    void updateEntryPrefixes(vector<string>& disabledPrefixes);
+
+    const bool hasEmittedConstantMetrics();
+
+private:
+    bool enabled;
+
+    MetricHandle countHandle_;
+    MetricHandle sumHandle_;
+    MetricHandle maxHandle_;
+    MetricHandle p50Handle_;
+    MetricHandle p90Handle_;
+    MetricHandle p99Handle_;
+
+    vector<uint64_t> buckets_;
+
+    DISALLOW_COPY_AND_ASSIGN(RuntimeLockReader);
+};
+
+#endif // OPSIAN_RUNTIME_LOCK_PROFILER_H
@@ -110,3 +110,33 @@ struct sigaction SignalHandler::SetAction(
 
     return old_handler;
 }
+
+struct sigaction SignalHandler::SetAction(
+        const int signalNumber,
+        const sigset_t& maskedSignals,
+        void (*action)(int, siginfo_t *, void *)) {
+
+    struct sigaction sa;
+#ifdef __clang__
+    #pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdisabled-macro-expansion"
+#endif
+    sa.sa_handler = NULL;
+    sa.sa_sigaction = action;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+    sa.sa_mask = maskedSignals;
+
+    struct sigaction old_handler;
+
+    // Set the sigprof signal handler
+    if (sigaction(signalNumber, &sa, &old_handler) != 0) {
+        logError("Scheduling profiler action failed with error %d\n", errno);
+        return old_handler;
+    }
+
+    return old_handler;
+}
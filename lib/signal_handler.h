@@ -32,6 +32,8 @@ public:
 
     struct sigaction SetAction(int signalNumber, int maskedSignalNumber, int maskedSignalNumber2, void (*sigaction)(int, siginfo_t *, void *));
 
+    struct sigaction SetAction(int signalNumber, const sigset_t& maskedSignals, void (*sigaction)(int, siginfo_t *, void *));
+
     bool updateProcessInterval(int);
 
     bool stopProcessProfiling();
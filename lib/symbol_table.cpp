@@ -1,7 +1,12 @@
 #include "symbol_table.h"
 
+#include <algorithm>
+#include <atomic>
 #include <dlfcn.h>
+#include <limits.h>
 #include <link.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <unordered_set>
 #include <unordered_map>
 
@@ -20,6 +25,9 @@ unordered_map<uintptr_t, vector<Location>> knownAddrToLocations_;
 unordered_map<string, uint64_t> knownMethodToIds_;
 unordered_map<string, uint64_t> knownFileToIds_;
 
+// Cleared at exit, see disable_ocaml_locations
+std::atomic_bool ocamlLocationsEnabled_(true);
+
 // used in lib backtrace callbacks
 vector<Location>* currentLocations_;
 string currentSymbolName_;
@@ -32,10 +40,197 @@ void* data_ = nullptr;
 
 struct backtrace_state* btState_ = NULL;
 
+// The libbacktrace state used for the current lookup
+struct backtrace_state* currentState_ = NULL;
+
+// Executable segment of a loaded object (the main program, a shared library, a dlopen'd library or a .cmxs plugin)
+struct ObjectMapping {
+    uintptr_t start;
+    uintptr_t end;
+    string path;
+    // Objects loaded after the initial libbacktrace state was created are symbolized by a later state,
+    // libbacktrace doesn't pick up objects loaded after its first lookup
+    size_t generation;
+    // Used to detect unloaded objects
+    bool seenInRefresh;
+};
+
+// Sorted by start address
+vector<ObjectMapping> objectMappings_;
+// Generation 0 is symbolized by btState_, later generations by latestState_ which is lazily replaced when a lookup
+// needs an object loaded after it was created
+struct backtrace_state* latestState_ = NULL;
+size_t latestStateGeneration_ = 0;
+size_t extraStateCount_ = 0;
+// libbacktrace has no way of freeing a state and each new state re-reads every loaded object, so stop creating them
+// after this many. Objects loaded after that are named after their path.
+static const size_t MAX_EXTRA_BACKTRACE_STATES = 8;
+size_t currentGeneration_ = 0;
+bool hasScannedObjects_ = false;
+unsigned long long lastAdds_ = 0;
+unsigned long long lastSubs_ = 0;
+
 // ----------------
 // END STATE
 // ----------------
 
+// ----------------
+// BEGIN OBJECT MAPPINGS
+// ----------------
+
+struct RefreshState {
+    bool changed;
+    bool checkedCounters;
+    bool addedMapping;
+};
+
+// Supported by glibc since 2.4, but check the size as the callback info struct is versioned.
+bool hasLoadCounters(const size_t size) {
+    return size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(((struct dl_phdr_info*) 0)->dlpi_subs);
+}
+
+string mainProgramPath() {
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path));
+    return len > 0 ? string(path, len) : string("");
+}
+
+bool compareMappingStart(const ObjectMapping& mapping, const uintptr_t pc) {
+    return mapping.start < pc;
+}
+
+int onLoadedObject(struct dl_phdr_info* info, size_t size, void* data) {
+    RefreshState* state = (RefreshState*) data;
+
+    if (!state->checkedCounters) {
+        state->checkedCounters = true;
+
+        // The adds and subs counters are process wide, nothing has been loaded or unloaded since the last refresh
+        // so stop iterating.
+        if (hasLoadCounters(size)) {
+            if (hasScannedObjects_ && info->dlpi_adds == lastAdds_ && info->dlpi_subs == lastSubs_) {
+                return 1;
+            }
+
+            lastAdds_ = info->dlpi_adds;
+            lastSubs_ = info->dlpi_subs;
+        }
+
+        state->changed = true;
+    }
+
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)& header = info->dlpi_phdr[i];
+        if (header.p_type != PT_LOAD || (header.p_flags & PF_X) == 0) {
+            continue;
+        }
+
+        const uintptr_t start = info->dlpi_addr + header.p_vaddr;
+        auto it = std::lower_bound(objectMappings_.begin(), objectMappings_.end(), start, compareMappingStart);
+        if (it != objectMappings_.end() && it->start == start) {
+            it->seenInRefresh = true;
+            continue;
+        }
+
+        ObjectMapping mapping;
+        mapping.start = start;
+        mapping.end = start + header.p_memsz;
+        // The main program has an empty name
+        mapping.path = (info->dlpi_name == nullptr || info->dlpi_name[0] == '\0') ?
+            mainProgramPath() : string(info->dlpi_name);
+        mapping.generation = hasScannedObjects_ ? currentGeneration_ + 1 : 0;
+        mapping.seenInRefresh = true;
+        objectMappings_.insert(it, mapping);
+        state->addedMapping = true;
+
+        *debugLoggerSt_ << "New object mapping: " << mapping.path << ", generation=" << mapping.generation << endl;
+    }
+
+    return 0;
+}
+
+// Incrementally brings the object mappings up to date, existing mappings and their libbacktrace states are kept.
+void refreshObjectMappings() {
+    for (auto& mapping : objectMappings_) {
+        mapping.seenInRefresh = false;
+    }
+
+    RefreshState state = { false, false, false };
+    dl_iterate_phdr(onLoadedObject, &state);
+
+    if (!state.changed) {
+        return;
+    }
+
+    // Drop unloaded objects along with any cached symbols that pointed into them, their address range
+    // could be reused by the next object to be loaded.
+    auto removed = std::remove_if(objectMappings_.begin(), objectMappings_.end(),
+        [](const ObjectMapping& mapping) { return !mapping.seenInRefresh; });
+    for (auto it = removed; it != objectMappings_.end(); ++it) {
+        *debugLoggerSt_ << "Removed object mapping: " << it->path << endl;
+        for (auto addrIt = knownAddrToLocations_.begin(); addrIt != knownAddrToLocations_.end();) {
+            if (addrIt->first >= it->start && addrIt->first < it->end) {
+                addrIt = knownAddrToLocations_.erase(addrIt);
+            } else {
+                ++addrIt;
+            }
+        }
+    }
+    objectMappings_.erase(removed, objectMappings_.end());
+
+    if (state.addedMapping && hasScannedObjects_) {
+        currentGeneration_++;
+    }
+    hasScannedObjects_ = true;
+}
+
+const ObjectMapping* findMapping(const uintptr_t pc) {
+    auto it = std::upper_bound(objectMappings_.begin(), objectMappings_.end(), pc,
+        [](const uintptr_t value, const ObjectMapping& mapping) { return value < mapping.start; });
+    if (it == objectMappings_.begin()) {
+        return nullptr;
+    }
+
+    --it;
+    return pc < it->end ? &(*it) : nullptr;
+}
+
+// Finds the object for the pc, looking for newly loaded objects if it isn't one we know about
+const ObjectMapping* findOrRefreshMapping(const uintptr_t pc) {
+    const ObjectMapping* mapping = findMapping(pc);
+    if (mapping == nullptr) {
+        refreshObjectMappings();
+        mapping = findMapping(pc);
+    }
+    return mapping;
+}
+
+struct backtrace_state* stateForMapping(const ObjectMapping* mapping) {
+    if (mapping == nullptr || mapping->generation == 0) {
+        return btState_;
+    }
+
+    // One state covers every generation loaded before its first lookup, so a burst of dlopens shares a state
+    if (latestState_ != nullptr &&
+        (mapping->generation <= latestStateGeneration_ || extraStateCount_ >= MAX_EXTRA_BACKTRACE_STATES)) {
+        return latestState_;
+    }
+
+    // libbacktrace reads the loaded objects when it's first used, which is the lookup we're about to do
+    latestState_ = backtrace_create_state(nullptr, 0, error_callback_, data_);
+    latestStateGeneration_ = currentGeneration_;
+    extraStateCount_++;
+    if (extraStateCount_ == MAX_EXTRA_BACKTRACE_STATES) {
+        *debugLoggerSt_ << "Reached the limit of " << MAX_EXTRA_BACKTRACE_STATES
+                        << " symbolization states, later loaded objects won't have debug info" << endl;
+    }
+    return latestState_;
+}
+
+// ----------------
+// END OBJECT MAPPINGS
+// ----------------
+
 // ----------------
 // BEGIN CALLBACKS
 // ----------------
@@ -58,6 +253,47 @@ uint64_t recordFile(const string& fileName) {
     return fileId;
 }
 
+uint64_t recordFunction(const string& functionName, const uint64_t fileId) {
+    uint64_t functionId = 0;
+    auto it = knownMethodToIds_.find(functionName);
+    if (it != knownMethodToIds_.end()) {
+        functionId = it->second;
+    } else {
+        functionId = nextId_++;
+        knownMethodToIds_.insert({functionName, functionId});
+        if (newFunctionCallback_ != nullptr) {
+            newFunctionCallback_(data_, functionId, functionName, fileId);
+        }
+    }
+    return functionId;
+}
+
+void addLocation(
+    const uintptr_t pc,
+    const int lineNumber,
+    const string& fileName,
+    const uint64_t fileId,
+    string& functionName) {
+
+    // We don't know the function name
+    if (functionName.empty()) {
+        functionName = "Unknown";
+    }
+
+    const uint64_t functionId = recordFunction(functionName, fileId);
+
+    // Save the address information into the cache
+    Location location = {
+        functionId,
+        lineNumber,
+        fileName,
+        functionName
+    };
+    currentLocations_->push_back(location);
+
+    *debugLoggerSt_ << "PcInfo Lookup: pc=" << pc << ",func=" << functionName << ",file=" << fileName << endl;
+}
+
 // In C code we get the file name, line number and function name via this callback
 // In Ocaml code we get the line number and file name via this callback and the function name via symInfo
 int handlePcInfo (
@@ -86,55 +322,31 @@ int handlePcInfo (
         functionName = currentSymbolName_;
     }
 
-    // Other fallback: use dl - this can provide the binary file name for functions that don't have any debug symbols
+    // Other fallback: use the object the pc lives in - this provides the binary file name for functions that
+    // don't have any debug symbols
     if (functionName.empty() || fileId == 0) {
-        Dl_info dlInfo;
-        const int ret = dladdr((void*) pc, &dlInfo);
-        // not a typo - 0 means failure unlike everything else
-        if (ret != 0) {
+        const ObjectMapping* mapping = findOrRefreshMapping(pc);
+        if (mapping != nullptr) {
             if (functionName.empty()) {
-                if (dlInfo.dli_sname != NULL) {
+                // dladdr only knows about dynamic symbols so only try it when we know we've got nothing else
+                Dl_info dlInfo;
+                // not a typo - 0 means failure unlike everything else
+                if (dladdr((void*) pc, &dlInfo) != 0 && dlInfo.dli_sname != NULL) {
                     functionName = dlInfo.dli_sname;
-                } else if (dlInfo.dli_fname != NULL) {
-                    functionName.append("In ").append(dlInfo.dli_fname);
+                } else {
+                    functionName.append("In ").append(mapping->path);
                 }
             }
 
             // Use the binary name as the file name if it's missing
-            if (fileId == 0 && dlInfo.dli_fname != NULL) {
-                fileName = dlInfo.dli_fname;
+            if (fileId == 0 && !mapping->path.empty()) {
+                fileName = mapping->path;
                 fileId = recordFile(fileName);
             }
         }
     }
 
-    // We don't know the function name
-    if (functionName.empty()) {
-        functionName = "Unknown";
-    }
-
-    uint64_t functionId = 0;
-    auto it = knownMethodToIds_.find(functionName);
-    if (it != knownMethodToIds_.end()) {
-        functionId = it->second;
-    } else {
-        functionId = nextId_++;
-        knownMethodToIds_.insert({functionName, functionId});
-        if (newFunctionCallback_ != nullptr) {
-            newFunctionCallback_(data_, functionId, functionName, fileId);
-        }
-    }
-
-    // Save the address information into the cache
-    Location location = {
-        functionId,
-        lineNumber,
-        fileName,
-        functionName
-    };
-    currentLocations_->push_back(location);
-
-    *debugLoggerSt_ << "PcInfo Lookup: pc=" << pc << ",func=" << functionName << ",file=" << fileName << endl;
+    addLocation(pc, lineNumber, fileName, fileId, functionName);
 
     return 0;
 }
@@ -167,6 +379,56 @@ void handleSyminfo (
 // END CALLBACKS
 // ----------------
 
+static const char* const DUNE_MODULE_PREFIX = "Dune__exe__";
+static const size_t DUNE_MODULE_PREFIX_LEN = 11;
+
+// OCaml frames carry their own debuginfo in the frame descriptors, which is cheaper to decode than dwarf and
+// gives every function in an inlined chain a name, rather than just the outermost symbol.
+// Returns false if there's no debuginfo for this pc, eg: it's not a call site or was compiled without -g.
+bool lookupOcamlLocations(const uintptr_t pc) {
+    if (!ocamlLocationsEnabled_) {
+        return false;
+    }
+
+    OcamlLocation ocamlLocations[MAX_OCAML_LOCATIONS];
+    const int numLocations = linkable_ocaml_locations(pc, ocamlLocations, MAX_OCAML_LOCATIONS);
+    if (numLocations == 0) {
+        return false;
+    }
+
+    string fileName;
+    string functionName;
+    for (int i = 0; i < numLocations; i++) {
+        const OcamlLocation& ocamlLocation = ocamlLocations[i];
+
+        uint64_t fileId = 0;
+        fileName.clear();
+        if (ocamlLocation.fileName != NULL) {
+            fileName = ocamlLocation.fileName;
+            fileId = recordFile(fileName);
+        }
+
+        functionName.clear();
+        if (ocamlLocation.functionName != NULL) {
+            const char* name = ocamlLocation.functionName;
+            if (strncmp(name, DUNE_MODULE_PREFIX, DUNE_MODULE_PREFIX_LEN) == 0) {
+                name += DUNE_MODULE_PREFIX_LEN;
+            }
+            functionName = name;
+        } else if (i == numLocations - 1) {
+            // Older compilers don't record function names in debuginfo, fallback to the symbol
+            // of the outermost function
+            currentSymbolName_.clear();
+            backtrace_syminfo(currentState_, pc, handleSyminfo, error_callback_, nullptr);
+            functionName = currentSymbolName_;
+        }
+
+        addLocation(pc, ocamlLocation.lineNumber, fileName, fileId, functionName);
+    }
+
+    return true;
+}
+
 // ----------------
 // BEGIN PUBLIC API
 // ----------------
@@ -187,6 +449,8 @@ void init_symbols(
     // Only init these once, but record the last set of initialized callbacks
     if (btState_ == nullptr) {
         btState_ = backtrace_create_state(nullptr, 0, error_callback_, data_);
+        // Everything loaded at this point is symbolized by btState_
+        refreshObjectMappings();
     }
 }
 
@@ -199,16 +463,19 @@ vector<Location>& lookup_locations(const uintptr_t pc, const bool isForeign) {
         // Looked the symbol information from dwarf
         currentLocations_ = new vector<Location>();
         currentSymbolName_.clear();
+        currentState_ = stateForMapping(findOrRefreshMapping(pc));
+
+        if (isForeign || !lookupOcamlLocations(pc)) {
+            if (!isForeign) {
+                // Ocaml's dwarf function names don't appear to identified using backtrace_pcinfo, not sure why
+                // So we use backtrace_syminfo to identify them. NB: this only appears to provide a single symbol
+                // in the case of inlined functions.
+                backtrace_syminfo(currentState_, pc, handleSyminfo, error_callback_, nullptr);
+            }
 
-        if (!isForeign) {
-            // Ocaml's dwarf function names don't appear to identified using backtrace_pcinfo, not sure why
-            // So we use backtrace_syminfo to identify them. NB: this only appears to provide a single symbol
-            // in the case of inlined functions.
-            backtrace_syminfo(btState_, pc, handleSyminfo, error_callback_, nullptr);
+            backtrace_pcinfo(currentState_, pc, handlePcInfo, error_callback_, nullptr);
         }
 
-        backtrace_pcinfo(btState_, pc, handlePcInfo, error_callback_, nullptr);
-
         knownAddrToLocations_.insert({pc, *currentLocations_});
         return *currentLocations_;
     }
@@ -220,6 +487,53 @@ void clear_symbols() {
     knownFileToIds_.clear();
 }
 
+void disable_ocaml_locations() {
+    ocamlLocationsEnabled_ = false;
+}
+
+// The runtime functions that start each phase, across OCaml 4.14 and 5. Static functions are listed as well as their
+// callers in case the callers have been inlined.
+static const unordered_map<string, GcPhase> gcEntryPoints_ = {
+    {"caml_empty_minor_heap", GC_PHASE_MINOR},
+    {"caml_empty_minor_heaps_once", GC_PHASE_MINOR},
+    {"caml_stw_empty_minor_heap", GC_PHASE_MINOR},
+    {"caml_stw_empty_minor_heap_no_major_slice", GC_PHASE_MINOR},
+    {"caml_empty_minor_heap_promote", GC_PHASE_MINOR},
+    {"caml_major_collection_slice", GC_PHASE_MAJOR_SLICE},
+    {"caml_opportunistic_major_collection_slice", GC_PHASE_MAJOR_SLICE},
+    {"major_collection_slice", GC_PHASE_MAJOR_SLICE},
+    {"caml_finish_major_cycle", GC_PHASE_MAJOR_SLICE},
+    {"caml_compact_heap", GC_PHASE_COMPACTION},
+    {"caml_compact_heap_maybe", GC_PHASE_COMPACTION},
+    {"do_compaction", GC_PHASE_COMPACTION}
+};
+
+GcPhase gc_phase_of_frame(const vector<Location>& locations, const GcPhase outerPhase) {
+    GcPhase phase = outerPhase;
+    // Inlined functions are ordered innermost first
+    for (auto it = locations.rbegin(); it != locations.rend(); ++it) {
+        auto entryPoint = gcEntryPoints_.find(it->functionName);
+        if (entryPoint != gcEntryPoints_.end()) {
+            phase = entryPoint->second;
+        }
+    }
+
+    return phase;
+}
+
+const char* gc_phase_name(const GcPhase phase) {
+    switch (phase) {
+        case GC_PHASE_MINOR:
+            return "minor";
+        case GC_PHASE_MAJOR_SLICE:
+            return "major_slice";
+        case GC_PHASE_COMPACTION:
+            return "compaction";
+        default:
+            return "mutator";
+    }
+}
+
 // ----------------
 // END PUBLIC API
 // ----------------
@@ -41,4 +41,27 @@ vector<Location>& lookup_locations(const uintptr_t pc, const bool isForeign);
 
 void clear_symbols();
 
+// Stops decoding OCaml debuginfo, which takes the runtime lock, and falls back to dwarf. Called at exit, when the main
+// thread holds the runtime lock whilst it joins the processor thread.
+void disable_ocaml_locations();
+
+// The GC work a sample was taken in, the values match data.proto's GcPhase
+enum GcPhase {
+    GC_PHASE_MUTATOR = 0,
+    GC_PHASE_MINOR = 1,
+    GC_PHASE_MAJOR_SLICE = 2,
+    GC_PHASE_COMPACTION = 3,
+    NUMBER_OF_GC_PHASES
+};
+
+// Identifies the phase from the runtime's GC entry points on the stack, which are a consistent snapshot of what the
+// thread was doing when the signal arrived, unlike runtime state that's only updated at phase boundaries. Returns
+// the phase entered by a frame with these locations, or outerPhase if the frame isn't a GC entry point. Stacks are
+// classified from their outermost frame inwards so that the innermost phase wins, eg: a compaction within a major
+// slice.
+GcPhase gc_phase_of_frame(const vector<Location>& locations, const GcPhase outerPhase);
+
+// Lower case, used as a label value
+const char* gc_phase_name(const GcPhase phase);
+
 #endif //OPSIAN_OCAML_SYMBOL_TABLE_H
@@ -0,0 +1,116 @@
+#include "thread_hooks.h"
+#include "proc_scanner.h"
+
+#include <atomic>
+#include <dlfcn.h>
+#include <errno.h>
+#include <new>
+#include <pthread.h>
+#include <sys/prctl.h>
+
+typedef int (*PthreadCreate)(pthread_t*, const pthread_attr_t*, void* (*)(void*), void*);
+typedef int (*PthreadSetnameNp)(pthread_t, const char*);
+
+// Linux limits thread names to 16 bytes, including the terminator
+static const int THREAD_NAME_SIZE = 16;
+
+static std::atomic<CircularQueue*> queue_(nullptr);
+
+// Resolved on first use, threads can be started before static initialization has finished
+static PthreadCreate realPthreadCreate() {
+    static PthreadCreate real = (PthreadCreate) dlsym(RTLD_NEXT, "pthread_create");
+    return real;
+}
+
+static PthreadSetnameNp realPthreadSetnameNp() {
+    static PthreadSetnameNp real = (PthreadSetnameNp) dlsym(RTLD_NEXT, "pthread_setname_np");
+    return real;
+}
+
+void init_thread_hooks(CircularQueue* queue) {
+    queue_.store(queue);
+    enable_thread_hooks();
+}
+
+// ---- BEGIN Thread Lifecycle ----
+
+struct ThreadStart {
+    void* (*routine)(void*);
+    void* arg;
+};
+
+static void onThreadExit(void* arg) {
+    on_thread_exit(getTid());
+
+    CircularQueue* queue = queue_.load();
+    if (queue != nullptr) {
+        queue->pushThreadExit((int) pthread_self());
+    }
+}
+
+static void* startThread(void* arg) {
+    const ThreadStart start = *static_cast<ThreadStart*>(arg);
+    delete static_cast<ThreadStart*>(arg);
+
+    on_thread_start(getTid());
+
+    // A new thread has its creator's name until it sets its own
+    CircularQueue* queue = queue_.load();
+    char name[THREAD_NAME_SIZE] = {0};
+    if (queue != nullptr && prctl(PR_GET_NAME, name) == 0) {
+        queue->pushThread(name, (int) pthread_self());
+    }
+
+    // Also run if the thread calls pthread_exit or is cancelled
+    void* result;
+    pthread_cleanup_push(onThreadExit, nullptr);
+    result = start.routine(start.arg);
+    pthread_cleanup_pop(1);
+
+    return result;
+}
+
+// ---- END Thread Lifecycle ----
+
+// ---- BEGIN Interposed Functions ----
+
+extern "C" int pthread_create(
+    pthread_t* thread,
+    const pthread_attr_t* attr,
+    void* (*routine)(void*),
+    void* arg) noexcept {
+
+    const PthreadCreate real = realPthreadCreate();
+    if (real == nullptr) {
+        return EAGAIN;
+    }
+
+    ThreadStart* start = new (std::nothrow) ThreadStart{routine, arg};
+    if (start == nullptr) {
+        return real(thread, attr, routine, arg);
+    }
+
+    const int result = real(thread, attr, &startThread, start);
+    if (result != 0) {
+        delete start;
+    }
+
+    return result;
+}
+
+extern "C" int pthread_setname_np(pthread_t thread, const char* name) noexcept {
+    const PthreadSetnameNp real = realPthreadSetnameNp();
+    if (real == nullptr) {
+        return ENOSYS;
+    }
+
+    const int result = real(thread, name);
+    CircularQueue* queue = queue_.load();
+    if (result == 0 && queue != nullptr) {
+        queue->pushThread(name, (int) thread);
+    }
+
+    return result;
+}
+
+// ---- END Interposed Functions ----
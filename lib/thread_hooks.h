@@ -0,0 +1,14 @@
+#ifndef OPSIAN_THREAD_HOOKS_H
+#define OPSIAN_THREAD_HOOKS_H
+
+#include "circular_queue.h"
+
+// pthread_create and pthread_setname_np are interposed so that threads are registered with the /proc scanner as
+// they start, which arms their timers straight away rather than on the next scan, and unregistered as they exit,
+// which deletes their timers. Thread names are sent as they're set rather than read from /proc for each new thread.
+// OCaml's Thread and Domain modules start their threads with pthread_create, so are covered along with C threads.
+
+// Called once the agent has initialized, the hooks only call through to libc until then
+void init_thread_hooks(CircularQueue* queue);
+
+#endif // OPSIAN_THREAD_HOOKS_H
@@ -0,0 +1,112 @@
+#include "thread_state.h"
+#include "runtime_lock_profiler.h"
+
+#include <time.h>
+
+extern "C" {
+
+#include "misc.h"
+
+#include <caml/mlvalues.h>
+#include <caml/signals.h>
+}
+
+// Below this fraction of the wallclock time since the previous sample on CPU the thread counts as idle
+static const double IDLE_CPU_RATIO = 0.1;
+
+static const uint64_t NANOS_IN_SECOND = 1000000000;
+
+// Initial exec so that reading them in a signal handler never allocates
+#define SIGNAL_SAFE_TLS __thread __attribute__((tls_model("initial-exec")))
+
+static SIGNAL_SAFE_TLS int blockingState_ = THREAD_STATE_RUNNING;
+static SIGNAL_SAFE_TLS uint64_t previousCpuTimeInNs_ = 0;
+static SIGNAL_SAFE_TLS uint64_t previousWallclockTimeInNs_ = 0;
+static SIGNAL_SAFE_TLS uint32_t offCpuSamplesUntilKept_ = 0;
+
+static bool installedHooks_ = false;
+static void (*previousEnterBlockingSectionHook_)(void) = nullptr;
+static void (*previousLeaveBlockingSectionHook_)(void) = nullptr;
+
+static uint64_t nowInNs(const clockid_t clock) {
+    timespec now;
+    if (clock_gettime(clock, &now) != 0) {
+        return 0;
+    }
+
+    return now.tv_sec * NANOS_IN_SECOND + now.tv_nsec;
+}
+
+// ---- BEGIN Blocking Section Hooks ----
+
+// The Thread module's hooks release and reacquire the runtime lock
+static void enterBlockingSection() {
+    blockingState_ = THREAD_STATE_BLOCKED;
+    if (previousEnterBlockingSectionHook_ != nullptr) {
+        previousEnterBlockingSectionHook_();
+    }
+}
+
+static void leaveBlockingSection() {
+    blockingState_ = THREAD_STATE_WAITING_FOR_RUNTIME_LOCK;
+    if (is_runtime_lock_profiling()) {
+        const uint64_t waitStartInNs = nowInNs(CLOCK_MONOTONIC);
+        if (previousLeaveBlockingSectionHook_ != nullptr) {
+            previousLeaveBlockingSectionHook_();
+        }
+        // Before the state changes, so that the call isn't a tail call and this frame is on the sampled stack
+        record_runtime_lock_wait(nowInNs(CLOCK_MONOTONIC) - waitStartInNs);
+    } else if (previousLeaveBlockingSectionHook_ != nullptr) {
+        previousLeaveBlockingSectionHook_();
+    }
+    blockingState_ = THREAD_STATE_RUNNING;
+}
+
+void install_thread_state_hooks() {
+    if (installedHooks_) {
+        return;
+    }
+    installedHooks_ = true;
+
+    previousEnterBlockingSectionHook_ = caml_enter_blocking_section_hook;
+    previousLeaveBlockingSectionHook_ = caml_leave_blocking_section_hook;
+    caml_enter_blocking_section_hook = enterBlockingSection;
+    caml_leave_blocking_section_hook = leaveBlockingSection;
+}
+
+// ---- END Blocking Section Hooks ----
+
+ThreadState capture_thread_state() {
+    const uint64_t cpuTimeInNs = nowInNs(CLOCK_THREAD_CPUTIME_ID);
+    const uint64_t wallclockTimeInNs = nowInNs(CLOCK_MONOTONIC);
+    const uint64_t cpuDeltaInNs = cpuTimeInNs - previousCpuTimeInNs_;
+    const uint64_t wallclockDeltaInNs = wallclockTimeInNs - previousWallclockTimeInNs_;
+    const bool hasPrevious = previousWallclockTimeInNs_ != 0;
+    previousCpuTimeInNs_ = cpuTimeInNs;
+    previousWallclockTimeInNs_ = wallclockTimeInNs;
+
+    const ThreadState blockingState = static_cast<ThreadState>(blockingState_);
+    if (blockingState != THREAD_STATE_RUNNING) {
+        return blockingState;
+    }
+
+    if (hasPrevious && wallclockDeltaInNs > 0 && cpuDeltaInNs < wallclockDeltaInNs * IDLE_CPU_RATIO) {
+        return THREAD_STATE_IDLE;
+    }
+
+    return THREAD_STATE_RUNNING;
+}
+
+bool keep_off_cpu_sample(const uint32_t ratio) {
+    if (ratio == 0) {
+        return false;
+    }
+
+    if (offCpuSamplesUntilKept_ == 0) {
+        offCpuSamplesUntilKept_ = ratio - 1;
+        return true;
+    }
+
+    offCpuSamplesUntilKept_--;
+    return false;
+}
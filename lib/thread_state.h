@@ -0,0 +1,35 @@
+#ifndef OPSIAN_THREAD_STATE_H
+#define OPSIAN_THREAD_STATE_H
+
+#include <stdint.h>
+
+// What a thread was doing when a wallclock sample was taken, sent as StackSample.thread_state. OCaml threads mark
+// their blocking sections through the runtime's hooks, other off-CPU time is inferred from the thread's CPU time
+// since its previous sample.
+enum ThreadState {
+    // Not captured
+    THREAD_STATE_UNKNOWN = 0,
+    THREAD_STATE_RUNNING = 1,
+    // In a blocking section, eg: a system call that released the runtime lock
+    THREAD_STATE_BLOCKED = 2,
+    // Leaving a blocking section, waiting to reacquire the runtime lock
+    THREAD_STATE_WAITING_FOR_RUNTIME_LOCK = 3,
+    // Mostly off-CPU since its previous sample outside of a blocking section, eg: a C thread parked in epoll_wait
+    THREAD_STATE_IDLE = 4
+};
+
+// Called on an OCaml thread with the runtime lock held, after the Thread module has been initialized, as it replaces
+// the blocking section hooks rather than chaining them
+void install_thread_state_hooks();
+
+// Async signal safe, called in the signal handler on the sampled thread
+ThreadState capture_thread_state();
+
+inline bool is_off_cpu(const ThreadState state) {
+    return state == THREAD_STATE_BLOCKED || state == THREAD_STATE_IDLE;
+}
+
+// Async signal safe, keeps one in every ratio of the thread's off-CPU samples, 0 keeps none
+bool keep_off_cpu_sample(const uint32_t ratio);
+
+#endif // OPSIAN_THREAD_STATE_H
@@ -0,0 +1,169 @@
+#include "wallclock_sampler.h"
+#include "globals.h"
+#include "proc_scanner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using std::vector;
+
+static const char* const WALLCLOCK_SAMPLER_THREAD_NAME = "Opsian Wallclock";
+static const uint64_t NANOS_IN_SECOND = 1000000000;
+
+uint32_t signalBudgetPerSecond_ = 0;
+
+// Guards threads_ and threadsVersion_. A pointer so that it can be replaced in a forked child, where the sampler
+// thread may have been holding it.
+boost::mutex* samplerMutex_ = new boost::mutex();
+vector<pid_t> threads_{};
+uint64_t threadsVersion_ = 0;
+
+std::atomic_uint64_t intervalInNs_(0);
+pthread_t samplerThread_{};
+std::atomic_bool samplerRunning_(false);
+std::atomic_bool registeredSamplerExit_(false);
+
+void configure_wallclock_sampler(const uint32_t signalBudgetPerSecond) {
+    signalBudgetPerSecond_ = signalBudgetPerSecond;
+}
+
+bool is_wallclock_sampler_configured() {
+    return signalBudgetPerSecond_ > 0;
+}
+
+// ---- BEGIN Sampler Thread ----
+
+// Like tgkill, but queues the sample's weight with the signal for the handler to read from its siginfo_t
+static void signalThread(const pid_t pid, const pid_t tid, const int weight) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = SIGALRM;
+    info.si_code = SI_QUEUE;
+    info.si_pid = pid;
+    info.si_uid = getuid();
+    info.si_value.sival_int = weight;
+
+    // ESRCH is a thread that's exited since the last scan, which the next scan removes
+    if (syscall(SYS_rt_tgsigqueueinfo, pid, tid, SIGALRM, &info) != 0 && errno != ESRCH) {
+        logError("rt_tgsigqueueinfo error: %s", strerror(errno));
+    }
+}
+
+static void addNs(timespec& time, const uint64_t durationInNs) {
+    const uint64_t nanos = time.tv_nsec + durationInNs;
+    time.tv_sec += nanos / NANOS_IN_SECOND;
+    time.tv_nsec = nanos % NANOS_IN_SECOND;
+}
+
+void* runWallclockSampler(void* arg) {
+    // Avoid having the sampler thread also receive the PROF signals
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPROF);
+    sigaddset(&mask, SIGALRM);
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) < 0) {
+        logError("ERROR: failed to set wallclock sampler thread signal mask\n");
+    }
+
+    on_sampler_thread_start();
+
+    const pid_t pid = getpid();
+    vector<pid_t> threads;
+    uint64_t threadsVersion = 0;
+    uint64_t tick = 0;
+
+    timespec nextTick {0};
+    clock_gettime(CLOCK_MONOTONIC, &nextTick);
+
+    while (samplerRunning_) {
+        {
+            boost::lock_guard<boost::mutex> guard(*samplerMutex_);
+            if (threadsVersion != threadsVersion_) {
+                threads = threads_;
+                threadsVersion = threadsVersion_;
+            }
+        }
+
+        const uint64_t intervalInNs = std::max((uint64_t) 1, intervalInNs_.load());
+        // A budget below one signal per interval stretches the tick to a whole number of intervals instead, so that
+        // the budget's kept and each sample stands for every interval of its tick
+        const uint64_t signalsPerSecondAtInterval = signalBudgetPerSecond_ * intervalInNs;
+        const uint64_t intervalsPerTick = signalsPerSecondAtInterval < NANOS_IN_SECOND
+            ? (NANOS_IN_SECOND + signalsPerSecondAtInterval - 1) / signalsPerSecondAtInterval
+            : 1;
+        const uint64_t tickInNs = intervalInNs * intervalsPerTick;
+        const size_t signalsPerTick =
+            std::max((uint64_t) 1, (signalBudgetPerSecond_ * tickInNs) / NANOS_IN_SECOND);
+        const size_t stride = std::max((size_t) 1, (threads.size() + signalsPerTick - 1) / signalsPerTick);
+        const int weight = (int) std::min((uint64_t) INT32_MAX, stride * intervalsPerTick);
+
+        for (size_t index = tick % stride; index < threads.size(); index += stride) {
+            signalThread(pid, threads[index], weight);
+        }
+        tick++;
+
+        // Scheduled from the previous tick rather than from now so that signalling doesn't stretch the interval
+        addNs(nextTick, tickInNs);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &nextTick, nullptr);
+    }
+
+    on_sampler_thread_stop();
+
+    return nullptr;
+}
+
+// ---- END Sampler Thread ----
+
+void start_wallclock_sampler(const uint64_t interval_in_ns) {
+    intervalInNs_.store(interval_in_ns);
+    if (samplerRunning_) {
+        return;
+    }
+
+    if (!registeredSamplerExit_.exchange(true)) {
+        atexit(stop_wallclock_sampler);
+    }
+
+    samplerRunning_ = true;
+    int result = pthread_create(&samplerThread_, nullptr, &runWallclockSampler, nullptr);
+    if (result) {
+        logError("ERROR: failed to start wallclock sampler thread %d\n", result);
+        samplerRunning_ = false;
+        return;
+    }
+
+    pthread_setname_np(samplerThread_, WALLCLOCK_SAMPLER_THREAD_NAME);
+}
+
+void stop_wallclock_sampler() {
+    // Called from both the atexit handler and the metrics thread, only one of them joins the sampler thread
+    if (samplerRunning_.exchange(false)) {
+        int result = pthread_join(samplerThread_, nullptr);
+        if (result) {
+            logError("ERROR: failed to join wallclock sampler thread %d\n", result);
+        }
+    }
+}
+
+void update_wallclock_sampler_threads(const std::unordered_set<pid_t>& threads) {
+    boost::lock_guard<boost::mutex> guard(*samplerMutex_);
+    threads_.assign(threads.begin(), threads.end());
+    // Sorted so that a thread's place in the rotation only shifts when threads before it come or go
+    std::sort(threads_.begin(), threads_.end());
+    threadsVersion_++;
+}
+
+void on_fork_wallclock_sampler() {
+    // The sampler thread doesn't exist in the child, it's restarted when wallclock profiling is
+    samplerMutex_ = new boost::mutex();
+    samplerRunning_ = false;
+    threads_.clear();
+    threadsVersion_++;
+}
@@ -0,0 +1,34 @@
+#ifndef OPSIAN_WALLCLOCK_SAMPLER_H
+#define OPSIAN_WALLCLOCK_SAMPLER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <unordered_set>
+
+// An alternative to a wallclock timer per thread, for processes with thousands of threads where the signal rate and
+// the kernel's timer cost would grow with the thread count. A sampler thread signals a rotating subset of the threads
+// on each tick, bounded by a budget of signals per second. On each tick one of every stride threads is signalled, so
+// each thread is sampled once every stride ticks and its samples are weighted by the stride to keep totals unbiased.
+// A budget of fewer signals per second than ticks stretches the tick to several intervals, which the weight includes.
+
+// Called before profiling starts, a budget of 0 leaves wallclock sampling to the per-thread timers
+void configure_wallclock_sampler(const uint32_t signalBudgetPerSecond);
+bool is_wallclock_sampler_configured();
+
+// -------------------
+//   Metrics Thread
+// -------------------
+
+// Starts the sampler thread or updates its interval
+void start_wallclock_sampler(const uint64_t interval_in_ns);
+void stop_wallclock_sampler();
+// The threads to sample, called after each /proc scan
+void update_wallclock_sampler_threads(const std::unordered_set<pid_t>& threads);
+
+// -------------------
+//   Fork Thread
+// -------------------
+
+void on_fork_wallclock_sampler();
+
+#endif //OPSIAN_WALLCLOCK_SAMPLER_H